@@ -1,17 +1,25 @@
 #include <iostream>
-#include <cassert>
+#include <fstream>
+#include <cstdint>
+#include <cctype>
+#include <algorithm>
 #include "Image.h"
+#include "WorkStealingPool.h"
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
 using namespace std;
 
-Image::Image(int w, int h) :
+Image::Image(int w, int h, bool hasLinear) :
 	width(w),
 	height(h),
 	comp(3),
-	pixels(width*height*comp, 0)
+	pixels(width*height*comp, 0),
+	linear(hasLinear ? width*height*comp : 0, 0.0f),
+	dropped(0),
+	firstDroppedX(0),
+	firstDroppedY(0)
 {
 }
 
@@ -24,13 +32,9 @@ void Image::setPixel(int x, int y, unsigned char r, unsigned char g, unsigned ch
 	// The pixel data is laid out row by row. Each row consists of 'width'
 	// columns, and each column consists of 3 unsigned chars.
 
-	// First check for bounds
-	if(y < 0 || y >= height) {
-		cout << "Row " << y << " is out of bounds" << endl;
-		return;
-	}
-	if(x < 0 || x >= width) {
-		cout << "Col " << x << " is out of bounds" << endl;
+	// First check for bounds; one unsigned compare covers both ends.
+	if(static_cast<unsigned>(x) >= static_cast<unsigned>(width) || static_cast<unsigned>(y) >= static_cast<unsigned>(height)) {
+		drop(x, y, 1);
 		return;
 	}
 
@@ -40,22 +44,215 @@ void Image::setPixel(int x, int y, unsigned char r, unsigned char g, unsigned ch
 	// index corresponding to row and col, (assuming single component image)
 	int index = y*width + x;
 	// Multiply by 3 to get the index for the rgb components.
-	assert(index >= 0);
-	assert(3*index + 2 < (int)pixels.size());
 	pixels[3*index + 0] = r;
 	pixels[3*index + 1] = g;
 	pixels[3*index + 2] = b;
+	if(!linear.empty()) {
+		linear[3*index + 0] = r / 255.0f;
+		linear[3*index + 1] = g / 255.0f;
+		linear[3*index + 2] = b / 255.0f;
+	}
+}
+
+void Image::setLinear(int x, int y, float r, float g, float b)
+{
+	if(linear.empty()) {
+		return;
+	}
+	if(static_cast<unsigned>(x) >= static_cast<unsigned>(width) || static_cast<unsigned>(y) >= static_cast<unsigned>(height)) {
+		drop(x, y, 1);
+		return;
+	}
+	int index = (height - y - 1)*width + x;
+	linear[3*index + 0] = r;
+	linear[3*index + 1] = g;
+	linear[3*index + 2] = b;
+}
+
+void Image::drop(int x, int y, size_t count)
+{
+	// Only the first writer sees zero, so only it records the position.
+	if(dropped.fetch_add(count) == 0) {
+		firstDroppedX = x;
+		firstDroppedY = y;
+	}
+}
+
+// Trims the span [x, x + count) on row y to the image, dropping the rest.
+// skip is how many pixels were cut from the left. False when nothing is left.
+bool Image::clip(int& x, int y, int& count, int& skip)
+{
+	skip = 0;
+	if(count <= 0) {
+		return false;
+	}
+	if(static_cast<unsigned>(y) >= static_cast<unsigned>(height)) {
+		drop(x, y, count);
+		return false;
+	}
+	int x0 = max(x, 0);
+	int x1 = static_cast<int>(min(static_cast<long long>(x) + count, static_cast<long long>(width)));
+	if(x1 - x0 != count) {
+		drop(x < 0 ? x : width, y, count - max(x1 - x0, 0));
+	}
+	if(x1 <= x0) {
+		return false;
+	}
+	skip = x0 - x;
+	x = x0;
+	count = x1 - x0;
+	return true;
+}
+
+void Image::setSpan(int x, int y, int count, const unsigned char* rgb)
+{
+	int skip;
+	if(!clip(x, y, count, skip)) {
+		return;
+	}
+	size_t index = 3*(static_cast<size_t>(height - y - 1)*width + x);
+	rgb += 3*skip;
+	copy(rgb, rgb + 3*count, &pixels[index]);
+	if(!linear.empty()) {
+		for(int i = 0; i < 3*count; ++i) {
+			linear[index + i] = rgb[i] / 255.0f;
+		}
+	}
+}
+
+void Image::setLinearSpan(int x, int y, int count, const float* rgb)
+{
+	int skip;
+	if(linear.empty() || !clip(x, y, count, skip)) {
+		return;
+	}
+	size_t index = 3*(static_cast<size_t>(height - y - 1)*width + x);
+	rgb += 3*skip;
+	copy(rgb, rgb + 3*count, &linear[index]);
+}
+
+unsigned char* Image::getRow(int y)
+{
+	if(static_cast<unsigned>(y) >= static_cast<unsigned>(height)) {
+		drop(0, y, width);
+		return nullptr;
+	}
+	return &pixels[3*static_cast<size_t>(height - y - 1)*width];
+}
+
+float* Image::getLinearRow(int y)
+{
+	if(linear.empty()) {
+		return nullptr;
+	}
+	if(static_cast<unsigned>(y) >= static_cast<unsigned>(height)) {
+		drop(0, y, width);
+		return nullptr;
+	}
+	return &linear[3*static_cast<size_t>(height - y - 1)*width];
+}
+
+bool Image::reportDropped(ostream& out) const
+{
+	size_t count = dropped.load();
+	if(count == 0) {
+		return true;
+	}
+	out << count << " pixel writes fell outside the " << width << "x" << height << " image and were dropped, the first at (" << firstDroppedX << ", " << firstDroppedY << ")" << endl;
+	return false;
+}
+
+static string extension_of(const string &filename)
+{
+	size_t dot = filename.find_last_of('.');
+	string ext = dot == string::npos ? "" : filename.substr(dot);
+	transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return static_cast<char>(tolower(c)); });
+	return ext;
+}
+
+bool Image::isFloatFormat(const string &filename)
+{
+	string ext = extension_of(filename);
+	return ext == ".pfm" || ext == ".hdr";
+}
+
+// Portable float map: a text header, then little- or big-endian floats as
+// the sign of the scale says, bottom row first.
+static bool write_pfm(const string &filename, int width, int height, const float* rgb)
+{
+	const uint16_t probe = 1;
+	bool little = *reinterpret_cast<const unsigned char*>(&probe) == 1;
+	ofstream out(filename, ios::binary | ios::trunc);
+	out << "PF\n" << width << " " << height << "\n" << (little ? "-1.0" : "1.0") << "\n";
+	for(int y = height - 1; y >= 0; --y) {
+		out.write(reinterpret_cast<const char*>(rgb + 3*y*width), 3*width*sizeof(float));
+	}
+	return static_cast<bool>(out);
+}
+
+static bool write_bytes(const string &filename, const string &header, const vector<unsigned char> &pixels)
+{
+	ofstream out(filename, ios::binary | ios::trunc);
+	out << header;
+	out.write(reinterpret_cast<const char*>(pixels.data()), pixels.size());
+	return static_cast<bool>(out);
+}
+
+static bool write_png(const string &filename, int width, int height, const unsigned char* pixels, PngLevel level, WorkStealingPool* pool)
+{
+	vector<unsigned char> png;
+	encode_png(width, height, pixels, level, pool, png);
+	ofstream out(filename, ios::binary | ios::trunc);
+	out.write(reinterpret_cast<const char*>(png.data()), png.size());
+	return static_cast<bool>(out);
+}
+
+static bool write_image(const string &filename, int width, int height, const vector<unsigned char> &pixels, const vector<float> &linear, PngLevel level, WorkStealingPool* pool)
+{
+	string ext = extension_of(filename);
+	if(ext == ".ppm") {
+		return write_bytes(filename, "P6\n" + to_string(width) + " " + to_string(height) + "\n255\n", pixels);
+	}
+	if(ext == ".raw") {
+		return write_bytes(filename, "", pixels);
+	}
+	if(ext == ".pfm" || ext == ".hdr") {
+		vector<float> scaled;
+		const float* rgb = linear.data();
+		if(linear.empty()) {
+			scaled.resize(pixels.size());
+			transform(pixels.begin(), pixels.end(), scaled.begin(), [](unsigned char c) { return c / 255.0f; });
+			rgb = scaled.data();
+		}
+		if(ext == ".pfm") {
+			return write_pfm(filename, width, height, rgb);
+		}
+		return stbi_write_hdr(filename.c_str(), width, height, 3, rgb) != 0;
+	}
+	return write_png(filename, width, height, pixels.data(), level, pool);
 }
 
 void Image::writeToFile(const string &filename)
 {
-	// The distance in bytes from the first byte of a row of pixels to the
-	// first byte of the next row of pixels
-	int stride_in_bytes = width*comp*sizeof(unsigned char);
-	int rc = stbi_write_png(filename.c_str(), width, height, comp, &pixels[0], stride_in_bytes);
-	if(rc) {
+	writeToFile(filename, PngLevel::Best, nullptr);
+}
+
+bool Image::writeToFile(const string &filename, PngLevel level, WorkStealingPool* pool)
+{
+	bool ok = write_image(filename, width, height, pixels, linear, level, pool);
+	if(ok) {
 		cout << "Wrote to " << filename << endl;
 	} else {
 		cout << "Couldn't write to " << filename << endl;
 	}
+	return ok;
+}
+
+future<bool> Image::writeToFileAsync(const string &filename, PngLevel level) const
+{
+	int w = width, h = height;
+	return async(launch::async, [filename, w, h, level](vector<unsigned char> copy, vector<float> linearCopy) {
+		WorkStealingPool pool(0);
+		return write_image(filename, w, h, copy, linearCopy, level, &pool);
+	}, pixels, linear);
 }
@@ -2,24 +2,73 @@
 #ifndef _IMAGE_H_
 #define _IMAGE_H_
 
+#include <future>
+#include <atomic>
+#include <iosfwd>
 #include <string>
 #include <vector>
+#include "PngEncoder.h"
 
+class WorkStealingPool;
+
+// 8-bit RGB image, optionally with a linear float plane beside it. The
+// file format follows the extension: .ppm (binary P6) and .raw (bare RGB
+// bytes, top row first) write the 8-bit plane without compressing it, .pfm
+// and .hdr write the float plane unquantized, and anything else is PNG.
 class Image
 {
 public:
-	Image(int width, int height);
+	// linear adds the float plane; the float formats fall back to the 8-bit
+	// plane scaled to [0, 1] without it.
+	Image(int width, int height, bool linear = false);
 	virtual ~Image();
+	// Also sets the float plane, if any, to the same color over 255. Writes
+	// outside the image are dropped and counted rather than printed.
 	void setPixel(int x, int y, unsigned char r, unsigned char g, unsigned char b);
+	// Sets the float plane alone; values outside [0, 1] are kept.
+	void setLinear(int x, int y, float r, float g, float b);
+	// Writes count RGB pixels from (x, y) rightwards, y counted from the
+	// bottom as in setPixel. Bounds are checked once for the whole span;
+	// the part outside the image is dropped and counted.
+	void setSpan(int x, int y, int count, const unsigned char* rgb);
+	void setLinearSpan(int x, int y, int count, const float* rgb);
+	// The 3 * width values of row y, for callers that fill whole rows
+	// themselves. Only y is checked: out of range gives nullptr and counts
+	// the row as dropped. Writing through getRow leaves the float plane
+	// alone, and getLinearRow is nullptr without one.
+	unsigned char* getRow(int y);
+	float* getLinearRow(int y);
+	// Pixel writes dropped for falling outside the image.
+	size_t getDroppedCount() const { return dropped.load(); }
+	// Prints one line about the dropped writes, if there were any, and
+	// returns whether there were none.
+	bool reportDropped(std::ostream& out) const;
+	bool hasLinear() const { return !linear.empty(); }
+	static bool isFloatFormat(const std::string &filename);
 	void writeToFile(const std::string &filename);
+	// Every PNG level encodes row bands in parallel on pool when one is
+	// given; the other formats ignore level and pool.
+	bool writeToFile(const std::string &filename, PngLevel level, WorkStealingPool* pool);
+	// Copies the pixels and writes them from a thread of its own, which
+	// encodes on every hardware thread, so the caller can go on drawing into
+	// this image. The future holds whether the write succeeded; nothing is
+	// printed.
+	std::future<bool> writeToFileAsync(const std::string &filename, PngLevel level) const;
 	int getWidth() const { return width; }
 	int getHeight() const { return height; }
+	const std::vector<unsigned char>& getPixels() const { return pixels; }
 
 private:
 	int width;
 	int height;
 	int comp;
 	std::vector<unsigned char> pixels;
+	std::vector<float> linear;
+	std::atomic<size_t> dropped;
+	int firstDroppedX, firstDroppedY;
+
+	bool clip(int& x, int y, int& count, int& skip);
+	void drop(int x, int y, size_t count);
 };
 
 #endif
@@ -0,0 +1,65 @@
+#include <iostream>
+#include "ImageWriter.h"
+#include "Image.h"
+#include "WorkStealingPool.h"
+
+using namespace std;
+
+ImageWriter::ImageWriter(size_t n) :
+	maxPending(n > 0 ? n : 1),
+	busy(false),
+	stopping(false)
+{
+	thread = std::thread(&ImageWriter::writerLoop, this);
+}
+
+ImageWriter::~ImageWriter()
+{
+	{
+		lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	ready.notify_all();
+	thread.join();
+}
+
+void ImageWriter::submit(unique_ptr<Image> image, const string& filename, PngLevel level, const string& message)
+{
+	{
+		unique_lock<std::mutex> lock(mutex);
+		drained.wait(lock, [&] { return items.size() < maxPending; });
+		items.push_back({ move(image), filename, level, message });
+	}
+	ready.notify_one();
+}
+
+void ImageWriter::finish()
+{
+	unique_lock<std::mutex> lock(mutex);
+	drained.wait(lock, [&] { return items.empty() && !busy; });
+}
+
+void ImageWriter::writerLoop()
+{
+	WorkStealingPool pool(0);
+	unique_lock<std::mutex> lock(mutex);
+	for (;;) {
+		ready.wait(lock, [&] { return stopping || !items.empty(); });
+		if (items.empty()) {
+			return;
+		}
+		Item item = move(items.front());
+		items.pop_front();
+		busy = true;
+		drained.notify_all();
+		lock.unlock();
+
+		cout << item.message;
+		item.image->writeToFile(item.filename, item.level, &pool);
+		item.image.reset();
+
+		lock.lock();
+		busy = false;
+		drained.notify_all();
+	}
+}
@@ -0,0 +1,51 @@
+#pragma once
+#ifndef _IMAGEWRITER_H_
+#define _IMAGEWRITER_H_
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "PngEncoder.h"
+
+class Image;
+
+// Writes images on a background thread in the order they are submitted, so
+// the threads that render them never wait on PNG encoding or the disk. The
+// writer spreads the bands of each image over a pool of its own. At
+// most maxPending images wait at once; submit() blocks beyond that, which
+// bounds memory when rendering outpaces writing.
+class ImageWriter
+{
+public:
+	explicit ImageWriter(size_t maxPending = 64);
+	// Writes whatever is still pending.
+	virtual ~ImageWriter();
+	// Prints message (which may be empty), then writes image to filename.
+	void submit(std::unique_ptr<Image> image, const std::string& filename, PngLevel level, const std::string& message);
+	// Returns once everything submitted so far has been written.
+	void finish();
+
+private:
+	struct Item {
+		std::unique_ptr<Image> image;
+		std::string filename;
+		PngLevel level;
+		std::string message;
+	};
+
+	void writerLoop();
+
+	size_t maxPending;
+	std::mutex mutex;
+	std::condition_variable ready;
+	std::condition_variable drained;
+	std::deque<Item> items;
+	bool busy;
+	bool stopping;
+	std::thread thread;
+};
+
+#endif
@@ -0,0 +1,230 @@
+#include <unordered_map>
+#include <cstdlib>
+#include <cctype>
+#include <algorithm>
+#include "Mesh.h"
+#include "MeshCache.h"
+
+#define TINYOBJLOADER_IMPLEMENTATION
+#include "tiny_obj_loader.h"
+
+using namespace std;
+
+bool load_obj_mesh(const string& filename, Mesh& mesh, string& err)
+{
+	MeshCache cache;
+	if (!cache.open(filename, err)) {
+		return false;
+	}
+
+	mesh = Mesh();
+	size_t vertexCount = cache.getVertexCount();
+	mesh.x.assign(cache.getPositions(0), cache.getPositions(0) + vertexCount);
+	mesh.y.assign(cache.getPositions(1), cache.getPositions(1) + vertexCount);
+	mesh.z.assign(cache.getPositions(2), cache.getPositions(2) + vertexCount);
+	if (cache.hasNormals()) {
+		mesh.nx.assign(cache.getNormals(0), cache.getNormals(0) + vertexCount);
+		mesh.ny.assign(cache.getNormals(1), cache.getNormals(1) + vertexCount);
+		mesh.nz.assign(cache.getNormals(2), cache.getNormals(2) + vertexCount);
+	} else {
+		mesh.nx.assign(vertexCount, 0.0f);
+		mesh.ny.assign(vertexCount, 0.0f);
+		mesh.nz.assign(vertexCount, 0.0f);
+	}
+	if (cache.hasTexcoords()) {
+		mesh.u.assign(cache.getTexcoords(0), cache.getTexcoords(0) + vertexCount);
+		mesh.v.assign(cache.getTexcoords(1), cache.getTexcoords(1) + vertexCount);
+	}
+	mesh.indices.assign(cache.getIndices(), cache.getIndices() + cache.getIndexCount());
+	mesh.r.assign(vertexCount, 0);
+	mesh.g.assign(vertexCount, 0);
+	mesh.b.assign(vertexCount, 0);
+	return true;
+}
+
+static void parse_floats(const char* p, float* out)
+{
+	for (int k = 0; k < 3; ++k) {
+		char* end;
+		out[k] = strtof(p, &end);
+		p = end;
+	}
+}
+
+ObjStream::ObjStream() :
+	triangleCount(0),
+	positionsSeen(0),
+	normalsSeen(0),
+	texcoordsSeen(0)
+{
+}
+
+ObjStream::~ObjStream()
+{
+}
+
+bool ObjStream::open(const string& filename, string& err)
+{
+	file.open(filename);
+	if (!file) {
+		err = "Cannot open " + filename;
+		return false;
+	}
+
+	positions = Mesh();
+	normals.clear();
+	texcoords.clear();
+	triangleCount = 0;
+	string line;
+	while (getline(file, line)) {
+		if (line.compare(0, 2, "v ") == 0) {
+			float v[3];
+			parse_floats(line.c_str() + 2, v);
+			positions.x.push_back(v[0]);
+			positions.y.push_back(v[1]);
+			positions.z.push_back(v[2]);
+		} else if (line.compare(0, 3, "vn ") == 0) {
+			float n[3];
+			parse_floats(line.c_str() + 3, n);
+			normals.insert(normals.end(), n, n + 3);
+		} else if (line.compare(0, 3, "vt ") == 0) {
+			// A third (w) coordinate, if any, is ignored.
+			const char* p = line.c_str() + 3;
+			for (int k = 0; k < 2; ++k) {
+				char* end;
+				texcoords.push_back(strtof(p, &end));
+				p = end;
+			}
+		} else if (line.compare(0, 2, "f ") == 0) {
+			size_t corners = 0;
+			for (const char* p = line.c_str() + 2; *p; ) {
+				while (isspace(static_cast<unsigned char>(*p))) {
+					++p;
+				}
+				if (!*p) {
+					break;
+				}
+				++corners;
+				while (*p && !isspace(static_cast<unsigned char>(*p))) {
+					++p;
+				}
+			}
+			triangleCount += corners >= 3 ? corners - 2 : 0;
+		}
+	}
+	positions.nx.assign(positions.x.size(), 0.0f);
+	positions.ny.assign(positions.x.size(), 0.0f);
+	positions.nz.assign(positions.x.size(), 0.0f);
+	positions.r.assign(positions.x.size(), 0);
+	positions.g.assign(positions.x.size(), 0);
+	positions.b.assign(positions.x.size(), 0);
+
+	// Rewind for the face pass.
+	file.clear();
+	file.seekg(0);
+	positionsSeen = normalsSeen = texcoordsSeen = 0;
+	return true;
+}
+
+// Parses the v, v/vt, v//vn or v/vt/vn corners of a face line into
+// zero-based indices, with -1 for a missing normal or texture coordinate.
+// As in load_obj_mesh, texture coordinates are ignored in a file without vt
+// lines.
+bool ObjStream::parseFace(const string& line, vector<Corner>& corners)
+{
+	corners.clear();
+	const char* p = line.c_str() + 2;
+	for (;;) {
+		char* end;
+		long v = strtol(p, &end, 10);
+		if (end == p) {
+			break;
+		}
+		p = end;
+		Corner corner = { static_cast<int>(v < 0 ? positionsSeen + v : v - 1), -1, -1 };
+		if (*p == '/') {
+			long t = strtol(++p, &end, 10);
+			if (end != p && !texcoords.empty()) {
+				corner.texcoord = static_cast<int>(t < 0 ? texcoordsSeen + t : t - 1);
+			}
+			p = end;
+			if (*p == '/') {
+				long n = strtol(++p, &end, 10);
+				if (end != p) {
+					corner.normal = static_cast<int>(n < 0 ? normalsSeen + n : n - 1);
+				}
+				p = end;
+			}
+		}
+		if (corner.position < 0 || corner.position >= static_cast<int>(positions.x.size()) ||
+			corner.normal >= static_cast<int>(normals.size() / 3) ||
+			corner.texcoord >= static_cast<int>(texcoords.size() / 2)) {
+			return false;
+		}
+		corners.push_back(corner);
+	}
+	return corners.size() >= 3;
+}
+
+bool ObjStream::readChunk(size_t maxTriangles, Mesh& chunk)
+{
+	chunk = Mesh();
+	unordered_map<CornerKey, uint32_t, CornerHash> vertexOf;
+	vector<Corner> corners;
+	string line;
+	maxTriangles = max<size_t>(maxTriangles, 1);
+	while (chunk.getTriangleCount() < maxTriangles && getline(file, line)) {
+		if (line.compare(0, 2, "v ") == 0) {
+			++positionsSeen;
+			continue;
+		}
+		if (line.compare(0, 3, "vn ") == 0) {
+			++normalsSeen;
+			continue;
+		}
+		if (line.compare(0, 3, "vt ") == 0) {
+			++texcoordsSeen;
+			continue;
+		}
+		if (line.compare(0, 2, "f ") != 0 || !parseFace(line, corners)) {
+			continue;
+		}
+
+		// Same vertex merging as load_obj_mesh, within the chunk.
+		uint32_t fan[3];
+		for (size_t j = 0; j < corners.size(); ++j) {
+			const Corner& corner = corners[j];
+			CornerKey key = { corner.position, corner.normal, corner.texcoord };
+			auto found = vertexOf.find(key);
+			uint32_t v;
+			if (found != vertexOf.end()) {
+				v = found->second;
+			} else {
+				v = static_cast<uint32_t>(chunk.x.size());
+				vertexOf.emplace(key, v);
+				chunk.x.push_back(positions.x[corner.position]);
+				chunk.y.push_back(positions.y[corner.position]);
+				chunk.z.push_back(positions.z[corner.position]);
+				chunk.nx.push_back(corner.normal < 0 ? 0.0f : normals[3 * corner.normal + 0]);
+				chunk.ny.push_back(corner.normal < 0 ? 0.0f : normals[3 * corner.normal + 1]);
+				chunk.nz.push_back(corner.normal < 0 ? 0.0f : normals[3 * corner.normal + 2]);
+				if (!texcoords.empty()) {
+					chunk.u.push_back(corner.texcoord < 0 ? 0.0f : texcoords[2 * corner.texcoord + 0]);
+					chunk.v.push_back(corner.texcoord < 0 ? 0.0f : texcoords[2 * corner.texcoord + 1]);
+				}
+			}
+			if (j < 2) {
+				fan[j] = v;
+				continue;
+			}
+			chunk.indices.push_back(fan[0]);
+			chunk.indices.push_back(fan[1]);
+			chunk.indices.push_back(v);
+			fan[1] = v;
+		}
+	}
+	chunk.r.assign(chunk.x.size(), 0);
+	chunk.g.assign(chunk.x.size(), 0);
+	chunk.b.assign(chunk.x.size(), 0);
+	return chunk.getTriangleCount() > 0;
+}
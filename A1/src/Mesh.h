@@ -0,0 +1,65 @@
+#pragma once
+#ifndef _MESH_H_
+#define _MESH_H_
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdint>
+
+// Indexed triangle mesh stored as one array per component. Face corners that
+// share both position and normal in the OBJ file become one vertex, so
+// per-vertex work (transforms, colors) runs once per vertex rather than once
+// per face corner, and loops over a component vectorize.
+struct Mesh {
+	std::vector<float> x, y, z;
+	std::vector<float> nx, ny, nz; // 0 when the file has no normals
+	std::vector<float> u, v;       // Empty when the file has no texture coordinates
+	std::vector<unsigned char> r, g, b;
+	std::vector<uint32_t> indices; // Three per triangle
+	size_t getVertexCount() const { return x.size(); }
+	size_t getTriangleCount() const { return indices.size() / 3; }
+};
+
+// Loads a (triangulated) OBJ file into mesh. On failure returns false and
+// sets err.
+bool load_obj_mesh(const std::string& filename, Mesh& mesh, std::string& err);
+
+// Reads an OBJ file in two passes so that meshes of any size can be drawn in
+// bounded memory. open() keeps only the vertex positions, normals and
+// texture coordinates, which faces index at random, and the bounds.
+// readChunk() then parses faces in file order and hands them out a chunk at
+// a time, each chunk a Mesh with just the vertices its triangles use.
+// Polygons are split into fans.
+class ObjStream
+{
+public:
+	ObjStream();
+	virtual ~ObjStream();
+	bool open(const std::string& filename, std::string& err);
+	// Reads up to maxTriangles more triangles (a polygon is never split
+	// across chunks, so its fan may go over). Returns false once no faces
+	// are left.
+	bool readChunk(size_t maxTriangles, Mesh& chunk);
+	// Every position in the file, as a mesh without triangles.
+	const Mesh& getPositions() const { return positions; }
+	size_t getTriangleCount() const { return triangleCount; }
+
+private:
+	struct Corner {
+		int position, normal, texcoord;
+	};
+
+	bool parseFace(const std::string& line, std::vector<Corner>& corners);
+
+	std::ifstream file;
+	Mesh positions;
+	std::vector<float> normals;
+	std::vector<float> texcoords; // u, v of every vt line
+	size_t triangleCount;
+	// Number of v, vn and vt lines read so far in the face pass, for
+	// resolving negative (relative) indices.
+	int positionsSeen, normalsSeen, texcoordsSeen;
+};
+
+#endif
@@ -0,0 +1,693 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <queue>
+#include "PngEncoder.h"
+#include "WorkStealingPool.h"
+
+using namespace std;
+
+// Raw bytes per band. Bands restart the LZ77 window, so much smaller bands
+// cost compression; much larger ones leave threads idle on small frames.
+static const size_t BAND_BYTES = 256 * 1024;
+static const int WINDOW = 32768;
+static const int HASH_BITS = 15;
+static const int MIN_MATCH = 3;
+static const int MAX_MATCH = 258;
+// Best: candidates tried per position, the match length that ends the
+// search early, and tokens per block, each block with its own codes.
+static const int MAX_CHAIN = 32;
+static const int NICE_MATCH = 64;
+static const size_t BLOCK_TOKENS = 16384;
+static const int MAX_CODE_BITS = 15;
+static const int MAX_LENGTH_CODE_BITS = 7;
+
+static const uint16_t LENGTH_BASE[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t LENGTH_EXTRA[] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t DIST_BASE[] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t DIST_EXTRA[] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+// Order in which a dynamic block lists the code lengths of the code length
+// alphabet.
+static const uint8_t LENGTH_CODE_ORDER[] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+bool parse_png_level(const string& name, PngLevel& level)
+{
+	if (name == "store") {
+		level = PngLevel::Store;
+	} else if (name == "fast") {
+		level = PngLevel::Fast;
+	} else if (name == "best") {
+		level = PngLevel::Best;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+static uint32_t crc32(uint32_t crc, const unsigned char* data, size_t n)
+{
+	static const struct CrcTable {
+		uint32_t entries[256];
+		CrcTable()
+		{
+			for (uint32_t i = 0; i < 256; ++i) {
+				uint32_t c = i;
+				for (int k = 0; k < 8; ++k) {
+					c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+				}
+				entries[i] = c;
+			}
+		}
+	} table;
+	crc = ~crc;
+	for (size_t i = 0; i < n; ++i) {
+		crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+static const uint32_t ADLER_BASE = 65521;
+
+static uint32_t adler32(uint32_t adler, const unsigned char* data, size_t n)
+{
+	uint32_t a = adler & 0xffff, b = adler >> 16;
+	while (n > 0) {
+		// The most bytes before b can overflow 32 bits.
+		size_t run = min(n, static_cast<size_t>(5552));
+		n -= run;
+		for (; run > 0; --run) {
+			a += *data++;
+			b += a;
+		}
+		a %= ADLER_BASE;
+		b %= ADLER_BASE;
+	}
+	return a | b << 16;
+}
+
+// Adler-32 of two streams back to back from the checksum of each and the
+// length of the second, as zlib's adler32_combine.
+static uint32_t adler32_combine(uint32_t first, uint32_t second, size_t secondLength)
+{
+	uint32_t rem = static_cast<uint32_t>(secondLength % ADLER_BASE);
+	uint32_t a = first & 0xffff;
+	uint32_t b = static_cast<uint32_t>((static_cast<uint64_t>(rem) * a) % ADLER_BASE);
+	a += (second & 0xffff) + ADLER_BASE - 1;
+	b += (first >> 16) + (second >> 16) + ADLER_BASE - rem;
+	if (a >= ADLER_BASE) a -= ADLER_BASE;
+	if (a >= ADLER_BASE) a -= ADLER_BASE;
+	if (b >= 2 * ADLER_BASE) b -= 2 * ADLER_BASE;
+	if (b >= ADLER_BASE) b -= ADLER_BASE;
+	return a | b << 16;
+}
+
+static void put_u32(vector<unsigned char>& out, uint32_t v)
+{
+	out.push_back(static_cast<unsigned char>(v >> 24));
+	out.push_back(static_cast<unsigned char>(v >> 16));
+	out.push_back(static_cast<unsigned char>(v >> 8));
+	out.push_back(static_cast<unsigned char>(v));
+}
+
+// Appends a chunk whose data is already in out from dataStart on; the
+// eight bytes before it are reserved for the length and type.
+static void finish_chunk(vector<unsigned char>& out, size_t dataStart, const char* type)
+{
+	uint32_t length = static_cast<uint32_t>(out.size() - dataStart);
+	unsigned char* header = &out[dataStart - 8];
+	for (int k = 0; k < 4; ++k) {
+		header[k] = static_cast<unsigned char>(length >> (24 - 8 * k));
+		header[4 + k] = static_cast<unsigned char>(type[k]);
+	}
+	put_u32(out, crc32(0, header + 4, length + 4));
+}
+
+static size_t begin_chunk(vector<unsigned char>& out)
+{
+	out.resize(out.size() + 8);
+	return out.size();
+}
+
+// Deflate writes bits from the least significant end of each byte.
+class BitWriter
+{
+public:
+	BitWriter(vector<unsigned char>& out) : out(out), bits(0), count(0) {}
+	void put(uint32_t value, int n)
+	{
+		bits |= static_cast<uint64_t>(value) << count;
+		count += n;
+		while (count >= 8) {
+			out.push_back(static_cast<unsigned char>(bits));
+			bits >>= 8;
+			count -= 8;
+		}
+	}
+	void align()
+	{
+		if (count > 0) {
+			put(0, 8 - count);
+		}
+	}
+
+private:
+	vector<unsigned char>& out;
+	uint64_t bits;
+	int count;
+};
+
+static uint32_t reverse_bits(uint32_t code, int n)
+{
+	uint32_t r = 0;
+	for (int k = 0; k < n; ++k) {
+		r = r << 1 | (code >> k & 1);
+	}
+	return r;
+}
+
+// A prefix code, with the codes bit reversed for BitWriter.
+struct HuffmanCode {
+	vector<uint16_t> codes;
+	vector<uint8_t> lengths;
+	void put(BitWriter& writer, int symbol) const
+	{
+		writer.put(codes[symbol], lengths[symbol]);
+	}
+};
+
+// The canonical code for the given code lengths, RFC 1951 3.2.2.
+static HuffmanCode make_code(const vector<uint8_t>& lengths)
+{
+	int count[MAX_CODE_BITS + 1] = {};
+	for (uint8_t length : lengths) {
+		++count[length];
+	}
+	count[0] = 0;
+	uint32_t next[MAX_CODE_BITS + 1] = {};
+	for (int bits = 1; bits <= MAX_CODE_BITS; ++bits) {
+		next[bits] = (next[bits - 1] + count[bits - 1]) << 1;
+	}
+	HuffmanCode code;
+	code.lengths = lengths;
+	code.codes.resize(lengths.size());
+	for (size_t s = 0; s < lengths.size(); ++s) {
+		if (lengths[s] > 0) {
+			code.codes[s] = static_cast<uint16_t>(reverse_bits(next[lengths[s]]++, lengths[s]));
+		}
+	}
+	return code;
+}
+
+// The fixed literal/length and distance codes of RFC 1951 3.2.6.
+static const HuffmanCode& fixed_literals()
+{
+	static const HuffmanCode code = [] {
+		vector<uint8_t> lengths(288);
+		for (int s = 0; s < 288; ++s) {
+			lengths[s] = s < 144 ? 8 : s < 256 ? 9 : s < 280 ? 7 : 8;
+		}
+		return make_code(lengths);
+	}();
+	return code;
+}
+
+static const HuffmanCode& fixed_distances()
+{
+	static const HuffmanCode code = make_code(vector<uint8_t>(30, 5));
+	return code;
+}
+
+// Code lengths of at most maxBits for symbols with the given frequencies, 0
+// for unused symbols. A tree that comes out too deep is built again from
+// flattened frequencies. Fewer than two used symbols get a partner, so the
+// code is always complete.
+static vector<uint8_t> huffman_lengths(const vector<uint32_t>& frequencies, int maxBits)
+{
+	typedef pair<uint64_t, int> Node; // weight, index
+	const int symbols = static_cast<int>(frequencies.size());
+	vector<uint8_t> lengths(symbols, 0);
+	vector<uint32_t> weights(frequencies);
+	vector<int> used;
+	for (int s = 0; s < symbols; ++s) {
+		if (weights[s] > 0) {
+			used.push_back(s);
+		}
+	}
+	if (used.size() < 2) {
+		int first = used.empty() ? 0 : used[0];
+		lengths[first] = 1;
+		lengths[first == 0 ? 1 : 0] = 1;
+		return lengths;
+	}
+	for (;;) {
+		priority_queue<Node, vector<Node>, greater<Node>> queue;
+		vector<int> parent(symbols, -1);
+		for (int s : used) {
+			queue.push(Node(weights[s], s));
+		}
+		while (queue.size() > 1) {
+			Node a = queue.top();
+			queue.pop();
+			Node b = queue.top();
+			queue.pop();
+			int merged = static_cast<int>(parent.size());
+			parent.push_back(-1);
+			parent[a.second] = parent[b.second] = merged;
+			queue.push(Node(a.first + b.first, merged));
+		}
+		int deepest = 0;
+		for (int s : used) {
+			int depth = 0;
+			for (int node = s; parent[node] >= 0; node = parent[node]) {
+				++depth;
+			}
+			lengths[s] = static_cast<uint8_t>(depth);
+			deepest = max(deepest, depth);
+		}
+		if (deepest <= maxBits) {
+			return lengths;
+		}
+		for (int s : used) {
+			weights[s] = (weights[s] + 1) / 2;
+		}
+	}
+}
+
+static int length_code(int length)
+{
+	int l = 28;
+	while (LENGTH_BASE[l] > length) {
+		--l;
+	}
+	return l;
+}
+
+static int distance_code(int distance)
+{
+	int d = 29;
+	while (DIST_BASE[d] > distance) {
+		--d;
+	}
+	return d;
+}
+
+static void put_match(BitWriter& writer, int length, int distance, const HuffmanCode& literals, const HuffmanCode& distances)
+{
+	int l = length_code(length);
+	literals.put(writer, 257 + l);
+	writer.put(length - LENGTH_BASE[l], LENGTH_EXTRA[l]);
+	int d = distance_code(distance);
+	distances.put(writer, d);
+	writer.put(distance - DIST_BASE[d], DIST_EXTRA[d]);
+}
+
+// Ends a band with an empty stored block, so the next band starts on a byte.
+static void sync_flush(BitWriter& writer, vector<unsigned char>& out)
+{
+	writer.put(0, 3);
+	writer.align();
+	out.insert(out.end(), { 0x00, 0x00, 0xff, 0xff });
+}
+
+// One fixed-code block over data, greedy LZ77 with a single candidate per
+// hash.
+static void deflate_fast(const unsigned char* data, size_t n, vector<unsigned char>& out)
+{
+	const HuffmanCode& literals = fixed_literals();
+	const HuffmanCode& distances = fixed_distances();
+	vector<int> head(size_t(1) << HASH_BITS, -1);
+	BitWriter writer(out);
+	writer.put(0, 1); // not final
+	writer.put(1, 2); // fixed codes
+	size_t i = 0;
+	while (i < n) {
+		int length = 0, distance = 0;
+		if (i + MIN_MATCH <= n) {
+			uint32_t key = data[i] | data[i + 1] << 8 | data[i + 2] << 16;
+			uint32_t h = (key * 2654435761u) >> (32 - HASH_BITS);
+			int candidate = head[h];
+			head[h] = static_cast<int>(i);
+			if (candidate >= 0 && static_cast<int>(i) - candidate <= WINDOW) {
+				size_t limit = min(n - i, static_cast<size_t>(MAX_MATCH));
+				const unsigned char* a = data + candidate;
+				const unsigned char* b = data + i;
+				size_t k = 0;
+				while (k < limit && a[k] == b[k]) {
+					++k;
+				}
+				if (k >= MIN_MATCH) {
+					length = static_cast<int>(k);
+					distance = static_cast<int>(i) - candidate;
+				}
+			}
+		}
+		if (length > 0) {
+			put_match(writer, length, distance, literals, distances);
+			i += length;
+		} else {
+			literals.put(writer, data[i]);
+			++i;
+		}
+	}
+	literals.put(writer, 256);
+	sync_flush(writer, out);
+}
+
+// A literal byte when distance is 0, else a match of length bytes.
+struct Token {
+	uint16_t value;
+	uint16_t distance;
+};
+
+// LZ77 over hash chains with lazy matching, as zlib's higher levels: a match
+// is put off by a byte whenever the next position starts a longer one.
+static void find_matches(const unsigned char* data, size_t n, vector<Token>& tokens)
+{
+	vector<int> head(size_t(1) << HASH_BITS, -1);
+	vector<int> prev(n, -1);
+	auto hash = [&](size_t i) {
+		uint32_t key = data[i] | data[i + 1] << 8 | data[i + 2] << 16;
+		return (key * 2654435761u) >> (32 - HASH_BITS);
+	};
+	auto insert = [&](size_t i) {
+		if (i + MIN_MATCH <= n) {
+			uint32_t h = hash(i);
+			prev[i] = head[h];
+			head[h] = static_cast<int>(i);
+		}
+	};
+	auto longest = [&](size_t i, int& distance) {
+		int best = 0;
+		if (i + MIN_MATCH > n) {
+			return best;
+		}
+		const int limit = static_cast<int>(min(n - i, static_cast<size_t>(MAX_MATCH)));
+		const unsigned char* b = data + i;
+		int chain = MAX_CHAIN;
+		for (int candidate = head[hash(i)]; candidate >= 0 && static_cast<int>(i) - candidate <= WINDOW && chain-- > 0; candidate = prev[candidate]) {
+			const unsigned char* a = data + candidate;
+			if (a[best] != b[best]) {
+				continue;
+			}
+			int k = 0;
+			while (k < limit && a[k] == b[k]) {
+				++k;
+			}
+			if (k > best) {
+				best = k;
+				distance = static_cast<int>(i) - candidate;
+				if (k == limit) {
+					break;
+				}
+			}
+		}
+		return best >= MIN_MATCH ? best : 0;
+	};
+
+	// The match found at i - 1, if any, waits to be compared with the one
+	// at i.
+	bool pending = false;
+	int pendingLength = 0, pendingDistance = 0;
+	size_t i = 0;
+	while (i < n) {
+		int distance = 0;
+		int length = pendingLength < NICE_MATCH ? longest(i, distance) : 0;
+		insert(i);
+		if (pendingLength >= MIN_MATCH && length <= pendingLength) {
+			tokens.push_back({ static_cast<uint16_t>(pendingLength), static_cast<uint16_t>(pendingDistance) });
+			size_t end = i - 1 + pendingLength;
+			for (++i; i < end; ++i) {
+				insert(i);
+			}
+			pending = false;
+			pendingLength = 0;
+			continue;
+		}
+		if (pending) {
+			tokens.push_back({ data[i - 1], 0 });
+		}
+		pending = true;
+		pendingLength = length;
+		pendingDistance = distance;
+		++i;
+	}
+	if (pending) {
+		if (pendingLength >= MIN_MATCH) {
+			tokens.push_back({ static_cast<uint16_t>(pendingLength), static_cast<uint16_t>(pendingDistance) });
+		} else {
+			tokens.push_back({ data[n - 1], 0 });
+		}
+	}
+}
+
+// Run-length codes a dynamic block's code lengths: 16 repeats the previous
+// length 3 to 6 times, 17 and 18 give runs of 3 to 10 and 11 to 138 zeros.
+// Each entry is a symbol and the value of its extra bits.
+static void encode_lengths(const vector<uint8_t>& lengths, vector<pair<int, int>>& symbols)
+{
+	size_t i = 0;
+	while (i < lengths.size()) {
+		int length = lengths[i];
+		size_t run = 1;
+		while (i + run < lengths.size() && lengths[i + run] == length) {
+			++run;
+		}
+		i += run;
+		if (length == 0) {
+			for (; run >= 11; run -= min(run, static_cast<size_t>(138))) {
+				symbols.push_back({ 18, static_cast<int>(min(run, static_cast<size_t>(138))) - 11 });
+			}
+			if (run >= 3) {
+				symbols.push_back({ 17, static_cast<int>(run) - 3 });
+				run = 0;
+			}
+		} else {
+			symbols.push_back({ length, 0 });
+			--run;
+			for (; run >= 3; run -= min(run, static_cast<size_t>(6))) {
+				symbols.push_back({ 16, static_cast<int>(min(run, static_cast<size_t>(6))) - 3 });
+			}
+		}
+		for (; run > 0; --run) {
+			symbols.push_back({ length, 0 });
+		}
+	}
+}
+
+// One block over tokens, with codes built for them or with the fixed codes
+// when those come out smaller, as they can for short blocks.
+static void put_block(BitWriter& writer, const Token* tokens, size_t count)
+{
+	vector<uint32_t> literalCounts(286, 0), distanceCounts(30, 0);
+	for (size_t t = 0; t < count; ++t) {
+		if (tokens[t].distance == 0) {
+			++literalCounts[tokens[t].value];
+		} else {
+			++literalCounts[257 + length_code(tokens[t].value)];
+			++distanceCounts[distance_code(tokens[t].distance)];
+		}
+	}
+	literalCounts[256] = 1;
+	HuffmanCode literals = make_code(huffman_lengths(literalCounts, MAX_CODE_BITS));
+	HuffmanCode distances = make_code(huffman_lengths(distanceCounts, MAX_CODE_BITS));
+	int literalCount = 286, distanceCount = 30;
+	while (literalCount > 257 && literals.lengths[literalCount - 1] == 0) {
+		--literalCount;
+	}
+	while (distanceCount > 1 && distances.lengths[distanceCount - 1] == 0) {
+		--distanceCount;
+	}
+	vector<uint8_t> lengths(literals.lengths.begin(), literals.lengths.begin() + literalCount);
+	lengths.insert(lengths.end(), distances.lengths.begin(), distances.lengths.begin() + distanceCount);
+	vector<pair<int, int>> lengthSymbols;
+	encode_lengths(lengths, lengthSymbols);
+	vector<uint32_t> lengthCounts(19, 0);
+	for (const auto& symbol : lengthSymbols) {
+		++lengthCounts[symbol.first];
+	}
+	HuffmanCode lengthCode = make_code(huffman_lengths(lengthCounts, MAX_LENGTH_CODE_BITS));
+	int orderCount = 19;
+	while (orderCount > 4 && lengthCode.lengths[LENGTH_CODE_ORDER[orderCount - 1]] == 0) {
+		--orderCount;
+	}
+
+	// Extra bits cost the same either way, so only the codes are compared.
+	static const uint8_t LENGTH_SYMBOL_EXTRA[] = { 2, 3, 7 };
+	uint64_t dynamicBits = 14 + 3 * orderCount, fixedBits = 0;
+	for (const auto& symbol : lengthSymbols) {
+		dynamicBits += lengthCode.lengths[symbol.first] + (symbol.first >= 16 ? LENGTH_SYMBOL_EXTRA[symbol.first - 16] : 0);
+	}
+	for (int s = 0; s < 286; ++s) {
+		dynamicBits += static_cast<uint64_t>(literalCounts[s]) * literals.lengths[s];
+		fixedBits += static_cast<uint64_t>(literalCounts[s]) * fixed_literals().lengths[s];
+	}
+	for (int d = 0; d < 30; ++d) {
+		dynamicBits += static_cast<uint64_t>(distanceCounts[d]) * distances.lengths[d];
+		fixedBits += static_cast<uint64_t>(distanceCounts[d]) * fixed_distances().lengths[d];
+	}
+
+	writer.put(0, 1); // not final
+	if (fixedBits <= dynamicBits) {
+		writer.put(1, 2);
+		literals = fixed_literals();
+		distances = fixed_distances();
+	} else {
+		writer.put(2, 2);
+		writer.put(literalCount - 257, 5);
+		writer.put(distanceCount - 1, 5);
+		writer.put(orderCount - 4, 4);
+		for (int k = 0; k < orderCount; ++k) {
+			writer.put(lengthCode.lengths[LENGTH_CODE_ORDER[k]], 3);
+		}
+		for (const auto& symbol : lengthSymbols) {
+			lengthCode.put(writer, symbol.first);
+			if (symbol.first >= 16) {
+				writer.put(symbol.second, LENGTH_SYMBOL_EXTRA[symbol.first - 16]);
+			}
+		}
+	}
+	for (size_t t = 0; t < count; ++t) {
+		if (tokens[t].distance == 0) {
+			literals.put(writer, tokens[t].value);
+		} else {
+			put_match(writer, tokens[t].value, tokens[t].distance, literals, distances);
+		}
+	}
+	literals.put(writer, 256);
+}
+
+static void deflate_best(const unsigned char* data, size_t n, vector<unsigned char>& out)
+{
+	vector<Token> tokens;
+	tokens.reserve(n / 4);
+	find_matches(data, n, tokens);
+	BitWriter writer(out);
+	for (size_t t = 0; t < tokens.size(); t += BLOCK_TOKENS) {
+		put_block(writer, &tokens[t], min(BLOCK_TOKENS, tokens.size() - t));
+	}
+	sync_flush(writer, out);
+}
+
+static void deflate_store(const unsigned char* data, size_t n, vector<unsigned char>& out)
+{
+	for (size_t i = 0; i < n; i += 65535) {
+		uint16_t length = static_cast<uint16_t>(min(n - i, static_cast<size_t>(65535)));
+		// Not final, stored: three zero bits padded to a byte.
+		out.insert(out.end(), { 0x00,
+			static_cast<unsigned char>(length), static_cast<unsigned char>(length >> 8),
+			static_cast<unsigned char>(~length), static_cast<unsigned char>(~length >> 8) });
+		out.insert(out.end(), data + i, data + i + length);
+	}
+}
+
+static int paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+static unsigned char filtered(const unsigned char* row, const unsigned char* prev, int i, int type)
+{
+	const int bpp = 3;
+	int a = i >= bpp ? row[i - bpp] : 0;
+	int b = prev ? prev[i] : 0;
+	int c = i >= bpp && prev ? prev[i - bpp] : 0;
+	int predict = type == 1 ? a : type == 2 ? b : type == 3 ? (a + b) / 2 : type == 4 ? paeth(a, b, c) : 0;
+	return static_cast<unsigned char>(row[i] - predict);
+}
+
+// Filters one row into out: the filter type byte, then the row. Fast picks
+// the filter whose output has the smallest sum of magnitudes, the usual PNG
+// heuristic; Store keeps the row as it is.
+static void filter_row(const unsigned char* row, const unsigned char* prev, int rowBytes, PngLevel level, unsigned char* out)
+{
+	int best = 0;
+	if (level != PngLevel::Store) {
+		long bestCost = -1;
+		for (int type = 0; type < 5; ++type) {
+			long cost = 0;
+			for (int i = 0; i < rowBytes; ++i) {
+				unsigned char f = filtered(row, prev, i, type);
+				cost += f < 128 ? f : 256 - f;
+			}
+			if (bestCost < 0 || cost < bestCost) {
+				bestCost = cost;
+				best = type;
+			}
+		}
+	}
+	out[0] = static_cast<unsigned char>(best);
+	for (int i = 0; i < rowBytes; ++i) {
+		out[1 + i] = filtered(row, prev, i, best);
+	}
+}
+
+void encode_png(int width, int height, const unsigned char* rgb, PngLevel level, WorkStealingPool* pool, vector<unsigned char>& png)
+{
+	png.clear();
+	const int rowBytes = 3 * width;
+	const int bandRows = max(1, static_cast<int>(BAND_BYTES / (rowBytes + 1)));
+	const int bandCount = max(1, (height + bandRows - 1) / bandRows);
+	vector<vector<unsigned char>> chunks(bandCount);
+	vector<uint32_t> adlers(bandCount);
+	vector<size_t> lengths(bandCount);
+	auto encodeBand = [&](int band) {
+		int y0 = band * bandRows, y1 = min(height, y0 + bandRows);
+		vector<unsigned char> raw(static_cast<size_t>(y1 - y0) * (rowBytes + 1));
+		for (int y = y0; y < y1; ++y) {
+			const unsigned char* row = rgb + static_cast<size_t>(y) * rowBytes;
+			filter_row(row, y > 0 ? row - rowBytes : nullptr, rowBytes, level, &raw[static_cast<size_t>(y - y0) * (rowBytes + 1)]);
+		}
+		adlers[band] = adler32(1, raw.data(), raw.size());
+		lengths[band] = raw.size();
+
+		vector<unsigned char>& chunk = chunks[band];
+		chunk.reserve(level == PngLevel::Store ? raw.size() + raw.size() / 8192 + 32 : raw.size() / 2 + 64);
+		size_t start = begin_chunk(chunk);
+		if (band == 0) {
+			// zlib header: deflate, 32K window, fastest or maximum compression.
+			chunk.insert(chunk.end(), { 0x78, static_cast<unsigned char>(level == PngLevel::Best ? 0xda : 0x01) });
+		}
+		if (level == PngLevel::Store) {
+			deflate_store(raw.data(), raw.size(), chunk);
+		} else if (level == PngLevel::Fast) {
+			deflate_fast(raw.data(), raw.size(), chunk);
+		} else {
+			deflate_best(raw.data(), raw.size(), chunk);
+		}
+		finish_chunk(chunk, start, "IDAT");
+	};
+	if (pool && bandCount > 1) {
+		pool->run(bandCount, encodeBand);
+	} else {
+		for (int band = 0; band < bandCount; ++band) {
+			encodeBand(band);
+		}
+	}
+
+	static const unsigned char SIGNATURE[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	png.insert(png.end(), SIGNATURE, SIGNATURE + 8);
+	size_t start = begin_chunk(png);
+	put_u32(png, width);
+	put_u32(png, height);
+	// 8 bits per channel, RGB, deflate, adaptive filters, not interlaced.
+	png.insert(png.end(), { 8, 2, 0, 0, 0 });
+	finish_chunk(png, start, "IHDR");
+
+	uint32_t adler = adlers[0];
+	for (int band = 0; band < bandCount; ++band) {
+		png.insert(png.end(), chunks[band].begin(), chunks[band].end());
+		if (band > 0) {
+			adler = adler32_combine(adler, adlers[band], lengths[band]);
+		}
+	}
+	start = begin_chunk(png);
+	// An empty final fixed block, then the checksum of the whole stream.
+	png.insert(png.end(), { 0x03, 0x00 });
+	put_u32(png, adler);
+	finish_chunk(png, start, "IDAT");
+
+	start = begin_chunk(png);
+	finish_chunk(png, start, "IEND");
+}
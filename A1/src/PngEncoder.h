@@ -0,0 +1,24 @@
+#pragma once
+#ifndef _PNGENCODER_H_
+#define _PNGENCODER_H_
+
+#include <string>
+#include <vector>
+
+class WorkStealingPool;
+
+// How hard to compress. Store writes the filtered rows as they are, Fast
+// runs a greedy LZ77 pass coded with the fixed deflate tables, and Best
+// searches hash chains with lazy matching and codes each block with Huffman
+// tables built for it.
+enum class PngLevel { Store, Fast, Best };
+
+bool parse_png_level(const std::string& name, PngLevel& level);
+
+// Encodes a width x height RGB image, top row first, as a PNG file in png.
+// The rows are split into bands that are filtered and deflated
+// independently, on pool when one is given; every band becomes its own IDAT
+// chunk of a single zlib stream, so any decoder reads the result.
+void encode_png(int width, int height, const unsigned char* rgb, PngLevel level, WorkStealingPool* pool, std::vector<unsigned char>& png);
+
+#endif
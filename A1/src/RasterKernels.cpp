@@ -0,0 +1,677 @@
+#include <algorithm>
+#include <cmath>
+#include "RasterKernels.h"
+#include "Texture.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RASTER_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define RASTER_TARGET(isa)
+#else
+#define RASTER_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+using namespace std;
+
+// Final color of a pixel from its interpolated attribute v and depth z.
+template <Shading S>
+static inline void shade_values(const unsigned char* flatColor, const ShadeStage& stage, float* v, float z, unsigned char* rgb)
+{
+	if (S == Shading::Flat) {
+		rgb[0] = flatColor[0];
+		rgb[1] = flatColor[1];
+		rgb[2] = flatColor[2];
+	} else if (S == Shading::Depth) {
+		rgb[0] = static_cast<unsigned char>((z - stage.minZ) / (stage.maxZ - stage.minZ) * 255);
+		rgb[1] = 0;
+		rgb[2] = 0;
+	} else if (S == Shading::Color) {
+		for (int k = 0; k < 3; ++k) {
+			rgb[k] = static_cast<unsigned char>(v[k]);
+		}
+	} else if (S == Shading::Normal) {
+		for (int k = 0; k < 3; ++k) {
+			rgb[k] = static_cast<unsigned char>((v[k] * 0.5f + 0.5f) * 255);
+		}
+	} else if (S == Shading::Lambert) {
+		float length = sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+		v[0] /= length;
+		v[1] /= length;
+		v[2] /= length;
+		float dot = max(v[0] * stage.light[0] + v[1] * stage.light[1] + v[2] * stage.light[2], 0.0f);
+		unsigned char intensity = static_cast<unsigned char>(dot * 255);
+		rgb[0] = rgb[1] = rgb[2] = intensity;
+	} else if (S == Shading::Texture) {
+		stage.texture->sample(v[0], v[1], v[2], rgb);
+	}
+}
+
+// Flat and depth shading need no interpolated attribute.
+template <Shading S>
+static inline bool uses_attr()
+{
+	return S != Shading::Flat && S != Shading::Depth;
+}
+
+// Screen-space barycentrics weighted by 1/w and renormalized, so that they
+// interpolate linearly across the triangle in 3D.
+static inline void perspective_correct(const ScreenTriangle& tri, float& a, float& b, float& c)
+{
+	a *= tri.invW[0];
+	b *= tri.invW[1];
+	c *= tri.invW[2];
+	float scale = 1.0f / (a + b + c);
+	a *= scale;
+	b *= scale;
+	c *= scale;
+}
+
+static inline void interpolate_attr(const ScreenTriangle& tri, float a, float b, float c, float* v)
+{
+	if (tri.perspective) {
+		perspective_correct(tri, a, b, c);
+	}
+	for (int k = 0; k < 3; ++k) {
+		v[k] = a * tri.attr[0][k] + b * tri.attr[1][k] + c * tri.attr[2][k];
+	}
+}
+
+// Texture coordinates at the screen barycentrics (a, b), and in v[2] the
+// mip level: log2 of how many texels they move over one pixel, taking the
+// larger of the x and y steps.
+static inline void texture_attr(const BlockRow& row, const ScreenTriangle& tri, const ShadeStage& stage, float a, float b, float* v)
+{
+	const float step[3][2] = { { 0.0f, 0.0f }, { row.dadx, row.dbdx }, { row.dady, row.dbdy } };
+	float uv[3][3];
+	for (int j = 0; j < 3; ++j) {
+		float sa = a + step[j][0];
+		float sb = b + step[j][1];
+		interpolate_attr(tri, sa, sb, 1.0f - sa - sb, uv[j]);
+	}
+	float w = static_cast<float>(stage.texture->getWidth());
+	float h = static_cast<float>(stage.texture->getHeight());
+	float dx = hypot((uv[1][0] - uv[0][0]) * w, (uv[1][1] - uv[0][1]) * h);
+	float dy = hypot((uv[2][0] - uv[0][0]) * w, (uv[2][1] - uv[0][1]) * h);
+	v[0] = uv[0][0];
+	v[1] = uv[0][1];
+	v[2] = log2(max(max(dx, dy), 1e-6f));
+}
+
+template <Shading S, bool GBuffer>
+static int row_scalar(const BlockRow& row, const ScreenTriangle& tri, const RasterState& state)
+{
+	int written = 0;
+	for (int lane = row.first; lane <= row.last; ++lane) {
+		if (!row.accept) {
+			bool inside = true;
+			for (int k = 0; k < 3; ++k) {
+				inside = inside && row.e[k] + row.edx[k] * lane >= row.threshold;
+			}
+			if (!inside) {
+				continue;
+			}
+		}
+		float k = static_cast<float>(lane);
+		float a = row.a + k * row.dadx;
+		float b = row.b + k * row.dbdx;
+		float c = 1.0f - a - b;
+		float z = a * tri.z[0] + b * tri.z[1] + c * tri.z[2];
+		if (state.depthTest) {
+			if (!(z > row.depth[lane])) {
+				continue;
+			}
+			row.depth[lane] = z;
+		}
+		float v[3];
+		if (S == Shading::Texture) {
+			texture_attr(row, tri, state.shade, a, b, v);
+		} else if (uses_attr<S>()) {
+			interpolate_attr(tri, a, b, c, v);
+		}
+		if (GBuffer) {
+			for (int j = 0; uses_attr<S>() && j < 3; ++j) {
+				row.attr[j][lane] = v[j];
+			}
+			row.id[lane] = row.triangle;
+		} else {
+			shade_values<S>(tri.color, state.shade, v, z, &row.color[3 * lane]);
+		}
+		++written;
+	}
+	return written;
+}
+
+template <Shading S>
+static int row_msaa(const BlockRow& row, const ScreenTriangle& tri, const RasterState& state)
+{
+	int written = 0;
+	for (int lane = row.first; lane <= row.last; ++lane) {
+		row.coverage[lane] = 0;
+		int64_t center[3];
+		bool centerInside = true;
+		for (int k = 0; k < 3; ++k) {
+			center[k] = row.e[k] + row.edx[k] * lane;
+			centerInside = centerInside && (row.accept || center[k] >= row.threshold);
+		}
+		// Shade at the pixel center when the triangle covers it, otherwise at
+		// the first covered sample, so attributes are never extrapolated.
+		int shadeAt = centerInside ? -1 : row.samples;
+		unsigned passed = 0;
+		float* depth = row.depth + lane * row.samples;
+		for (int s = 0; s < row.samples; ++s) {
+			int64_t e[3];
+			bool inside = true;
+			for (int k = 0; k < 3; ++k) {
+				e[k] = center[k] + row.sampleEdge[3 * s + k];
+				inside = inside && (row.accept || e[k] >= row.threshold);
+			}
+			if (!inside) {
+				continue;
+			}
+			shadeAt = min(shadeAt, s);
+			float a = static_cast<float>(e[0]) * row.invDet;
+			float b = static_cast<float>(e[1]) * row.invDet;
+			float c = 1.0f - a - b;
+			float z = a * tri.z[0] + b * tri.z[1] + c * tri.z[2];
+			if (state.depthTest) {
+				if (!(z > depth[s])) {
+					continue;
+				}
+				depth[s] = z;
+			}
+			passed |= 1u << s;
+		}
+		if (!passed) {
+			continue;
+		}
+
+		float a, b;
+		if (shadeAt < 0) {
+			float k = static_cast<float>(lane);
+			a = row.a + k * row.dadx;
+			b = row.b + k * row.dbdx;
+		} else {
+			a = static_cast<float>(center[0] + row.sampleEdge[3 * shadeAt]) * row.invDet;
+			b = static_cast<float>(center[1] + row.sampleEdge[3 * shadeAt + 1]) * row.invDet;
+		}
+		float c = 1.0f - a - b;
+		float z = a * tri.z[0] + b * tri.z[1] + c * tri.z[2];
+		float v[3];
+		if (S == Shading::Texture) {
+			texture_attr(row, tri, state.shade, a, b, v);
+		} else if (uses_attr<S>()) {
+			interpolate_attr(tri, a, b, c, v);
+		}
+		shade_values<S>(tri.color, state.shade, v, z, &row.color[3 * lane]);
+		row.coverage[lane] = static_cast<unsigned char>(passed);
+		++written;
+	}
+	return written;
+}
+
+#ifdef RASTER_X86
+
+// The vector kernels test edges in 32 bits: the lane-0 value is clamped to
+// +/-2^30 and lane steps of up to 7 * 2^27 are added, which keeps the sign of
+// every lane exact. Steeper edges fall back to the scalar kernel.
+static const int64_t EDGE_STEP_LIMIT = int64_t(1) << 27;
+static const int64_t EDGE_CLAMP = int64_t(1) << 30;
+
+static inline bool edges_fit_32(const BlockRow& row)
+{
+	for (int k = 0; k < 3; ++k) {
+		if (row.edx[k] >= EDGE_STEP_LIMIT || row.edx[k] <= -EDGE_STEP_LIMIT) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static inline int clamped_edge(const BlockRow& row, int k)
+{
+	return static_cast<int>(min(max(row.e[k] - row.threshold, -EDGE_CLAMP), EDGE_CLAMP));
+}
+
+static inline int popcount(int mask)
+{
+	int count = 0;
+	for (; mask; mask &= mask - 1) {
+		++count;
+	}
+	return count;
+}
+
+// Writes id to every lane set in mask.
+static inline void store_id(uint32_t* ids, int mask, uint32_t id, int count)
+{
+	for (int lane = 0; lane < count; ++lane) {
+		if (mask & (1 << lane)) {
+			ids[lane] = id;
+		}
+	}
+}
+
+// Writes the RGB of every lane set in mask.
+static inline void store_rgb(unsigned char* color, int mask, const int* r, const int* g, const int* b, int count)
+{
+	for (int lane = 0; lane < count; ++lane) {
+		if (mask & (1 << lane)) {
+			color[3 * lane + 0] = static_cast<unsigned char>(r[lane]);
+			color[3 * lane + 1] = static_cast<unsigned char>(g[lane]);
+			color[3 * lane + 2] = static_cast<unsigned char>(b[lane]);
+		}
+	}
+}
+
+template <Shading S, bool GBuffer>
+RASTER_TARGET("sse4.1")
+static int row_sse41(const BlockRow& row, const ScreenTriangle& tri, const RasterState& state)
+{
+	if (!edges_fit_32(row)) {
+		return row_scalar<S, GBuffer>(row, tri, state);
+	}
+
+	const ShadeStage& stage = state.shade;
+	int written = 0;
+	for (int base = 0; base < 8; base += 4) {
+		if (base > row.last || base + 3 < row.first) {
+			continue;
+		}
+		__m128i lane = _mm_setr_epi32(base, base + 1, base + 2, base + 3);
+		__m128i mask = _mm_and_si128(_mm_cmpgt_epi32(lane, _mm_set1_epi32(row.first - 1)),
+			_mm_cmplt_epi32(lane, _mm_set1_epi32(row.last + 1)));
+		if (!row.accept) {
+			for (int k = 0; k < 3; ++k) {
+				__m128i e = _mm_add_epi32(_mm_set1_epi32(clamped_edge(row, k)),
+					_mm_mullo_epi32(lane, _mm_set1_epi32(static_cast<int>(row.edx[k]))));
+				mask = _mm_andnot_si128(_mm_cmpgt_epi32(_mm_setzero_si128(), e), mask);
+			}
+		}
+		__m128 live = _mm_castsi128_ps(mask);
+		if (_mm_movemask_ps(live) == 0) {
+			continue;
+		}
+
+		__m128 k = _mm_cvtepi32_ps(lane);
+		__m128 a = _mm_add_ps(_mm_set1_ps(row.a), _mm_mul_ps(k, _mm_set1_ps(row.dadx)));
+		__m128 b = _mm_add_ps(_mm_set1_ps(row.b), _mm_mul_ps(k, _mm_set1_ps(row.dbdx)));
+		__m128 c = _mm_sub_ps(_mm_sub_ps(_mm_set1_ps(1.0f), a), b);
+		__m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a, _mm_set1_ps(tri.z[0])), _mm_mul_ps(b, _mm_set1_ps(tri.z[1]))),
+			_mm_mul_ps(c, _mm_set1_ps(tri.z[2])));
+		if (state.depthTest) {
+			__m128 old = _mm_loadu_ps(row.depth + base);
+			live = _mm_and_ps(live, _mm_cmpgt_ps(z, old));
+			_mm_storeu_ps(row.depth + base, _mm_blendv_ps(old, z, live));
+		}
+		int bits = _mm_movemask_ps(live);
+		if (bits == 0) {
+			continue;
+		}
+		written += popcount(bits);
+
+		// Attributes take perspective-correct weights; depth stays linear in
+		// screen space.
+		__m128 wa = a, wb = b, wc = c;
+		if (tri.perspective) {
+			wa = _mm_mul_ps(wa, _mm_set1_ps(tri.invW[0]));
+			wb = _mm_mul_ps(wb, _mm_set1_ps(tri.invW[1]));
+			wc = _mm_mul_ps(wc, _mm_set1_ps(tri.invW[2]));
+			__m128 scale = _mm_div_ps(_mm_set1_ps(1.0f), _mm_add_ps(_mm_add_ps(wa, wb), wc));
+			wa = _mm_mul_ps(wa, scale);
+			wb = _mm_mul_ps(wb, scale);
+			wc = _mm_mul_ps(wc, scale);
+		}
+
+		if (GBuffer) {
+			for (int j = 0; uses_attr<S>() && j < 3; ++j) {
+				__m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(wa, _mm_set1_ps(tri.attr[0][j])), _mm_mul_ps(wb, _mm_set1_ps(tri.attr[1][j]))),
+					_mm_mul_ps(wc, _mm_set1_ps(tri.attr[2][j])));
+				_mm_storeu_ps(row.attr[j] + base, _mm_blendv_ps(_mm_loadu_ps(row.attr[j] + base), v, live));
+			}
+			store_id(row.id + base, bits, row.triangle, 4);
+			continue;
+		}
+
+		__m128i out[3];
+		if (S == Shading::Flat) {
+			for (int j = 0; j < 3; ++j) {
+				out[j] = _mm_set1_epi32(tri.color[j]);
+			}
+		} else if (S == Shading::Depth) {
+			__m128 d = _mm_div_ps(_mm_sub_ps(z, _mm_set1_ps(stage.minZ)), _mm_set1_ps(stage.maxZ - stage.minZ));
+			out[0] = _mm_cvttps_epi32(_mm_mul_ps(d, _mm_set1_ps(255.0f)));
+			out[1] = out[2] = _mm_setzero_si128();
+		} else {
+			__m128 v[3];
+			for (int j = 0; j < 3; ++j) {
+				v[j] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(wa, _mm_set1_ps(tri.attr[0][j])), _mm_mul_ps(wb, _mm_set1_ps(tri.attr[1][j]))),
+					_mm_mul_ps(wc, _mm_set1_ps(tri.attr[2][j])));
+			}
+			if (S == Shading::Color) {
+				for (int j = 0; j < 3; ++j) {
+					out[j] = _mm_cvttps_epi32(v[j]);
+				}
+			} else if (S == Shading::Normal) {
+				for (int j = 0; j < 3; ++j) {
+					__m128 n = _mm_add_ps(_mm_mul_ps(v[j], _mm_set1_ps(0.5f)), _mm_set1_ps(0.5f));
+					out[j] = _mm_cvttps_epi32(_mm_mul_ps(n, _mm_set1_ps(255.0f)));
+				}
+			} else if (S == Shading::Lambert) {
+				__m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(v[0], v[0]), _mm_mul_ps(v[1], v[1])), _mm_mul_ps(v[2], v[2])));
+				for (int j = 0; j < 3; ++j) {
+					v[j] = _mm_div_ps(v[j], length);
+				}
+				__m128 dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(v[0], _mm_set1_ps(stage.light[0])), _mm_mul_ps(v[1], _mm_set1_ps(stage.light[1]))),
+					_mm_mul_ps(v[2], _mm_set1_ps(stage.light[2])));
+				dot = _mm_max_ps(dot, _mm_setzero_ps());
+				out[0] = out[1] = out[2] = _mm_cvttps_epi32(_mm_mul_ps(dot, _mm_set1_ps(255.0f)));
+			}
+		}
+
+		alignas(16) int rgb[3][4];
+		for (int j = 0; j < 3; ++j) {
+			_mm_store_si128(reinterpret_cast<__m128i*>(rgb[j]), out[j]);
+		}
+		store_rgb(row.color + 3 * base, bits, rgb[0], rgb[1], rgb[2], 4);
+	}
+	return written;
+}
+
+template <Shading S, bool GBuffer>
+RASTER_TARGET("avx2")
+static int row_avx2(const BlockRow& row, const ScreenTriangle& tri, const RasterState& state)
+{
+	if (!edges_fit_32(row)) {
+		return row_scalar<S, GBuffer>(row, tri, state);
+	}
+
+	const ShadeStage& stage = state.shade;
+	__m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i mask = _mm256_and_si256(_mm256_cmpgt_epi32(lane, _mm256_set1_epi32(row.first - 1)),
+		_mm256_cmpgt_epi32(_mm256_set1_epi32(row.last + 1), lane));
+	if (!row.accept) {
+		for (int k = 0; k < 3; ++k) {
+			__m256i e = _mm256_add_epi32(_mm256_set1_epi32(clamped_edge(row, k)),
+				_mm256_mullo_epi32(lane, _mm256_set1_epi32(static_cast<int>(row.edx[k]))));
+			mask = _mm256_andnot_si256(_mm256_cmpgt_epi32(_mm256_setzero_si256(), e), mask);
+		}
+	}
+	__m256 live = _mm256_castsi256_ps(mask);
+	if (_mm256_movemask_ps(live) == 0) {
+		return 0;
+	}
+
+	__m256 k = _mm256_cvtepi32_ps(lane);
+	__m256 a = _mm256_add_ps(_mm256_set1_ps(row.a), _mm256_mul_ps(k, _mm256_set1_ps(row.dadx)));
+	__m256 b = _mm256_add_ps(_mm256_set1_ps(row.b), _mm256_mul_ps(k, _mm256_set1_ps(row.dbdx)));
+	__m256 c = _mm256_sub_ps(_mm256_sub_ps(_mm256_set1_ps(1.0f), a), b);
+	__m256 z = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a, _mm256_set1_ps(tri.z[0])), _mm256_mul_ps(b, _mm256_set1_ps(tri.z[1]))),
+		_mm256_mul_ps(c, _mm256_set1_ps(tri.z[2])));
+	if (state.depthTest) {
+		__m256 old = _mm256_loadu_ps(row.depth);
+		live = _mm256_and_ps(live, _mm256_cmp_ps(z, old, _CMP_GT_OQ));
+		_mm256_storeu_ps(row.depth, _mm256_blendv_ps(old, z, live));
+	}
+	int bits = _mm256_movemask_ps(live);
+	if (bits == 0) {
+		return 0;
+	}
+
+	__m256 wa = a, wb = b, wc = c;
+	if (tri.perspective) {
+		wa = _mm256_mul_ps(wa, _mm256_set1_ps(tri.invW[0]));
+		wb = _mm256_mul_ps(wb, _mm256_set1_ps(tri.invW[1]));
+		wc = _mm256_mul_ps(wc, _mm256_set1_ps(tri.invW[2]));
+		__m256 scale = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_add_ps(_mm256_add_ps(wa, wb), wc));
+		wa = _mm256_mul_ps(wa, scale);
+		wb = _mm256_mul_ps(wb, scale);
+		wc = _mm256_mul_ps(wc, scale);
+	}
+
+	if (GBuffer) {
+		for (int j = 0; uses_attr<S>() && j < 3; ++j) {
+			__m256 v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(wa, _mm256_set1_ps(tri.attr[0][j])), _mm256_mul_ps(wb, _mm256_set1_ps(tri.attr[1][j]))),
+				_mm256_mul_ps(wc, _mm256_set1_ps(tri.attr[2][j])));
+			_mm256_storeu_ps(row.attr[j], _mm256_blendv_ps(_mm256_loadu_ps(row.attr[j]), v, live));
+		}
+		store_id(row.id, bits, row.triangle, 8);
+		return popcount(bits);
+	}
+
+	__m256i out[3];
+	if (S == Shading::Flat) {
+		for (int j = 0; j < 3; ++j) {
+			out[j] = _mm256_set1_epi32(tri.color[j]);
+		}
+	} else if (S == Shading::Depth) {
+		__m256 d = _mm256_div_ps(_mm256_sub_ps(z, _mm256_set1_ps(stage.minZ)), _mm256_set1_ps(stage.maxZ - stage.minZ));
+		out[0] = _mm256_cvttps_epi32(_mm256_mul_ps(d, _mm256_set1_ps(255.0f)));
+		out[1] = out[2] = _mm256_setzero_si256();
+	} else {
+		__m256 v[3];
+		for (int j = 0; j < 3; ++j) {
+			v[j] = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(wa, _mm256_set1_ps(tri.attr[0][j])), _mm256_mul_ps(wb, _mm256_set1_ps(tri.attr[1][j]))),
+				_mm256_mul_ps(wc, _mm256_set1_ps(tri.attr[2][j])));
+		}
+		if (S == Shading::Color) {
+			for (int j = 0; j < 3; ++j) {
+				out[j] = _mm256_cvttps_epi32(v[j]);
+			}
+		} else if (S == Shading::Normal) {
+			for (int j = 0; j < 3; ++j) {
+				__m256 n = _mm256_add_ps(_mm256_mul_ps(v[j], _mm256_set1_ps(0.5f)), _mm256_set1_ps(0.5f));
+				out[j] = _mm256_cvttps_epi32(_mm256_mul_ps(n, _mm256_set1_ps(255.0f)));
+			}
+		} else if (S == Shading::Lambert) {
+			__m256 length = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(v[0], v[0]), _mm256_mul_ps(v[1], v[1])), _mm256_mul_ps(v[2], v[2])));
+			for (int j = 0; j < 3; ++j) {
+				v[j] = _mm256_div_ps(v[j], length);
+			}
+			__m256 dot = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(v[0], _mm256_set1_ps(stage.light[0])), _mm256_mul_ps(v[1], _mm256_set1_ps(stage.light[1]))),
+				_mm256_mul_ps(v[2], _mm256_set1_ps(stage.light[2])));
+			dot = _mm256_max_ps(dot, _mm256_setzero_ps());
+			out[0] = out[1] = out[2] = _mm256_cvttps_epi32(_mm256_mul_ps(dot, _mm256_set1_ps(255.0f)));
+		}
+	}
+
+	alignas(32) int rgb[3][8];
+	for (int j = 0; j < 3; ++j) {
+		_mm256_store_si256(reinterpret_cast<__m256i*>(rgb[j]), out[j]);
+	}
+	store_rgb(row.color, bits, rgb[0], rgb[1], rgb[2], 8);
+	return popcount(bits);
+}
+
+#endif
+
+// out[r][i] = m[r] . (x[i], y[i], z[i], 1), summed left to right in every
+// version so the results match bit for bit.
+static void transform_scalar(const float* m, const float* x, const float* y, const float* z, size_t count, float* const* out)
+{
+	for (int r = 0; r < 4; ++r) {
+		const float* row = m + 4 * r;
+		float* dst = out[r];
+		for (size_t i = 0; i < count; ++i) {
+			dst[i] = row[0] * x[i] + row[1] * y[i] + row[2] * z[i] + row[3];
+		}
+	}
+}
+
+#ifdef RASTER_X86
+
+RASTER_TARGET("sse4.1")
+static void transform_sse41(const float* m, const float* x, const float* y, const float* z, size_t count, float* const* out)
+{
+	size_t body = count / 4 * 4;
+	for (int r = 0; r < 4; ++r) {
+		const float* row = m + 4 * r;
+		__m128 m0 = _mm_set1_ps(row[0]), m1 = _mm_set1_ps(row[1]), m2 = _mm_set1_ps(row[2]), m3 = _mm_set1_ps(row[3]);
+		for (size_t i = 0; i < body; i += 4) {
+			__m128 v = _mm_add_ps(_mm_mul_ps(m0, _mm_loadu_ps(x + i)), _mm_mul_ps(m1, _mm_loadu_ps(y + i)));
+			v = _mm_add_ps(_mm_add_ps(v, _mm_mul_ps(m2, _mm_loadu_ps(z + i))), m3);
+			_mm_storeu_ps(out[r] + i, v);
+		}
+	}
+	float* tail[4] = { out[0] + body, out[1] + body, out[2] + body, out[3] + body };
+	transform_scalar(m, x + body, y + body, z + body, count - body, tail);
+}
+
+RASTER_TARGET("avx2")
+static void transform_avx2(const float* m, const float* x, const float* y, const float* z, size_t count, float* const* out)
+{
+	size_t body = count / 8 * 8;
+	for (int r = 0; r < 4; ++r) {
+		const float* row = m + 4 * r;
+		__m256 m0 = _mm256_set1_ps(row[0]), m1 = _mm256_set1_ps(row[1]), m2 = _mm256_set1_ps(row[2]), m3 = _mm256_set1_ps(row[3]);
+		for (size_t i = 0; i < body; i += 8) {
+			__m256 v = _mm256_add_ps(_mm256_mul_ps(m0, _mm256_loadu_ps(x + i)), _mm256_mul_ps(m1, _mm256_loadu_ps(y + i)));
+			v = _mm256_add_ps(_mm256_add_ps(v, _mm256_mul_ps(m2, _mm256_loadu_ps(z + i))), m3);
+			_mm256_storeu_ps(out[r] + i, v);
+		}
+	}
+	float* tail[4] = { out[0] + body, out[1] + body, out[2] + body, out[3] + body };
+	transform_scalar(m, x + body, y + body, z + body, count - body, tail);
+}
+
+#endif
+
+SimdLevel detect_simd_level()
+{
+#if defined(RASTER_X86) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+	__cpuid(info, 1);
+	bool sse41 = (info[2] & (1 << 19)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx2 = false;
+	if (maxLeaf >= 7 && osxsave && (_xgetbv(0) & 6) == 6) {
+		__cpuidex(info, 7, 0);
+		avx2 = (info[1] & (1 << 5)) != 0;
+	}
+	return avx2 ? SimdLevel::AVX2 : sse41 ? SimdLevel::SSE41 : SimdLevel::Scalar;
+#elif defined(RASTER_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return SimdLevel::AVX2;
+	}
+	if (__builtin_cpu_supports("sse4.1")) {
+		return SimdLevel::SSE41;
+	}
+	return SimdLevel::Scalar;
+#else
+	return SimdLevel::Scalar;
+#endif
+}
+
+const char* simd_level_name(SimdLevel level)
+{
+	switch (level) {
+	case SimdLevel::AVX2: return "avx2";
+	case SimdLevel::SSE41: return "sse4.1";
+	default: return "scalar";
+	}
+}
+
+template <Shading S, bool GBuffer>
+static RowKernel kernel_for(SimdLevel level)
+{
+#ifdef RASTER_X86
+	if (S == Shading::Texture) {
+		return row_scalar<S, GBuffer>;
+	}
+	if (level == SimdLevel::AVX2) {
+		return row_avx2<S, GBuffer>;
+	}
+	if (level == SimdLevel::SSE41) {
+		return row_sse41<S, GBuffer>;
+	}
+#endif
+	return row_scalar<S, GBuffer>;
+}
+
+template <bool GBuffer>
+static RowKernel kernel_for(SimdLevel level, Shading mode)
+{
+	switch (mode) {
+	case Shading::Color: return kernel_for<Shading::Color, GBuffer>(level);
+	case Shading::Depth: return kernel_for<Shading::Depth, GBuffer>(level);
+	case Shading::Normal: return kernel_for<Shading::Normal, GBuffer>(level);
+	case Shading::Lambert: return kernel_for<Shading::Lambert, GBuffer>(level);
+	case Shading::Texture: return kernel_for<Shading::Texture, GBuffer>(level);
+	default: return kernel_for<Shading::Flat, GBuffer>(level);
+	}
+}
+
+RowKernel select_row_kernel(SimdLevel level, Shading mode)
+{
+	return kernel_for<false>(level, mode);
+}
+
+RowKernel select_gbuffer_kernel(SimdLevel level, Shading mode)
+{
+	return kernel_for<true>(level, mode);
+}
+
+RowKernel select_msaa_kernel(Shading mode)
+{
+	switch (mode) {
+	case Shading::Color: return row_msaa<Shading::Color>;
+	case Shading::Depth: return row_msaa<Shading::Depth>;
+	case Shading::Normal: return row_msaa<Shading::Normal>;
+	case Shading::Lambert: return row_msaa<Shading::Lambert>;
+	case Shading::Texture: return row_msaa<Shading::Texture>;
+	default: return row_msaa<Shading::Flat>;
+	}
+}
+
+template <Shading S>
+static size_t shade_gbuffer(const GBufferTile& tile, const ScreenMesh& mesh, const ShadeStage& stage)
+{
+	size_t shaded = 0;
+	for (int y = 0; y < tile.h; ++y) {
+		for (int x = 0; x < tile.w; ++x) {
+			int i = y * tile.stride + x;
+			uint32_t id = tile.id[i];
+			if (id == NO_TRIANGLE) {
+				continue;
+			}
+			float v[3];
+			for (int k = 0; uses_attr<S>() && k < 3; ++k) {
+				v[k] = tile.attr[k * tile.planeSize + i];
+			}
+			const unsigned char* flatColor = S == Shading::Flat ? &mesh.faceColor[3 * id] : nullptr;
+			shade_values<S>(flatColor, stage, v, tile.depth[i], &tile.color[3 * i]);
+			++shaded;
+		}
+	}
+	return shaded;
+}
+
+size_t shade_gbuffer(const GBufferTile& tile, const ScreenMesh& mesh, const ShadeStage& stage)
+{
+	switch (stage.mode) {
+	case Shading::Color: return shade_gbuffer<Shading::Color>(tile, mesh, stage);
+	case Shading::Depth: return shade_gbuffer<Shading::Depth>(tile, mesh, stage);
+	case Shading::Normal: return shade_gbuffer<Shading::Normal>(tile, mesh, stage);
+	case Shading::Lambert: return shade_gbuffer<Shading::Lambert>(tile, mesh, stage);
+	case Shading::Texture: return shade_gbuffer<Shading::Texture>(tile, mesh, stage);
+	default: return shade_gbuffer<Shading::Flat>(tile, mesh, stage);
+	}
+}
+
+TransformKernel select_transform_kernel(SimdLevel level)
+{
+#ifdef RASTER_X86
+	if (level == SimdLevel::AVX2) {
+		return transform_avx2;
+	}
+	if (level == SimdLevel::SSE41) {
+		return transform_sse41;
+	}
+#endif
+	return transform_scalar;
+}
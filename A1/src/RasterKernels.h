@@ -0,0 +1,79 @@
+#pragma once
+#ifndef _RASTERKERNELS_H_
+#define _RASTERKERNELS_H_
+
+#include <cstddef>
+#include <cstdint>
+#include "Rasterizer.h"
+
+// Instruction sets the vertex and per-pixel kernels are built for. The best one the CPU
+// supports is picked at run time; every level produces the same bytes.
+enum class SimdLevel {
+	Scalar,
+	SSE41,
+	AVX2
+};
+
+// One row of an 8x8 block: the pixels bx + lane for lane in [first, last].
+// Edge values, barycentrics and buffer pointers all refer to lane 0, and the
+// depth and color rows must have room for all 8 lanes.
+struct BlockRow {
+	int64_t e[3];
+	const int64_t* edx;
+	int64_t threshold;
+	bool accept; // Every lane is inside the triangle, skip the edge test
+	int first, last;
+	float a, b;
+	float dadx, dbdx;
+	float dady, dbdy; // Only read by Shading::Texture
+	float* depth;
+	unsigned char* color;
+	// G-buffer kernels write these instead of color: three attribute planes
+	// and the id of the triangle.
+	float* attr[3];
+	uint32_t* id;
+	uint32_t triangle;
+	// MSAA kernels: depth holds samples values per pixel, sampleEdge[3 * s + k]
+	// is the offset of edge k at sample s from the pixel center, and color
+	// and coverage receive each lane's shaded color and the samples it won.
+	int samples;
+	const int64_t* sampleEdge;
+	float invDet;
+	unsigned char* coverage;
+};
+
+// Marks G-buffer pixels nothing was drawn to.
+const uint32_t NO_TRIANGLE = 0xffffffffu;
+
+// One tile of the G-buffer for the lighting pass. Plane k of attr starts at
+// k * planeSize; pixels are addressed as y * stride + x.
+struct GBufferTile {
+	int w, h, stride;
+	size_t planeSize;
+	const float* depth;
+	const float* attr;
+	const uint32_t* id;
+	unsigned char* color;
+};
+
+// Tests coverage, interpolates depth and attributes, depth-tests and shades
+// up to 8 pixels, storing only the lanes that pass. Returns how many did.
+// The G-buffer kernels store the attribute and triangle id instead of
+// shading. Texture sampling always uses the scalar kernel.
+typedef int (*RowKernel)(const BlockRow& row, const ScreenTriangle& tri, const RasterState& state);
+
+// Multiplies count points (x[i], y[i], z[i], 1) by the row-major 4x4 matrix
+// m, writing the four homogeneous components to out[0..3].
+typedef void (*TransformKernel)(const float* m, const float* x, const float* y, const float* z, size_t count, float* const* out);
+
+SimdLevel detect_simd_level();
+const char* simd_level_name(SimdLevel level);
+RowKernel select_row_kernel(SimdLevel level, Shading mode);
+RowKernel select_gbuffer_kernel(SimdLevel level, Shading mode);
+// Tests coverage and depth per sample but shades each lane once. Scalar only.
+RowKernel select_msaa_kernel(Shading mode);
+// Shades every pixel of the tile with a triangle id, once. Returns how many.
+size_t shade_gbuffer(const GBufferTile& tile, const ScreenMesh& mesh, const ShadeStage& stage);
+TransformKernel select_transform_kernel(SimdLevel level);
+
+#endif
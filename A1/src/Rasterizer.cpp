@@ -0,0 +1,548 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include "Rasterizer.h"
+#include "RasterKernels.h"
+#include "Image.h"
+#include "WorkStealingPool.h"
+
+using namespace std;
+
+Rasterizer::Rasterizer(int w, int h, int ts, WorkStealingPool* p) :
+	width(w),
+	height(h),
+	tileSize((max(ts, 1) + 7) / 8 * 8),
+	tilesX((w + tileSize - 1) / tileSize),
+	tilesY((h + tileSize - 1) / tileSize),
+	pool(p),
+	simdLevel(detect_simd_level()),
+	samples(1)
+{
+	tiles.resize(tilesX * tilesY);
+	bins.resize(tilesX * tilesY);
+	allocateTiles();
+}
+
+Rasterizer::~Rasterizer()
+{
+}
+
+void Rasterizer::allocateTiles()
+{
+	for (int ty = 0; ty < tilesY; ++ty) {
+		for (int tx = 0; tx < tilesX; ++tx) {
+			Tile& tile = tiles[ty * tilesX + tx];
+			tile.x0 = tx * tileSize;
+			tile.y0 = ty * tileSize;
+			tile.w = min(tileSize, width - tile.x0);
+			tile.h = min(tileSize, height - tile.y0);
+			tile.stride = (tile.w + 7) / 8 * 8;
+			tile.color.resize(tile.stride * tile.h * 3);
+			tile.depth.resize(tile.stride * tile.h * samples);
+			tile.farthest.resize((tile.stride / 8) * ((tile.h + 7) / 8));
+			tile.sampleSlot.resize(samples > 1 ? tile.stride * tile.h : 0);
+		}
+	}
+	clear();
+}
+
+void Rasterizer::clear()
+{
+	for (auto& tile : tiles) {
+		fill(tile.color.begin(), tile.color.end(), 0);
+		fill(tile.depth.begin(), tile.depth.end(), numeric_limits<float>::lowest());
+		fill(tile.farthest.begin(), tile.farthest.end(), numeric_limits<float>::lowest());
+		fill(tile.sampleSlot.begin(), tile.sampleSlot.end(), -1);
+		tile.sampleColor.clear();
+		tile.freeSlots.clear();
+		tile.tileFarthest = numeric_limits<float>::lowest();
+		tile.stats = DepthStats();
+	}
+}
+
+void Rasterizer::setSampleCount(int count)
+{
+	samples = count;
+	allocateTiles();
+}
+
+static void gather_triangle(const ScreenMesh& mesh, size_t t, bool flat, ScreenTriangle& tri)
+{
+	tri.perspective = !mesh.invW.empty();
+	for (int j = 0; j < 3; ++j) {
+		uint32_t v = mesh.indices[3 * t + j];
+		tri.x[j] = mesh.x[v];
+		tri.y[j] = mesh.y[v];
+		tri.z[j] = mesh.z[v];
+		for (int k = 0; k < 3; ++k) {
+			tri.attr[j][k] = mesh.attr[k][v];
+		}
+		tri.invW[j] = tri.perspective ? mesh.invW[v] : 1.0f;
+	}
+	for (int k = 0; k < 3; ++k) {
+		tri.color[k] = flat ? mesh.faceColor[3 * t + k] : 0;
+	}
+}
+
+// Pixel box of a triangle, clipped to the frame. Box coverage keeps the
+// original task 1 extent, which stops at floor(maxX) rather than ceil(maxX).
+static bool triangle_bounds(const ScreenTriangle& tri, Coverage coverage, int width, int height, int& x0, int& x1, int& y0, int& y1)
+{
+	float minX = min(min(tri.x[0], tri.x[1]), tri.x[2]);
+	float maxX = max(max(tri.x[0], tri.x[1]), tri.x[2]);
+	float minY = min(min(tri.y[0], tri.y[1]), tri.y[2]);
+	float maxY = max(max(tri.y[0], tri.y[1]), tri.y[2]);
+
+	x0 = max(static_cast<int>(floor(minX)), 0);
+	y0 = max(static_cast<int>(floor(minY)), 0);
+	if (coverage == Coverage::BoundingBox) {
+		x1 = min(static_cast<int>(floor(maxX)), width - 1);
+		y1 = min(static_cast<int>(floor(maxY)), height - 1);
+	} else {
+		x1 = min(static_cast<int>(ceil(maxX)), width - 1);
+		y1 = min(static_cast<int>(ceil(maxY)), height - 1);
+	}
+	return x0 <= x1 && y0 <= y1;
+}
+
+// Side of the 8x8 blocks used for trivial reject/accept.
+static const int BLOCK = 8;
+// Vertices are snapped to 1/(1 << SUBPIXEL_BITS) of a pixel.
+static const int SUBPIXEL_BITS = 4;
+
+// Smallest and largest value of edge k over the block at (bx, by). The edge
+// is linear, so both are found at corners picked by the gradient signs.
+static inline void block_range(const TriangleSetup& s, int k, int bx, int by, int64_t& lo, int64_t& hi)
+{
+	int64_t origin = s.e[k] + s.edx[k] * bx + s.edy[k] * by;
+	int64_t ex = s.edx[k] * (BLOCK - 1);
+	int64_t ey = s.edy[k] * (BLOCK - 1);
+	lo = origin + min<int64_t>(ex, 0) + min<int64_t>(ey, 0);
+	hi = origin + max<int64_t>(ex, 0) + max<int64_t>(ey, 0);
+}
+
+// Sample positions in 1/16 pixel from the pixel center, in the usual
+// rotated-grid patterns, for 2, 4 and 8 samples.
+static const int SAMPLES_2[2][2] = { { 4, 4 }, { -4, -4 } };
+static const int SAMPLES_4[4][2] = { { -2, -6 }, { 6, -2 }, { -6, 2 }, { 2, 6 } };
+static const int SAMPLES_8[8][2] = { { 1, -3 }, { -1, 3 }, { 5, 1 }, { -3, -5 }, { -5, 5 }, { -7, -1 }, { 3, 7 }, { 7, -7 } };
+
+static const int (*sample_offsets(int samples))[2]
+{
+	return samples == 8 ? SAMPLES_8 : samples == 4 ? SAMPLES_4 : SAMPLES_2;
+}
+
+// Smallest depth over the w x h pixels at depth.
+static float farthest_depth(const float* depth, int stride, int w, int h)
+{
+	float farthest = numeric_limits<float>::max();
+	for (int y = 0; y < h; ++y) {
+		for (int x = 0; x < w; ++x) {
+			farthest = min(farthest, depth[y * stride + x]);
+		}
+	}
+	return farthest;
+}
+
+void Rasterizer::renderTile(Tile& tile, const vector<uint32_t>& bin, const ScreenMesh& mesh, const RasterState& state) const
+{
+	const bool boxOnly = state.coverage == Coverage::BoundingBox;
+	const bool flat = state.shade.mode == Shading::Flat;
+	const bool hiz = state.depthTest && state.hierarchicalZ;
+	const int blocksX = tile.stride / BLOCK;
+	const size_t planeSize = tile.color.size() / 3;
+	const bool msaa = samples > 1;
+	const bool deferred = state.deferred && !msaa;
+	RowKernel kernel = msaa ? select_msaa_kernel(state.shade.mode) :
+		deferred ? select_gbuffer_kernel(simdLevel, state.shade.mode) : select_row_kernel(simdLevel, state.shade.mode);
+	const size_t fragmentsBefore = tile.stats.fragments;
+	const int64_t noEdges[3] = { 0, 0, 0 };
+	unsigned char laneColor[3 * BLOCK];
+	unsigned char laneCoverage[BLOCK];
+	if (deferred) {
+		// Ids are per draw, so only pixels covered by this draw get shaded.
+		tile.attr.resize(3 * planeSize);
+		tile.id.assign(planeSize, NO_TRIANGLE);
+	}
+
+	for (uint32_t t : bin) {
+		const TriangleSetup& s = setups[t];
+		// The depth test only passes nearer pixels, so a triangle that cannot
+		// beat the farthest depth of a tile or block has nothing to draw there.
+		if (hiz && s.zNearest <= tile.tileFarthest) {
+			++tile.stats.trianglesRejected;
+			continue;
+		}
+		ScreenTriangle tri;
+		gather_triangle(mesh, t, flat, tri);
+		int x0 = max(s.x0, tile.x0);
+		int y0 = max(s.y0, tile.y0);
+		int x1 = min(s.x1, tile.x0 + tile.w - 1);
+		int y1 = min(s.y1, tile.y0 + tile.h - 1);
+
+		BlockRow row;
+		row.triangle = t;
+		row.edx = boxOnly ? noEdges : s.edx;
+		row.threshold = s.threshold;
+		row.dadx = boxOnly ? 0.0f : s.edx[0] * s.invDet;
+		row.dbdx = boxOnly ? 0.0f : s.edx[1] * s.invDet;
+		row.dady = boxOnly ? 0.0f : s.edy[0] * s.invDet;
+		row.dbdy = boxOnly ? 0.0f : s.edy[1] * s.invDet;
+		bool deeper = false;
+
+		// Edge steps are whole pixels of 1/16 pixel units, so the offset to a
+		// sample is exact. Blocks are tested with a half-pixel margin, which
+		// covers every sample position.
+		int64_t sampleEdge[3 * 8];
+		int64_t margin[3] = { 0, 0, 0 };
+		if (msaa) {
+			const int (*offsets)[2] = sample_offsets(samples);
+			for (int j = 0; j < samples; ++j) {
+				for (int k = 0; k < 3; ++k) {
+					sampleEdge[3 * j + k] = boxOnly ? 0 : (s.edx[k] * offsets[j][0] + s.edy[k] * offsets[j][1]) >> SUBPIXEL_BITS;
+				}
+			}
+			for (int k = 0; !boxOnly && k < 3; ++k) {
+				margin[k] = (llabs(s.edx[k]) + llabs(s.edy[k])) / 2;
+			}
+			row.samples = samples;
+			row.sampleEdge = sampleEdge;
+			row.invDet = boxOnly ? 0.0f : s.invDet;
+			row.coverage = laneCoverage;
+		}
+
+		// Blocks are aligned to the frame rather than the tile, so the result
+		// does not depend on the tile size.
+		for (int by = y0 - y0 % BLOCK; by <= y1; by += BLOCK) {
+			for (int bx = x0 - x0 % BLOCK; bx <= x1; bx += BLOCK) {
+				float* blockFarthest = &tile.farthest[(by - tile.y0) / BLOCK * blocksX + (bx - tile.x0) / BLOCK];
+				if (hiz && s.zNearest <= *blockFarthest) {
+					++tile.stats.blocksRejected;
+					continue;
+				}
+				row.accept = boxOnly;
+				if (!boxOnly) {
+					bool reject = false;
+					row.accept = true;
+					for (int k = 0; k < 3; ++k) {
+						int64_t lo, hi;
+						block_range(s, k, bx, by, lo, hi);
+						reject = reject || hi + margin[k] < s.threshold;
+						row.accept = row.accept && lo - margin[k] >= s.threshold;
+					}
+					if (reject) {
+						continue;
+					}
+				}
+
+				row.first = max(bx, x0) - bx;
+				row.last = min(bx + BLOCK - 1, x1) - bx;
+				int written = 0;
+				for (int y = max(by, y0); y <= min(by + BLOCK - 1, y1); ++y) {
+					for (int k = 0; k < 3; ++k) {
+						row.e[k] = boxOnly ? 0 : s.e[k] + s.edx[k] * bx + s.edy[k] * y;
+					}
+					row.a = boxOnly ? 0.0f : row.e[0] * s.invDet;
+					row.b = boxOnly ? 0.0f : row.e[1] * s.invDet;
+					int i = (y - tile.y0) * tile.stride + (bx - tile.x0);
+					row.depth = &tile.depth[i * samples];
+					row.color = msaa ? laneColor : &tile.color[3 * i];
+					if (deferred) {
+						for (int k = 0; k < 3; ++k) {
+							row.attr[k] = &tile.attr[k * planeSize + i];
+						}
+						row.id = &tile.id[i];
+					}
+					int rowWritten = kernel(row, tri, state);
+					for (int lane = row.first; msaa && rowWritten > 0 && lane <= row.last; ++lane) {
+						if (laneCoverage[lane]) {
+							storeSamples(tile, i + lane, laneCoverage[lane], &laneColor[3 * lane]);
+						}
+					}
+					written += rowWritten;
+				}
+				tile.stats.fragments += written;
+
+				if (hiz && written > 0) {
+					int i = (by - tile.y0) * tile.stride + (bx - tile.x0);
+					int w = min(BLOCK, tile.x0 + tile.w - bx);
+					int h = min(BLOCK, tile.y0 + tile.h - by);
+					*blockFarthest = farthest_depth(&tile.depth[i * samples], tile.stride * samples, w * samples, h);
+					deeper = true;
+				}
+			}
+		}
+
+		if (deeper) {
+			tile.tileFarthest = *min_element(tile.farthest.begin(), tile.farthest.end());
+		}
+	}
+
+	if (deferred) {
+		GBufferTile gbuffer = { tile.w, tile.h, tile.stride, planeSize, tile.depth.data(), tile.attr.data(), tile.id.data(), tile.color.data() };
+		tile.stats.shaded += shade_gbuffer(gbuffer, mesh, state.shade);
+	} else {
+		tile.stats.shaded += tile.stats.fragments - fragmentsBefore;
+	}
+}
+
+// A pixel stays compressed, one color for every sample, as long as each
+// write either covers all of its samples or leaves the color unchanged.
+void Rasterizer::storeSamples(Tile& tile, int i, unsigned mask, const unsigned char* rgb) const
+{
+	int32_t& slot = tile.sampleSlot[i];
+	unsigned char* color = &tile.color[3 * i];
+	if (mask == (1u << samples) - 1) {
+		if (slot >= 0) {
+			tile.freeSlots.push_back(slot);
+			slot = -1;
+		}
+		copy(rgb, rgb + 3, color);
+		return;
+	}
+	if (slot < 0) {
+		if (equal(rgb, rgb + 3, color)) {
+			return;
+		}
+		if (tile.freeSlots.empty()) {
+			slot = static_cast<int32_t>(tile.sampleColor.size() / (3 * samples));
+			tile.sampleColor.resize(tile.sampleColor.size() + 3 * samples);
+		} else {
+			slot = tile.freeSlots.back();
+			tile.freeSlots.pop_back();
+		}
+		for (int j = 0; j < samples; ++j) {
+			copy(color, color + 3, &tile.sampleColor[(slot * samples + j) * 3]);
+		}
+	}
+	for (int j = 0; j < samples; ++j) {
+		if (mask & (1u << j)) {
+			copy(rgb, rgb + 3, &tile.sampleColor[(slot * samples + j) * 3]);
+		}
+	}
+}
+
+// Vertices snapped to 1/16 pixel, and twice the signed area in those units,
+// positive for counter-clockwise triangles.
+struct SnappedTriangle {
+	int64_t X[3], Y[3];
+	int64_t det;
+};
+
+static void snap_triangle(const ScreenTriangle& tri, SnappedTriangle& s)
+{
+	const float scale = static_cast<float>(1 << SUBPIXEL_BITS);
+	for (int k = 0; k < 3; ++k) {
+		s.X[k] = llround(tri.x[k] * scale);
+		s.Y[k] = llround(tri.y[k] * scale);
+	}
+	// Same numerators as the barycentric formulas.
+	s.det = (s.Y[1] - s.Y[2]) * (s.X[0] - s.X[2]) + (s.X[2] - s.X[1]) * (s.Y[0] - s.Y[2]);
+}
+
+// Pixel centers sit on integer coordinates, so a triangle whose snapped box
+// has no integer column or row between its sides covers none of them.
+static bool misses_pixel_centers(const SnappedTriangle& s)
+{
+	const int64_t one = 1 << SUBPIXEL_BITS;
+	int64_t minX = min(min(s.X[0], s.X[1]), s.X[2]);
+	int64_t maxX = max(max(s.X[0], s.X[1]), s.X[2]);
+	int64_t minY = min(min(s.Y[0], s.Y[1]), s.Y[2]);
+	int64_t maxY = max(max(s.Y[0], s.Y[1]), s.Y[2]);
+	auto floorDiv = [&](int64_t v) { return v >= 0 ? v / one : -((-v + one - 1) / one); };
+	return floorDiv(minX + one - 1) > floorDiv(maxX) || floorDiv(minY + one - 1) > floorDiv(maxY);
+}
+
+// Returns true, and counts it, if the triangle should not be drawn. Box
+// coverage fills even degenerate triangles, so it only culls by facing, and
+// with multisampling a triangle between pixel centers may still cover
+// samples.
+static bool cull_triangle(const SnappedTriangle& s, Coverage coverage, CullMode mode, bool multisampled, CullStats& stats)
+{
+	bool boxOnly = coverage == Coverage::BoundingBox;
+	bool subPixel = mode != CullMode::None && !multisampled && misses_pixel_centers(s);
+	if (!boxOnly && (s.det == 0 || subPixel)) {
+		++stats.degenerate;
+		return true;
+	}
+	if ((mode == CullMode::Back && s.det < 0) || (mode == CullMode::Front && s.det > 0)) {
+		++stats.facing;
+		return true;
+	}
+	return false;
+}
+
+// Fills in the edge functions of s from a triangle with nonzero area.
+static void setup_edges(const SnappedTriangle& snapped, Coverage coverage, TriangleSetup& s)
+{
+	const float EPSILON = 0.0001f;
+	const int64_t* X = snapped.X;
+	const int64_t* Y = snapped.Y;
+	int64_t det = snapped.det;
+	int64_t sign = det > 0 ? 1 : -1;
+	int64_t A[3] = { (Y[1] - Y[2]) * sign, (Y[2] - Y[0]) * sign, (Y[0] - Y[1]) * sign };
+	int64_t B[3] = { (X[2] - X[1]) * sign, (X[0] - X[2]) * sign, (X[1] - X[0]) * sign };
+	int64_t refX[3] = { X[2], X[2], X[0] };
+	int64_t refY[3] = { Y[2], Y[2], Y[0] };
+	for (int k = 0; k < 3; ++k) {
+		s.e[k] = -(A[k] * refX[k] + B[k] * refY[k]);
+		s.edx[k] = A[k] << SUBPIXEL_BITS;
+		s.edy[k] = B[k] << SUBPIXEL_BITS;
+	}
+	det *= sign;
+	s.invDet = 1.0f / static_cast<float>(det);
+	s.threshold = coverage == Coverage::BarycentricEpsilon ? -static_cast<int64_t>(EPSILON * det) : 0;
+}
+
+void Rasterizer::draw(const ScreenMesh& mesh, const RasterState& state)
+{
+	for (auto& bin : bins) {
+		bin.clear();
+	}
+
+	// Set up and bin every triangle into the tiles its bounding box overlaps.
+	// Triangles are appended in order, so each tile sees them in submission
+	// order. Culled triangles are skipped here, before any edge setup.
+	const size_t triangleCount = mesh.getTriangleCount();
+	setups.resize(triangleCount);
+	cullStats = CullStats();
+	const bool boxOnly = state.coverage == Coverage::BoundingBox;
+	for (size_t t = 0; t < triangleCount; ++t) {
+		ScreenTriangle tri;
+		gather_triangle(mesh, t, false, tri);
+		TriangleSetup& s = setups[t];
+		if (!triangle_bounds(tri, state.coverage, width, height, s.x0, s.x1, s.y0, s.y1)) {
+			continue;
+		}
+		// Interpolation can overshoot the vertex depths by a few ulps, and by
+		// the tolerance of epsilon coverage, so the bound gets some slack.
+		float zMin = min(min(tri.z[0], tri.z[1]), tri.z[2]);
+		float zMax = max(max(tri.z[0], tri.z[1]), tri.z[2]);
+		s.zNearest = zMax + 0.001f * (zMax - zMin) + 1e-5f * max(fabs(zMin), fabs(zMax));
+		if (!boxOnly || state.cull != CullMode::None) {
+			SnappedTriangle snapped;
+			snap_triangle(tri, snapped);
+			if (cull_triangle(snapped, state.coverage, state.cull, samples > 1, cullStats)) {
+				continue;
+			}
+			if (!boxOnly) {
+				setup_edges(snapped, state.coverage, s);
+			}
+		}
+		for (int ty = s.y0 / tileSize; ty <= s.y1 / tileSize; ++ty) {
+			for (int tx = s.x0 / tileSize; tx <= s.x1 / tileSize; ++tx) {
+				bins[ty * tilesX + tx].push_back(static_cast<uint32_t>(t));
+			}
+		}
+	}
+
+	activeTiles.clear();
+	for (size_t i = 0; i < tiles.size(); ++i) {
+		if (!bins[i].empty()) {
+			activeTiles.push_back(static_cast<int>(i));
+		}
+	}
+
+	auto renderActive = [&](int k) {
+		int i = activeTiles[k];
+		renderTile(tiles[i], bins[i], mesh, state);
+	};
+	if (pool) {
+		pool->run(static_cast<int>(activeTiles.size()), renderActive);
+	} else {
+		for (int k = 0; k < static_cast<int>(activeTiles.size()); ++k) {
+			renderActive(k);
+		}
+	}
+}
+
+void Rasterizer::resolve(Image& image) const
+{
+	// Tiles cover disjoint pixels, so they can be copied out concurrently,
+	// a tile row at a time.
+	auto copyTile = [&](int i) {
+		const Tile& tile = tiles[i];
+		if (samples == 1) {
+			for (int y = 0; y < tile.h; ++y) {
+				image.setSpan(tile.x0, tile.y0 + y, tile.w, &tile.color[3 * y * tile.stride]);
+			}
+			return;
+		}
+		vector<unsigned char> rgb(3 * tile.w);
+		vector<float> linear(image.hasLinear() ? 3 * tile.w : 0);
+		for (int y = 0; y < tile.h; ++y) {
+			const unsigned char* row = &tile.color[3 * y * tile.stride];
+			copy(row, row + 3 * tile.w, rgb.begin());
+			for (int x = 0; x < tile.w; ++x) {
+				int p = y * tile.stride + x;
+				if (tile.sampleSlot[p] < 0) {
+					continue;
+				}
+				// Box filter over the samples, rounded to nearest.
+				const unsigned char* sample = &tile.sampleColor[tile.sampleSlot[p] * samples * 3];
+				int sum[3] = { 0, 0, 0 };
+				for (int j = 0; j < samples; ++j) {
+					for (int k = 0; k < 3; ++k) {
+						sum[k] += sample[3 * j + k];
+					}
+				}
+				for (int k = 0; k < 3; ++k) {
+					rgb[3 * x + k] = static_cast<unsigned char>((sum[k] + samples / 2) / samples);
+				}
+				if (!linear.empty()) {
+					// The float plane keeps the average unrounded.
+					const float scale = 1.0f / (255.0f * samples);
+					for (int k = 0; k < 3; ++k) {
+						linear[3 * x + k] = sum[k] * scale;
+					}
+				}
+			}
+			image.setSpan(tile.x0, tile.y0 + y, tile.w, rgb.data());
+			if (!linear.empty()) {
+				// Pixels with a single color take it over 255, as setSpan left them.
+				for (int x = 0; x < tile.w; ++x) {
+					if (tile.sampleSlot[y * tile.stride + x] < 0) {
+						for (int k = 0; k < 3; ++k) {
+							linear[3 * x + k] = rgb[3 * x + k] / 255.0f;
+						}
+					}
+				}
+				image.setLinearSpan(tile.x0, tile.y0 + y, tile.w, linear.data());
+			}
+		}
+	};
+	if (pool) {
+		pool->run(static_cast<int>(tiles.size()), copyTile);
+	} else {
+		for (int i = 0; i < static_cast<int>(tiles.size()); ++i) {
+			copyTile(i);
+		}
+	}
+}
+
+DepthStats Rasterizer::getDepthStats() const
+{
+	DepthStats total;
+	for (const auto& tile : tiles) {
+		total.fragments += tile.stats.fragments;
+		total.trianglesRejected += tile.stats.trianglesRejected;
+		total.blocksRejected += tile.stats.blocksRejected;
+		total.shaded += tile.stats.shaded;
+	}
+	return total;
+}
+
+size_t Rasterizer::countCoveredPixels() const
+{
+	size_t covered = 0;
+	for (const auto& tile : tiles) {
+		for (int y = 0; y < tile.h; ++y) {
+			for (int x = 0; x < tile.w; ++x) {
+				const float* depth = &tile.depth[(y * tile.stride + x) * samples];
+				covered += any_of(depth, depth + samples, [](float z) { return z != numeric_limits<float>::lowest(); });
+			}
+		}
+	}
+	return covered;
+}
@@ -0,0 +1,206 @@
+#pragma once
+#ifndef _RASTERIZER_H_
+#define _RASTERIZER_H_
+
+#include <vector>
+#include <cstdint>
+
+class Image;
+class Texture;
+class WorkStealingPool;
+enum class SimdLevel;
+
+// Indexed mesh after the fit-to-image transform, one entry per shared vertex
+// in each array. x and y are in pixels, z is the value used by the depth test
+// (larger is closer), and attr holds the per-vertex values (color, normal or
+// texture coordinates) that the shading stage interpolates. invW is 1/w of
+// each vertex under a perspective view, for perspective-correct
+// interpolation, and is empty when the view is affine. faceColor holds one
+// RGB triple per triangle and is only read by Shading::Flat.
+struct ScreenMesh {
+	std::vector<float> x, y, z;
+	std::vector<float> attr[3];
+	std::vector<float> invW;
+	std::vector<uint32_t> indices; // Three per triangle
+	std::vector<unsigned char> faceColor;
+	size_t getTriangleCount() const { return indices.size() / 3; }
+};
+
+// One triangle of a ScreenMesh, gathered by the rasterizer for setup and for
+// the row kernels.
+struct ScreenTriangle {
+	float x[3], y[3], z[3];
+	float attr[3][3];
+	float invW[3];
+	bool perspective;       // invW is set
+	unsigned char color[3]; // Used by Shading::Flat
+};
+
+// Per-triangle values computed once before rasterizing. Vertices are
+// snapped to 1/16 pixel and each edge becomes an integer function
+// e[k] + edx[k] * x + edy[k] * y of the pixel position, so stepping it is
+// exact. Edge k is the numerator of barycentric coordinate k, positive
+// inside the triangle; invDet turns it into the coordinate itself.
+struct TriangleSetup {
+	int x0, x1, y0, y1;
+	int64_t e[3], edx[3], edy[3];
+	int64_t threshold;
+	float invDet;
+	float zNearest; // Upper bound on the interpolated depth
+};
+
+// Which pixels of a triangle's bounding box get shaded.
+enum class Coverage {
+	BoundingBox,        // Every pixel of the box (task 1)
+	BarycentricEpsilon, // Barycentric test with a small tolerance (task 2)
+	Barycentric         // Strict barycentric test (task 3 onward)
+};
+
+// How a covered pixel turns into a color.
+enum class Shading {
+	Flat,    // The triangle's color
+	Color,   // Interpolated attr, already in [0, 255]
+	Depth,   // Red channel from z, scaled by minZ/maxZ
+	Normal,  // Interpolated attr mapped from [-1, 1] to [0, 255]
+	Lambert, // Normalized attr dotted with light
+	Texture  // attr holds u and v, sampled from texture with mipmaps
+};
+
+// Triangles dropped before setup. Triangles with no area after snapping are
+// always dropped; every mode but None also drops triangles too small to
+// cover a pixel center. Front faces wind counter-clockwise on screen.
+enum class CullMode {
+	None,
+	Degenerate, // Only zero-area and sub-pixel triangles
+	Back,       // Degenerate plus back faces
+	Front       // Degenerate plus front faces
+};
+
+struct CullStats {
+	size_t facing = 0;     // Dropped by Back or Front
+	size_t degenerate = 0; // Zero-area or sub-pixel
+};
+
+// Overdraw and early depth rejection counts.
+struct DepthStats {
+	size_t fragments = 0;         // Pixels shaded, counting every overwrite
+	size_t trianglesRejected = 0; // Triangle-tile pairs skipped by the coarse depth
+	size_t blocksRejected = 0;    // 8x8 blocks skipped by the coarse depth
+	size_t shaded = 0;            // Lighting evaluations; fragments unless deferred
+};
+
+struct ShadeStage {
+	Shading mode = Shading::Flat;
+	float minZ = 0.0f;
+	float maxZ = 1.0f;
+	float light[3] = { 0.0f, 0.0f, 0.0f };
+	const Texture* texture = nullptr;
+};
+
+struct RasterState {
+	Coverage coverage = Coverage::Barycentric;
+	bool depthTest = false;
+	bool hierarchicalZ = true; // Early rejection against the coarse depth
+	bool deferred = false;     // Shade after visibility, once per pixel
+	CullMode cull = CullMode::None;
+	ShadeStage shade;
+};
+
+// Tile-binned rasterizer. The frame is split into square tiles and each tile
+// keeps its own color and depth storage, so while a tile is being shaded its
+// whole working set stays in cache. draw() reads the indexed mesh directly,
+// bins the triangles by the tiles their bounding boxes touch and then
+// renders the tiles one at a time, in submission order within each tile.
+//
+// Coverage uses integer edge functions set up once per triangle and stepped
+// by additions. Each triangle is walked in 8x8 blocks aligned to the frame;
+// a block whose corners are all outside one edge is skipped, and one whose
+// corners are all inside every edge is filled without per-pixel tests.
+// Block rows go through an 8-wide SIMD kernel (see RasterKernels.h); the
+// tile size is rounded up to a multiple of 8 to match.
+//
+// With depth testing, each tile also keeps the farthest depth of every 8x8
+// block and of the whole tile. A triangle that cannot come nearer than the
+// tile's farthest depth skips the tile, and one that cannot come nearer than
+// a block's skips the block, before any per-pixel work.
+//
+// In deferred mode the visibility pass stores depth, the interpolated
+// attribute and the triangle id (which picks the per-face material) in a
+// per-tile G-buffer instead of shading. Once every triangle of the tile is
+// in, each pixel a triangle of this draw ended up covering is shaded
+// exactly once, however many fragments were drawn to it.
+//
+// With MSAA, coverage and depth are tested at 2, 4 or 8 rotated-grid sample
+// positions per pixel, but each triangle is shaded once per pixel it
+// touches. Sample colors are stored compressed: a pixel keeps a single color
+// until a triangle covers only some of its samples, and only then gets a
+// color per sample, which resolve() averages. Deferred shading is not
+// available with MSAA.
+//
+// With a pool, tiles are handed to its workers. Every tile owns its slice of
+// the color and depth buffers, so tiles need no locking and the output is
+// the same for any thread count.
+class Rasterizer
+{
+public:
+	Rasterizer(int width, int height, int tileSize = 32, WorkStealingPool* pool = nullptr);
+	virtual ~Rasterizer();
+	void clear();
+	void draw(const ScreenMesh& mesh, const RasterState& state);
+	void resolve(Image& image) const;
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+	int getTileSize() const { return tileSize; }
+	// Triangles culled by the last draw().
+	const CullStats& getCullStats() const { return cullStats; }
+	// Totals over every draw() since the last clear().
+	DepthStats getDepthStats() const;
+	// Pixels that passed a depth test since the last clear().
+	size_t countCoveredPixels() const;
+	// Defaults to the best level the CPU supports.
+	void setSimdLevel(SimdLevel level) { simdLevel = level; }
+	SimdLevel getSimdLevel() const { return simdLevel; }
+	// 1 (the default), 2, 4 or 8 samples per pixel. Also clears.
+	void setSampleCount(int count);
+	int getSampleCount() const { return samples; }
+
+private:
+	// Rows are padded to a multiple of 8 pixels so the row kernels can load
+	// and store whole 8-pixel block rows. farthest holds the smallest depth
+	// of each 8x8 block, row by row, and of the whole tile. With MSAA, depth
+	// holds every sample of a pixel next to each other, and a pixel whose
+	// samples differ in color has a slot of per-sample colors.
+	struct Tile {
+		int x0, y0, w, h, stride;
+		std::vector<unsigned char> color;
+		std::vector<float> depth;
+		std::vector<float> farthest;
+		std::vector<float> attr; // G-buffer, three planes of stride * h
+		std::vector<uint32_t> id;
+		std::vector<int32_t> sampleSlot; // -1 while every sample has color
+		std::vector<unsigned char> sampleColor;
+		std::vector<int32_t> freeSlots;
+		float tileFarthest;
+		DepthStats stats;
+	};
+
+	void allocateTiles();
+	void renderTile(Tile& tile, const std::vector<uint32_t>& bin, const ScreenMesh& mesh, const RasterState& state) const;
+	void storeSamples(Tile& tile, int i, unsigned mask, const unsigned char* rgb) const;
+
+	int width;
+	int height;
+	int tileSize;
+	int tilesX;
+	int tilesY;
+	std::vector<Tile> tiles;
+	std::vector<std::vector<uint32_t>> bins;
+	std::vector<TriangleSetup> setups;
+	std::vector<int> activeTiles;
+	WorkStealingPool* pool;
+	SimdLevel simdLevel;
+	int samples;
+	CullStats cullStats;
+};
+
+#endif
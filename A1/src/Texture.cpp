@@ -0,0 +1,137 @@
+#include <algorithm>
+#include <cmath>
+#include "Texture.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+using namespace std;
+
+static const int TILE = 8;
+
+Texture::Texture()
+{
+}
+
+Texture::~Texture()
+{
+}
+
+bool Texture::load(const string& filename, string& err)
+{
+	int w, h, comps;
+	stbi_set_flip_vertically_on_load(true);
+	unsigned char* data = stbi_load(filename.c_str(), &w, &h, &comps, 3);
+	if (!data) {
+		err = filename + ": " + stbi_failure_reason();
+		return false;
+	}
+	setPixels(w, h, data);
+	stbi_image_free(data);
+	return true;
+}
+
+void Texture::allocate(Level& level, int w, int h)
+{
+	level.w = w;
+	level.h = h;
+	level.tilesX = (w + TILE - 1) / TILE;
+	level.texels.assign(level.tilesX * ((h + TILE - 1) / TILE) * TILE * TILE * 4, 0);
+}
+
+size_t Texture::offset(const Level& level, int x, int y)
+{
+	size_t tile = (y / TILE) * level.tilesX + x / TILE;
+	return 4 * (tile * TILE * TILE + (y % TILE) * TILE + x % TILE);
+}
+
+const unsigned char* Texture::texel(const Level& level, int x, int y)
+{
+	return &level.texels[offset(level, x, y)];
+}
+
+void Texture::setTexel(Level& level, int x, int y, const unsigned char* rgb)
+{
+	copy(rgb, rgb + 3, &level.texels[offset(level, x, y)]);
+}
+
+void Texture::setPixels(int w, int h, const unsigned char* rgb)
+{
+	levels.clear();
+	levels.emplace_back();
+	allocate(levels[0], w, h);
+	for (int y = 0; y < h; ++y) {
+		for (int x = 0; x < w; ++x) {
+			setTexel(levels[0], x, y, &rgb[3 * (y * w + x)]);
+		}
+	}
+
+	// Each level is the 2x2 box filter of the one above, down to 1x1. Odd
+	// sizes reuse the last row or column.
+	while (levels.back().w > 1 || levels.back().h > 1) {
+		levels.emplace_back();
+		const Level& src = levels[levels.size() - 2];
+		Level& dst = levels.back();
+		allocate(dst, max(src.w / 2, 1), max(src.h / 2, 1));
+		for (int y = 0; y < dst.h; ++y) {
+			int y0 = min(2 * y, src.h - 1), y1 = min(2 * y + 1, src.h - 1);
+			for (int x = 0; x < dst.w; ++x) {
+				int x0 = min(2 * x, src.w - 1), x1 = min(2 * x + 1, src.w - 1);
+				const unsigned char* t[4] = { texel(src, x0, y0), texel(src, x1, y0), texel(src, x0, y1), texel(src, x1, y1) };
+				unsigned char avg[3];
+				for (int k = 0; k < 3; ++k) {
+					avg[k] = static_cast<unsigned char>((t[0][k] + t[1][k] + t[2][k] + t[3][k] + 2) / 4);
+				}
+				setTexel(dst, x, y, avg);
+			}
+		}
+	}
+}
+
+void Texture::bilinear(const Level& level, float u, float v, float* rgb)
+{
+	float x = u * level.w - 0.5f;
+	float y = v * level.h - 0.5f;
+	float fx = floor(x), fy = floor(y);
+	float tx = x - fx, ty = y - fy;
+	// Wrap for repeat; the modulo of a negative int is negative.
+	int x0 = static_cast<int>(fmod(fx, static_cast<float>(level.w)));
+	int y0 = static_cast<int>(fmod(fy, static_cast<float>(level.h)));
+	x0 += x0 < 0 ? level.w : 0;
+	y0 += y0 < 0 ? level.h : 0;
+	int x1 = x0 + 1 == level.w ? 0 : x0 + 1;
+	int y1 = y0 + 1 == level.h ? 0 : y0 + 1;
+	const unsigned char* t00 = texel(level, x0, y0);
+	const unsigned char* t10 = texel(level, x1, y0);
+	const unsigned char* t01 = texel(level, x0, y1);
+	const unsigned char* t11 = texel(level, x1, y1);
+	for (int k = 0; k < 3; ++k) {
+		float bottom = t00[k] + tx * (t10[k] - t00[k]);
+		float top = t01[k] + tx * (t11[k] - t01[k]);
+		rgb[k] = bottom + ty * (top - bottom);
+	}
+}
+
+void Texture::sample(float u, float v, float lod, unsigned char* rgb) const
+{
+	if (levels.empty()) {
+		rgb[0] = rgb[1] = rgb[2] = 0;
+		return;
+	}
+	if (!isfinite(u) || !isfinite(v)) {
+		u = v = 0.0f;
+	}
+	const int last = static_cast<int>(levels.size()) - 1;
+	lod = lod > 0.0f ? min(lod, static_cast<float>(last)) : 0.0f;
+	int level = min(static_cast<int>(lod), last);
+	float t = lod - level;
+	float fine[3], coarse[3] = { 0.0f, 0.0f, 0.0f };
+	bilinear(levels[level], u, v, fine);
+	if (t > 0.0f) {
+		bilinear(levels[level + 1], u, v, coarse);
+	}
+	for (int k = 0; k < 3; ++k) {
+		float c = fine[k] + t * (coarse[k] - fine[k]);
+		rgb[k] = static_cast<unsigned char>(min(max(c + 0.5f, 0.0f), 255.0f));
+	}
+}
@@ -0,0 +1,43 @@
+#pragma once
+#ifndef _TEXTURE_H_
+#define _TEXTURE_H_
+
+#include <string>
+#include <vector>
+
+// RGB texture with a full mip chain for the software rasterizer. Every level
+// is stored in 8x8 texel tiles, each tile contiguous, so the texels a
+// bilinear lookup and its neighbors touch share a few cache lines whatever
+// direction a triangle walks the texture in. Coordinates repeat outside
+// [0, 1], and v = 0 is the bottom row of the image.
+class Texture
+{
+public:
+	Texture();
+	virtual ~Texture();
+	bool load(const std::string& filename, std::string& err);
+	// Takes w * h RGB texels, bottom row first, and builds the mip chain.
+	void setPixels(int w, int h, const unsigned char* rgb);
+	int getWidth() const { return levels.empty() ? 0 : levels[0].w; }
+	int getHeight() const { return levels.empty() ? 0 : levels[0].h; }
+	int getLevelCount() const { return static_cast<int>(levels.size()); }
+	// Trilinear lookup: bilinear in the two levels around lod, where level 0
+	// is the full image, blended by the fraction of lod.
+	void sample(float u, float v, float lod, unsigned char* rgb) const;
+
+private:
+	struct Level {
+		int w, h, tilesX;
+		std::vector<unsigned char> texels; // RGBA, 64 per tile
+	};
+
+	static size_t offset(const Level& level, int x, int y);
+	static const unsigned char* texel(const Level& level, int x, int y);
+	static void setTexel(Level& level, int x, int y, const unsigned char* rgb);
+	static void bilinear(const Level& level, float u, float v, float* rgb);
+	static void allocate(Level& level, int w, int h);
+
+	std::vector<Level> levels;
+};
+
+#endif
@@ -0,0 +1,304 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "VertexStage.h"
+#include "Mesh.h"
+#include "RasterKernels.h"
+
+using namespace std;
+
+Mat4 Mat4::identity()
+{
+	Mat4 r = {};
+	for (int i = 0; i < 4; ++i) {
+		r.m[i][i] = 1.0f;
+	}
+	return r;
+}
+
+Mat4 Mat4::operator*(const Mat4& b) const
+{
+	Mat4 r = {};
+	for (int i = 0; i < 4; ++i) {
+		for (int j = 0; j < 4; ++j) {
+			for (int k = 0; k < 4; ++k) {
+				r.m[i][j] += m[i][k] * b.m[k][j];
+			}
+		}
+	}
+	return r;
+}
+
+static void normalize(float v[3])
+{
+	float length = sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+	for (int k = 0; k < 3; ++k) {
+		v[k] /= length;
+	}
+}
+
+static void cross(const float a[3], const float b[3], float out[3])
+{
+	out[0] = a[1] * b[2] - a[2] * b[1];
+	out[1] = a[2] * b[0] - a[0] * b[2];
+	out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+Mat4 look_at(const float eye[3], const float target[3], const float up[3])
+{
+	float f[3] = { target[0] - eye[0], target[1] - eye[1], target[2] - eye[2] };
+	normalize(f);
+	float s[3], u[3];
+	cross(f, up, s);
+	normalize(s);
+	cross(s, f, u);
+
+	Mat4 r = Mat4::identity();
+	for (int k = 0; k < 3; ++k) {
+		r.m[0][k] = s[k];
+		r.m[1][k] = u[k];
+		r.m[2][k] = -f[k];
+	}
+	r.m[0][3] = -(s[0] * eye[0] + s[1] * eye[1] + s[2] * eye[2]);
+	r.m[1][3] = -(u[0] * eye[0] + u[1] * eye[1] + u[2] * eye[2]);
+	r.m[2][3] = f[0] * eye[0] + f[1] * eye[1] + f[2] * eye[2];
+	return r;
+}
+
+Mat4 perspective(float fovy, float aspect, float zNear)
+{
+	float f = 1.0f / tan(fovy / 2);
+	Mat4 r = {};
+	r.m[0][0] = f / aspect;
+	r.m[1][1] = f;
+	r.m[2][3] = zNear;
+	r.m[3][2] = -1.0f;
+	return r;
+}
+
+Mat4 viewport(int width, int height)
+{
+	Mat4 r = Mat4::identity();
+	r.m[0][0] = r.m[0][3] = width / 2.0f;
+	r.m[1][1] = r.m[1][3] = height / 2.0f;
+	return r;
+}
+
+void depth_range(const Mesh& mesh, const ViewTransform& view, float& minZ, float& maxZ)
+{
+	const float (*m)[4] = view.matrix.m;
+	minZ = numeric_limits<float>::max();
+	maxZ = numeric_limits<float>::lowest();
+	for (size_t i = 0; i < mesh.getVertexCount(); ++i) {
+		float z = m[2][0] * mesh.x[i] + m[2][1] * mesh.y[i] + m[2][2] * mesh.z[i] + m[2][3];
+		float w = m[3][0] * mesh.x[i] + m[3][1] * mesh.y[i] + m[3][2] * mesh.z[i] + m[3][3];
+		if (w >= view.nearW) {
+			minZ = min(minZ, z / w);
+			maxZ = max(maxZ, z / w);
+		}
+	}
+}
+
+// How far past the frame, in pixels, triangles are left for the rasterizer
+// to scissor before they get clipped.
+static const float GUARD_BAND = 8192.0f;
+
+// Clip planes, each a signed distance that is negative outside.
+enum ClipPlane {
+	PLANE_NEAR,
+	PLANE_GUARD_LEFT,
+	PLANE_GUARD_RIGHT,
+	PLANE_GUARD_BOTTOM,
+	PLANE_GUARD_TOP,
+	PLANE_COUNT
+};
+
+// Outcode bits: one per clip plane, then the sides of the frame itself.
+static const unsigned OUT_LEFT = 1 << PLANE_COUNT;
+static const unsigned OUT_RIGHT = OUT_LEFT << 1;
+static const unsigned OUT_BOTTOM = OUT_LEFT << 2;
+static const unsigned OUT_TOP = OUT_LEFT << 3;
+static const unsigned CLIP_MASK = OUT_LEFT - 1;
+
+struct ClipVertex {
+	float p[4];
+	float attr[3];
+	int64_t index; // Source vertex, or -1 for one made by clipping
+};
+
+struct ClipFrame {
+	float width, height, nearW;
+
+	float distance(const float p[4], int plane) const
+	{
+		switch (plane) {
+		case PLANE_NEAR: return p[3] - nearW;
+		case PLANE_GUARD_LEFT: return p[0] + GUARD_BAND * p[3];
+		case PLANE_GUARD_RIGHT: return (width + GUARD_BAND) * p[3] - p[0];
+		case PLANE_GUARD_BOTTOM: return p[1] + GUARD_BAND * p[3];
+		default: return (height + GUARD_BAND) * p[3] - p[1];
+		}
+	}
+
+	unsigned outcode(const float p[4]) const
+	{
+		unsigned code = 0;
+		for (int plane = 0; plane < PLANE_COUNT; ++plane) {
+			code |= distance(p, plane) < 0 ? 1u << plane : 0;
+		}
+		code |= p[0] < 0 ? OUT_LEFT : 0;
+		code |= p[0] > width * p[3] ? OUT_RIGHT : 0;
+		code |= p[1] < 0 ? OUT_BOTTOM : 0;
+		code |= p[1] > height * p[3] ? OUT_TOP : 0;
+		return code;
+	}
+};
+
+// Sutherland-Hodgman against one plane. Each plane adds at most one vertex.
+static int clip_polygon(const ClipFrame& frame, int plane, const ClipVertex* in, int count, ClipVertex* out)
+{
+	int n = 0;
+	for (int i = 0; i < count; ++i) {
+		const ClipVertex& a = in[i];
+		const ClipVertex& b = in[(i + 1) % count];
+		float da = frame.distance(a.p, plane);
+		float db = frame.distance(b.p, plane);
+		if (da >= 0) {
+			out[n++] = a;
+		}
+		if ((da >= 0) != (db >= 0)) {
+			float t = da / (da - db);
+			ClipVertex& v = out[n++];
+			for (int k = 0; k < 4; ++k) {
+				v.p[k] = a.p[k] + t * (b.p[k] - a.p[k]);
+			}
+			for (int k = 0; k < 3; ++k) {
+				v.attr[k] = a.attr[k] + t * (b.attr[k] - a.attr[k]);
+			}
+			v.index = -1;
+		}
+	}
+	return n;
+}
+
+void process_vertices(const Mesh& mesh, const ViewTransform& view, int width, int height, SimdLevel level, ScreenMesh& screen, ClipStats& stats)
+{
+	const size_t n = mesh.getVertexCount();
+	vector<float> clip[4];
+	for (auto& c : clip) {
+		c.resize(n);
+	}
+	float* out[4] = { clip[0].data(), clip[1].data(), clip[2].data(), clip[3].data() };
+	select_transform_kernel(level)(&view.matrix.m[0][0], mesh.x.data(), mesh.y.data(), mesh.z.data(), n, out);
+
+	screen.x.resize(n);
+	screen.y.resize(n);
+	screen.z.resize(n);
+	for (size_t i = 0; i < n; ++i) {
+		screen.x[i] = clip[0][i] / clip[3][i];
+	}
+	for (size_t i = 0; i < n; ++i) {
+		screen.y[i] = clip[1][i] / clip[3][i];
+	}
+	for (size_t i = 0; i < n; ++i) {
+		screen.z[i] = clip[2][i] / clip[3][i];
+	}
+	// An affine view leaves w at 1, where screen-space interpolation is
+	// already exact.
+	const float (*m)[4] = view.matrix.m;
+	const bool projective = m[3][0] != 0.0f || m[3][1] != 0.0f || m[3][2] != 0.0f || m[3][3] != 1.0f;
+	screen.invW.clear();
+	if (projective) {
+		screen.invW.resize(n);
+		for (size_t i = 0; i < n; ++i) {
+			screen.invW[i] = 1.0f / clip[3][i];
+		}
+	}
+
+	ClipFrame frame = { static_cast<float>(width), static_cast<float>(height), view.nearW };
+	vector<unsigned> codes(n);
+	for (size_t i = 0; i < n; ++i) {
+		float p[4] = { clip[0][i], clip[1][i], clip[2][i], clip[3][i] };
+		codes[i] = frame.outcode(p);
+	}
+
+	const bool flat = !screen.faceColor.empty();
+	vector<uint32_t> indices;
+	vector<unsigned char> faceColor;
+	indices.reserve(screen.indices.size());
+	faceColor.reserve(screen.faceColor.size());
+	stats = ClipStats();
+
+	for (size_t t = 0; t < screen.getTriangleCount(); ++t) {
+		const uint32_t* tri = &screen.indices[3 * t];
+		unsigned all = codes[tri[0]] & codes[tri[1]] & codes[tri[2]];
+		unsigned any = codes[tri[0]] | codes[tri[1]] | codes[tri[2]];
+		if (all != 0) {
+			++stats.culled;
+			continue;
+		}
+		if ((any & CLIP_MASK) == 0) {
+			indices.insert(indices.end(), tri, tri + 3);
+			if (flat) {
+				faceColor.insert(faceColor.end(), &screen.faceColor[3 * t], &screen.faceColor[3 * t + 3]);
+			}
+			continue;
+		}
+
+		// Clip only against the planes some corner is outside of.
+		ClipVertex polygon[2][3 + PLANE_COUNT];
+		int count = 3;
+		for (int j = 0; j < 3; ++j) {
+			ClipVertex& v = polygon[0][j];
+			for (int k = 0; k < 4; ++k) {
+				v.p[k] = clip[k][tri[j]];
+			}
+			for (int k = 0; k < 3; ++k) {
+				v.attr[k] = screen.attr[k][tri[j]];
+			}
+			v.index = tri[j];
+		}
+		int src = 0;
+		for (int plane = 0; plane < PLANE_COUNT && count > 0; ++plane) {
+			if (any & (1u << plane)) {
+				count = clip_polygon(frame, plane, polygon[src], count, polygon[1 - src]);
+				src = 1 - src;
+			}
+		}
+		++stats.clipped;
+		if (count < 3) {
+			continue;
+		}
+
+		uint32_t fan[3 + PLANE_COUNT];
+		for (int j = 0; j < count; ++j) {
+			const ClipVertex& v = polygon[src][j];
+			if (v.index >= 0) {
+				fan[j] = static_cast<uint32_t>(v.index);
+				continue;
+			}
+			fan[j] = static_cast<uint32_t>(screen.x.size());
+			screen.x.push_back(v.p[0] / v.p[3]);
+			screen.y.push_back(v.p[1] / v.p[3]);
+			screen.z.push_back(v.p[2] / v.p[3]);
+			if (projective) {
+				screen.invW.push_back(1.0f / v.p[3]);
+			}
+			for (int k = 0; k < 3; ++k) {
+				screen.attr[k].push_back(v.attr[k]);
+			}
+		}
+		for (int j = 1; j + 1 < count; ++j) {
+			indices.push_back(fan[0]);
+			indices.push_back(fan[j]);
+			indices.push_back(fan[j + 1]);
+			if (flat) {
+				faceColor.insert(faceColor.end(), &screen.faceColor[3 * t], &screen.faceColor[3 * t + 3]);
+			}
+			++stats.added;
+		}
+	}
+
+	screen.indices.swap(indices);
+	screen.faceColor.swap(faceColor);
+}
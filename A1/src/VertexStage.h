@@ -0,0 +1,58 @@
+#pragma once
+#ifndef _VERTEXSTAGE_H_
+#define _VERTEXSTAGE_H_
+
+#include "Rasterizer.h"
+
+struct Mesh;
+enum class SimdLevel;
+
+// Row-major 4x4 matrix acting on column vectors.
+struct Mat4 {
+	float m[4][4];
+	static Mat4 identity();
+	Mat4 operator*(const Mat4& b) const;
+};
+
+// Camera at eye looking at target, with up pointing roughly along +y of the
+// view.
+Mat4 look_at(const float eye[3], const float target[3], const float up[3]);
+// Perspective projection with the far plane at infinity and reversed depth:
+// w is the distance in front of the camera and z/w is zNear / w, 1 on the
+// near plane and falling towards 0, so larger is nearer as elsewhere in the
+// pipeline.
+Mat4 perspective(float fovy, float aspect, float zNear);
+// Maps x and y from [-1, 1] to [0, width] and [0, height].
+Mat4 viewport(int width, int height);
+
+// Object space to clip space. The viewport is part of the matrix, so x/w and
+// y/w come out in pixels and z/w is the depth value.
+struct ViewTransform {
+	Mat4 matrix = Mat4::identity();
+	float nearW = 1e-6f; // Anything with a smaller w is clipped away
+};
+
+struct ClipStats {
+	size_t culled = 0;  // Entirely outside the frame or behind the near plane
+	size_t clipped = 0; // Crossed the near plane or the guard band
+	size_t added = 0;   // Triangles produced by clipping
+};
+
+// Smallest and largest depth of the vertices of mesh that are in front of
+// the near plane.
+void depth_range(const Mesh& mesh, const ViewTransform& view, float& minZ, float& maxZ);
+
+// Vertex processing ahead of the rasterizer. Every vertex of mesh is
+// transformed once, in SIMD batches, and divided by w. Triangles entirely
+// outside the frame are dropped. Those crossing the near plane, or reaching
+// past a guard band around the frame, are clipped in homogeneous space, so
+// the rasterizer only ever sees small, finite screen coordinates; the rest
+// is left to its scissoring.
+//
+// screen must come with attr, indices and (for flat shading) faceColor set
+// up for mesh. Its positions, and invW under a perspective view, are filled
+// in, new vertices from clipping are appended, and indices and faceColor are
+// rewritten to the surviving triangles in their original order.
+void process_vertices(const Mesh& mesh, const ViewTransform& view, int width, int height, SimdLevel level, ScreenMesh& screen, ClipStats& stats);
+
+#endif
@@ -0,0 +1,126 @@
+#include <algorithm>
+#include "WorkStealingPool.h"
+
+using namespace std;
+
+WorkStealingPool::WorkStealingPool(int n) :
+	threadCount(n > 0 ? n : max(1, static_cast<int>(thread::hardware_concurrency()))),
+	job(nullptr),
+	generation(0),
+	active(0),
+	stopping(false),
+	remaining(0)
+{
+	for (int i = 0; i < threadCount; ++i) {
+		queues.push_back(make_unique<Queue>());
+	}
+	for (int i = 1; i < threadCount; ++i) {
+		workers.emplace_back(&WorkStealingPool::workerLoop, this, i);
+	}
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+	{
+		lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (auto& worker : workers) {
+		worker.join();
+	}
+}
+
+bool WorkStealingPool::pop(int self, int& task)
+{
+	{
+		Queue& own = *queues[self];
+		lock_guard<std::mutex> lock(own.mutex);
+		if (!own.tasks.empty()) {
+			task = own.tasks.back();
+			own.tasks.pop_back();
+			return true;
+		}
+	}
+	for (int k = 1; k < threadCount; ++k) {
+		Queue& victim = *queues[(self + k) % threadCount];
+		lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.tasks.empty()) {
+			task = victim.tasks.front();
+			victim.tasks.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
+
+void WorkStealingPool::drain(int self)
+{
+	int task;
+	while (pop(self, task)) {
+		(*job)(task);
+		remaining.fetch_sub(1, memory_order_acq_rel);
+	}
+}
+
+void WorkStealingPool::workerLoop(int self)
+{
+	unsigned seen = 0;
+	for (;;) {
+		{
+			unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [&] { return stopping || generation != seen; });
+			if (stopping) {
+				return;
+			}
+			seen = generation;
+			++active;
+		}
+		drain(self);
+		{
+			lock_guard<std::mutex> lock(mutex);
+			--active;
+		}
+		done.notify_all();
+	}
+}
+
+void WorkStealingPool::run(int taskCount, const function<void(int)>& task)
+{
+	if (taskCount <= 0) {
+		return;
+	}
+	if (threadCount == 1) {
+		for (int i = 0; i < taskCount; ++i) {
+			task(i);
+		}
+		return;
+	}
+
+	// Publish the job before any of its tasks become visible, so a worker
+	// that pops one always sees the matching job. Contiguous blocks keep
+	// neighbouring tasks (e.g. adjacent tiles) on the same worker until
+	// stealing starts.
+	{
+		lock_guard<std::mutex> lock(mutex);
+		job = &task;
+		remaining.store(taskCount, memory_order_release);
+		++generation;
+		for (int w = 0; w < threadCount; ++w) {
+			int begin = static_cast<int>(static_cast<long long>(taskCount) * w / threadCount);
+			int end = static_cast<int>(static_cast<long long>(taskCount) * (w + 1) / threadCount);
+			Queue& q = *queues[w];
+			lock_guard<std::mutex> queueLock(q.mutex);
+			for (int i = end - 1; i >= begin; --i) {
+				q.tasks.push_back(i);
+			}
+		}
+	}
+	wake.notify_all();
+
+	drain(0);
+
+	unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [&] { return remaining.load(memory_order_acquire) == 0 && active == 0; });
+	job = nullptr;
+}
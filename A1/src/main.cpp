@@ -4,15 +4,24 @@
 #include <limits>
 #include <algorithm>
 #include <cmath>
+#include <memory>
 
-#include <cstdlib>  // For rand() and srand()
-#include <ctime>    // For time()
-
-#define TINYOBJLOADER_IMPLEMENTATION
-#include "tiny_obj_loader.h"
-
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <atomic>
+#include <future>
 
 #include "Image.h"
+#include "Mesh.h"
+#include "MeshCache.h"
+#include "Rasterizer.h"
+#include "VertexStage.h"
+#include "WorkStealingPool.h"
+#include "RasterKernels.h"
+#include "Texture.h"
+#include "ImageWriter.h"
 
 // This allows you to skip the `std::` in front of C++ standard library
 // functions. You can also say `using std::cout` to be more selective.
@@ -32,567 +41,663 @@ double RANDOM_COLORS[7][3] = {
 	{0.6350,    0.0780,    0.1840},
 };
 
-struct Vertex {
-	float x, y, z;
-	unsigned char r, g, b; 
-	float normX, normY, normZ;
-};
-
-struct Triangle {
-	Vertex vertices[3];
-	float minX, maxX, minY, maxY;
+// Axis-aligned bounds of a mesh's vertices.
+struct MeshBounds {
+	float min[3], max[3];
 };
 
-void compute_bounding_box(const vector<Vertex>& vertices, float& minX, float& maxX, float& minY, float& maxY){
-	minX = minY = numeric_limits<float>::max();
-	maxX = maxY = numeric_limits<float>::lowest();
-
-	for (const auto& v : vertices){
-		minX = min(minX, v.x);
-		maxX = max(maxX, v.x);
-		minY = min(minY, v.y);
-		maxY = max(maxY, v.y);
+MeshBounds compute_bounds(const Mesh& mesh){
+	MeshBounds bounds;
+	const vector<float>* coords[3] = { &mesh.x, &mesh.y, &mesh.z };
+	for (int k = 0; k < 3; ++k){
+		bounds.min[k] = numeric_limits<float>::max();
+		bounds.max[k] = numeric_limits<float>::lowest();
+		for (float v : *coords[k]){
+			bounds.min[k] = min(bounds.min[k], v);
+			bounds.max[k] = max(bounds.max[k], v);
+		}
 	}
+	return bounds;
 }
 
-void task_one(const vector<Vertex>& vertices, const string& outFName, int imageWidth, int imageHeight){
-	float minX, maxX, minY, maxY;
-	compute_bounding_box(vertices, minX, maxX, minY, maxY);
+struct RenderOptions {
+	int tileSize = 32;
+	WorkStealingPool* pool = nullptr;
+	SimdLevel simdLevel = detect_simd_level();
+	bool verifySimd = false;
+	bool verifyStream = false;
+	bool useCamera = false;
+	float eye[3] = { 0.0f, 0.0f, 0.0f };
+	CullMode cull = CullMode::None;
+	bool hierarchicalZ = true;
+	bool depthStats = false;
+	bool deferred = false;
+	int samples = 1;        // MSAA samples per pixel
+	string textureName;     // Task 9 image, a checkerboard when empty
+	const Texture* texture = nullptr;
+	size_t streamChunk = 0; // Triangles per chunk when streaming, 0 to load whole
+	int threadCount = 1;    // 0 picks the hardware thread count, the batch default
+	PngLevel png = PngLevel::Best;
+};
 
+// Orthographic view that fits the mesh's xy bounding box to the image,
+// keeping the aspect ratio. Depth is the object z.
+ViewTransform fit_view(const MeshBounds& bounds, int imageWidth, int imageHeight){
+	float minX = bounds.min[0], maxX = bounds.max[0];
+	float minY = bounds.min[1], maxY = bounds.max[1];
 	float scaleX = imageWidth / (maxX - minX);
 	float scaleY = imageHeight / (maxY - minY);
-	float finalScale = min(scaleX, scaleY);
-	float translationX = (imageWidth - finalScale * (minX + maxX)) / 2;
-	float translationY = (imageHeight - finalScale * (minY + maxY)) / 2;
-
-	Image image(imageWidth, imageHeight);
-
-	for (size_t i = 0; i < vertices.size(); i += 3){
-		Triangle tri;
-		for (int j = 0; j < 3; ++j){
-			tri.vertices[j].x = finalScale * vertices[i + j].x + translationX;
-			tri.vertices[j].y = finalScale * vertices[i + j].y + translationY;
-		}
+	float scale = min(scaleX, scaleY);
+	ViewTransform view;
+	view.matrix.m[0][0] = scale;
+	view.matrix.m[1][1] = scale;
+	view.matrix.m[0][3] = (imageWidth - scale * (minX + maxX)) / 2;
+	view.matrix.m[1][3] = (imageHeight - scale * (minY + maxY)) / 2;
+	return view;
+}
 
-		compute_bounding_box({ tri.vertices[0], tri.vertices[1], tri.vertices[2] }, tri.minX, tri.maxX, tri.minY, tri.maxY);
+// Perspective view from eye towards the center of the mesh's bounds, with a
+// 45 degree vertical field of view.
+ViewTransform camera_view(const MeshBounds& bounds, const float eye[3], int imageWidth, int imageHeight){
+	float center[3], radius = 0.0f;
+	for (int k = 0; k < 3; ++k){
+		center[k] = (bounds.min[k] + bounds.max[k]) / 2;
+		radius = max(radius, (bounds.max[k] - bounds.min[k]) / 2);
+	}
 
-		int colorIndex = (i / 3) % 7;
-		unsigned char r = static_cast<unsigned char>(RANDOM_COLORS[colorIndex][0] * 255);
-		unsigned char g = static_cast<unsigned char>(RANDOM_COLORS[colorIndex][1] * 255);
-		unsigned char b = static_cast<unsigned char>(RANDOM_COLORS[colorIndex][2] * 255);
+	const float up[3] = { 0.0f, 1.0f, 0.0f };
+	float zNear = 0.01f * radius;
+	ViewTransform view;
+	view.matrix = viewport(imageWidth, imageHeight) * perspective(3.14159265f / 4, static_cast<float>(imageWidth) / imageHeight, zNear) * look_at(eye, center, up);
+	view.nearW = zNear;
+	return view;
+}
 
-		for (int x = static_cast<int>(tri.minX); x <= tri.maxX; ++x){
-			for (int y = static_cast<int>(tri.minY); y <= tri.maxY; ++y){
-				if (x >= 0 && x < imageWidth && y >= 0 && y < imageHeight){
-					unsigned char color = static_cast<unsigned char>((i / 3) % 256);
-					image.setPixel(x, y, r, g, b);
-				}
+// Fills in the attributes the shading mode reads: vertex colors for Color,
+// texture coordinates for Texture, normals for Normal/Lambert and a per-face
+// palette color for Flat, where
+// firstTriangle is the index of the mesh's first face in the whole model.
+// The vertex stage adds the positions.
+ScreenMesh setup_screen_mesh(const Mesh& mesh, Shading mode, size_t firstTriangle){
+	ScreenMesh screen;
+	if (mode == Shading::Color){
+		screen.attr[0].assign(mesh.r.begin(), mesh.r.end());
+		screen.attr[1].assign(mesh.g.begin(), mesh.g.end());
+		screen.attr[2].assign(mesh.b.begin(), mesh.b.end());
+	} else if (mode == Shading::Texture){
+		screen.attr[0] = mesh.u;
+		screen.attr[1] = mesh.v;
+		screen.attr[2].assign(mesh.getVertexCount(), 0.0f);
+	} else {
+		screen.attr[0] = mesh.nx;
+		screen.attr[1] = mesh.ny;
+		screen.attr[2] = mesh.nz;
+	}
+	screen.indices = mesh.indices;
+
+	if (mode == Shading::Flat){
+		screen.faceColor.resize(3 * screen.getTriangleCount());
+		for (size_t i = 0; i < screen.getTriangleCount(); ++i){
+			int colorIndex = (firstTriangle + i) % 7;
+			for (int k = 0; k < 3; ++k){
+				screen.faceColor[3 * i + k] = static_cast<unsigned char>(RANDOM_COLORS[colorIndex][k] * 255);
 			}
 		}
 	}
-
-	image.writeToFile(outFName);
-}
-
-
-
-
-
-
-
-
-
-bool baryc_triangle(float x, float y, const Vertex& v0, const Vertex& v1, const Vertex& v2){
-	float det = (v1.y - v2.y) * (v0.x - v2.x) + (v2.x - v1.x) * (v0.y - v2.y);
-	float a = ((v1.y - v2.y) * (x - v2.x) + (v2.x - v1.x) * (y - v2.y)) / det;
-	float b = ((v2.y - v0.y) * (x - v2.x) + (v0.x - v2.x) * (y - v2.y)) / det;
-	float c = 1.0f - a - b;
-
-	const float EPSILON = 0.0001f;
-	return a >= -EPSILON && b >= -EPSILON && c >= -EPSILON;
+	return screen;
 }
 
-void task_two(const vector<Vertex>& vertices, const string& outFName, int imageWidth, int imageHeight){
-	Image image(imageWidth, imageHeight);
-
-	float minX, maxX, minY, maxY;
-	compute_bounding_box(vertices, minX, maxX, minY, maxY);
-
-	float scaleX = imageWidth / (maxX - minX);
-	float scaleY = imageHeight / (maxY - minY);
-	float finalScale = min(scaleX, scaleY);
-	float translationX = (imageWidth - finalScale * (minX + maxX)) / 2;
-	float translationY = (imageHeight - finalScale * (minY + maxY)) / 2;
-
-	for (size_t i = 0; i < vertices.size(); i += 3){
-		Triangle tri;
-		for (int j = 0; j < 3; ++j){
-			tri.vertices[j].x = finalScale * vertices[i + j].x + translationX;
-			tri.vertices[j].y = finalScale * vertices[i + j].y + translationY;
-		}
-
-		compute_bounding_box({ tri.vertices[0], tri.vertices[1], tri.vertices[2] }, tri.minX, tri.maxX, tri.minY, tri.maxY);
-
-		//Implement prof suggestion
-		int boundBoxMinX = max(static_cast<int>(floor(tri.minX)), 0);
-		int boundBoxMaxX = min(static_cast<int>(ceil(tri.maxX)), imageWidth - 1);
-		int boundBoxMinY = max(static_cast<int>(floor(tri.minY)), 0);
-		int boundBoxMaxY = min(static_cast<int>(ceil(tri.maxY)), imageHeight - 1);
-
-		int colorIndex = (i / 3) % 7;
-		unsigned char r = static_cast<unsigned char>(RANDOM_COLORS[colorIndex][0] * 255);
-		unsigned char g = static_cast<unsigned char>(RANDOM_COLORS[colorIndex][1] * 255);
-		unsigned char b = static_cast<unsigned char>(RANDOM_COLORS[colorIndex][2] * 255);
+// What a task draws. Vertex edits only look at the vertex itself and the
+// bounds of the whole mesh, so a mesh drawn in chunks comes out the same as
+// one drawn at once.
+struct Task {
+	RasterState state;
+	void (*editVertices)(Mesh& mesh, const MeshBounds& bounds) = nullptr;
+};
 
-		for (int y = boundBoxMinY; y <= boundBoxMaxY; ++y){
-			for (int x = boundBoxMinX; x <= boundBoxMaxX; ++x){
-				if (baryc_triangle(x, y, tri.vertices[0], tri.vertices[1], tri.vertices[2])){
-					image.setPixel(x, y, r, g, b);
-				}
-			}
+// Task 3: random vertex colors. The palette index is hashed from the vertex
+// position, so a vertex gets the same color in every chunk it shows up in.
+void color_randomly(Mesh& mesh, const MeshBounds&){
+	for (size_t i = 0; i < mesh.getVertexCount(); ++i){
+		uint32_t h = 2166136261u;
+		for (float v : { mesh.x[i], mesh.y[i], mesh.z[i] }){
+			uint32_t bits;
+			memcpy(&bits, &v, sizeof(bits));
+			h = (h ^ bits) * 16777619u;
 		}
+		h ^= h >> 16;
+		h *= 0x85ebca6bu;
+		h ^= h >> 13;
+		int colorIndex = h % 7;
+		mesh.r[i] = static_cast<unsigned char>(RANDOM_COLORS[colorIndex][0] * 255);
+		mesh.g[i] = static_cast<unsigned char>(RANDOM_COLORS[colorIndex][1] * 255);
+		mesh.b[i] = static_cast<unsigned char>(RANDOM_COLORS[colorIndex][2] * 255);
 	}
-
-	image.writeToFile(outFName);
 }
 
+// Task 4: vertical color gradient
+void color_by_height(Mesh& mesh, const MeshBounds& bounds){
+	float minY = bounds.min[1], maxY = bounds.max[1];
+	for (size_t i = 0; i < mesh.getVertexCount(); ++i){
+		float lerpFactor = (mesh.y[i] - minY) / (maxY - minY);
+		mesh.r[i] = static_cast<unsigned char>(255 * lerpFactor);
+		mesh.b[i] = static_cast<unsigned char>(255 * (1 - lerpFactor));
+		mesh.g[i] = 0;
+	}
+}
 
+// Task 8: rotation about the y-axis
+void rotate_about_y(Mesh& mesh, const MeshBounds&){
+	const float theta = 3.141592653589 / 4; // π/4
 
+	for (size_t i = 0; i < mesh.getVertexCount(); ++i) {
+		float x = mesh.x[i];
+		float z = mesh.z[i];
+		mesh.x[i] = cos(theta) * x + sin(theta) * z;
+		mesh.z[i] = -sin(theta) * x + cos(theta) * z;
 
-
-
-
-
-
-
-
-void baryc_triangle_task3(float x, float y, const Vertex& v0, const Vertex& v1, const Vertex& v2, float& a, float& b, float& c){
-	float det = (v1.y - v2.y) * (v0.x - v2.x) + (v2.x - v1.x) * (v0.y - v2.y);
-	a = ((v1.y - v2.y) * (x - v2.x) + (v2.x - v1.x) * (y - v2.y)) / det;
-	b = ((v2.y - v0.y) * (x - v2.x) + (v0.x - v2.x) * (y - v2.y)) / det;
-	c = 1.0f - a - b;
+		float normX = mesh.nx[i];
+		float normZ = mesh.nz[i];
+		mesh.nx[i] = cos(theta) * normX + sin(theta) * normZ;
+		mesh.nz[i] = -sin(theta) * normX + cos(theta) * normZ;
+	}
 }
 
-void task_three(vector<Vertex>& vertices, const string& outFName, int imageWidth, int imageHeight){
-	Image image(imageWidth, imageHeight);
-
-	for (auto& vertex : vertices){
-		int colorIndex = rand() % 7;
-		vertex.r = static_cast<unsigned char>(RANDOM_COLORS[colorIndex][0] * 255);
-		vertex.g = static_cast<unsigned char>(RANDOM_COLORS[colorIndex][1] * 255);
-		vertex.b = static_cast<unsigned char>(RANDOM_COLORS[colorIndex][2] * 255);
+// Task 9: texture coordinates for meshes without them, projected along z
+// from the bounds and repeated a few times across the mesh.
+void project_texcoords(Mesh& mesh, const MeshBounds& bounds){
+	const float REPEAT = 4.0f;
+	if (!mesh.u.empty()){
+		return;
 	}
+	mesh.u.resize(mesh.getVertexCount());
+	mesh.v.resize(mesh.getVertexCount());
+	for (size_t i = 0; i < mesh.getVertexCount(); ++i){
+		mesh.u[i] = REPEAT * (mesh.x[i] - bounds.min[0]) / (bounds.max[0] - bounds.min[0]);
+		mesh.v[i] = REPEAT * (mesh.y[i] - bounds.min[1]) / (bounds.max[1] - bounds.min[1]);
+	}
+}
 
-	float minX, maxX, minY, maxY;
-	compute_bounding_box(vertices, minX, maxX, minY, maxY);
-
-	float scaleX = imageWidth / (maxX - minX);
-	float scaleY = imageHeight / (maxY - minY);
-	float finalScale = min(scaleX, scaleY);
-	float translationX = (imageWidth - finalScale * (maxX + minX)) / 2;
-	float translationY = (imageHeight - finalScale * (minY + maxY)) / 2;
-
-	for (size_t i = 0; i < vertices.size(); i += 3){
-		Triangle tri;
-		for (int j = 0; j < 3; ++j){
-			tri.vertices[j].x = finalScale * vertices[i + j].x + translationX;
-			tri.vertices[j].y = finalScale * vertices[i + j].y + translationY;
-			tri.vertices[j].r = vertices[i + j].r;
-			tri.vertices[j].g = vertices[i + j].g;
-			tri.vertices[j].b = vertices[i + j].b;
-		}
-
-		compute_bounding_box({ tri.vertices[0], tri.vertices[1], tri.vertices[2] }, tri.minX, tri.maxX, tri.minY, tri.maxY);
-
-		int boundBoxMinX = max(static_cast<int>(floor(tri.minX)), 0);
-		int boundBoxMaxX = min(static_cast<int>(ceil(tri.maxX)), imageWidth - 1);
-		int boundBoxMinY = max(static_cast<int>(floor(tri.minY)), 0);
-		int boundBoxMaxY = min(static_cast<int>(ceil(tri.maxY)), imageHeight - 1);
-
-		for (int y = boundBoxMinY; y <= boundBoxMaxY; ++y){
-			for (int x = boundBoxMinX; x <= boundBoxMaxX; ++x){
-				float alpha, beta, gamma;
-				baryc_triangle_task3(x, y, tri.vertices[0], tri.vertices[1], tri.vertices[2], alpha, beta, gamma);
-
-				if (alpha >= 0 && beta >= 0 && gamma >= 0){
-					unsigned char r = static_cast<unsigned char>(alpha * tri.vertices[0].r + beta * tri.vertices[1].r + gamma * tri.vertices[2].r);
-					unsigned char g = static_cast<unsigned char>(alpha * tri.vertices[0].g + beta * tri.vertices[1].g + gamma * tri.vertices[2].g);
-					unsigned char b = static_cast<unsigned char>(alpha * tri.vertices[0].b + beta * tri.vertices[1].b + gamma * tri.vertices[2].b);
-
-					if (x >= 0 && x < imageWidth && y >= 0 && y < imageHeight){
-						image.setPixel(x, y, r, g, b);
-					}
-				}
+// Two-tone checkerboard for task 9 when no texture file is given.
+void make_checkerboard(Texture& texture){
+	const int SIZE = 256, CHECK = 32;
+	vector<unsigned char> rgb(SIZE * SIZE * 3);
+	for (int y = 0; y < SIZE; ++y){
+		for (int x = 0; x < SIZE; ++x){
+			int colorIndex = (x / CHECK + y / CHECK) % 2;
+			for (int k = 0; k < 3; ++k){
+				rgb[3 * (y * SIZE + x) + k] = colorIndex ? 255 : static_cast<unsigned char>(RANDOM_COLORS[0][k] * 255);
 			}
 		}
 	}
-
-	image.writeToFile(outFName);
+	texture.setPixels(SIZE, SIZE, rgb.data());
 }
 
+bool make_task(int number, Task& task){
+	RasterState& state = task.state;
+	if (number == 1){
+		// Task 1: bounding boxes
+		state.coverage = Coverage::BoundingBox;
+		state.shade.mode = Shading::Flat;
+	} else if (number == 2){
+		// Task 2: triangles
+		state.coverage = Coverage::BarycentricEpsilon;
+		state.shade.mode = Shading::Flat;
+	} else if (number == 3 || number == 4){
+		// Task 3: random vertex colors, task 4: vertical color gradient
+		state.shade.mode = Shading::Color;
+		task.editVertices = number == 3 ? color_randomly : color_by_height;
+	} else if (number == 5){
+		// Task 5: z-buffering
+		state.depthTest = true;
+		state.shade.mode = Shading::Depth;
+	} else if (number == 6){
+		// Task 6: normal coloring
+		state.depthTest = true;
+		state.shade.mode = Shading::Normal;
+	} else if (number == 7 || number == 8){
+		// Task 7: simple lighting, and task 8 lights the rotated mesh
+		state.depthTest = true;
+		state.shade.mode = Shading::Lambert;
+		for (int k = 0; k < 3; ++k) {
+			state.shade.light[k] = 1 / sqrt(3);
+		}
+		task.editVertices = number == 8 ? rotate_about_y : nullptr;
+	} else if (number == 9){
+		// Task 9: texture mapping
+		state.depthTest = true;
+		state.shade.mode = Shading::Texture;
+		task.editVertices = project_texcoords;
+	} else {
+		return false;
+	}
+	return true;
+}
 
-
-void task_four(vector<Vertex>& vertices, const string& outFName, int imageWidth, int imageHeight){
-	Image image(imageWidth, imageHeight);
-
-	float minX, maxX, minY, maxY;
-	compute_bounding_box(vertices, minX, maxX, minY, maxY);
-
-	for (auto& vertex : vertices){
-		float lerpFactor = (vertex.y - minY) / (maxY - minY);
-		vertex.r = static_cast<unsigned char>(255 * lerpFactor);
-		vertex.b = static_cast<unsigned char>(255 * (1 - lerpFactor));
-		vertex.g = 0;
+// Applies the task's vertex edits to the whole-model positions and works out
+// the view and the final raster state from them. Depth shading spans the
+// depth of every vertex in front of the near plane.
+void setup_frame(Mesh& positions, const Task& task, int imageWidth, int imageHeight, const RenderOptions& options, MeshBounds& bounds, ViewTransform& view, RasterState& state){
+	bounds = compute_bounds(positions);
+	if (task.editVertices){
+		task.editVertices(positions, bounds);
+	}
+	MeshBounds edited = compute_bounds(positions);
+	view = options.useCamera ? camera_view(edited, options.eye, imageWidth, imageHeight) : fit_view(edited, imageWidth, imageHeight);
+
+	state = task.state;
+	state.cull = options.cull;
+	state.hierarchicalZ = options.hierarchicalZ;
+	state.deferred = options.deferred;
+	state.shade.texture = options.texture;
+	if (state.shade.mode == Shading::Depth){
+		depth_range(positions, view, state.shade.minZ, state.shade.maxZ);
 	}
+}
 
-	float scaleX = imageWidth / (maxX - minX);
-	float scaleY = imageHeight / (maxY - minY);
-	float finalScale = min(scaleX, scaleY);
-	float translationX = (imageWidth - finalScale * (maxX + minX)) / 2;
-	float translationY = (imageHeight - finalScale * (minY + maxY)) / 2;
-
-	for (size_t i = 0; i < vertices.size(); i += 3){
-		Triangle tri;
-		for (int j = 0; j < 3; ++j){
-			tri.vertices[j].x = finalScale * vertices[i + j].x + translationX;
-			tri.vertices[j].y = finalScale * vertices[i + j].y + translationY;
-			tri.vertices[j].r = vertices[i + j].r;
-			tri.vertices[j].g = vertices[i + j].g;
-			tri.vertices[j].b = vertices[i + j].b;
+// Number of pixels whose 8-bit color differs between a and b.
+size_t count_mismatched(const Image& a, const Image& b){
+	const vector<unsigned char>& pa = a.getPixels();
+	const vector<unsigned char>& pb = b.getPixels();
+	size_t mismatched = 0;
+	for (size_t i = 0; i < pa.size(); i += 3){
+		if (pa[i] != pb[i] || pa[i + 1] != pb[i + 1] || pa[i + 2] != pb[i + 2]){
+			++mismatched;
 		}
+	}
+	return mismatched;
+}
 
-		compute_bounding_box({ tri.vertices[0], tri.vertices[1], tri.vertices[2] }, tri.minX, tri.maxX, tri.minY, tri.maxY);
-
-		int boundBoxMinX = max(static_cast<int>(floor(tri.minX)), 0);
-		int boundBoxMaxX = min(static_cast<int>(ceil(tri.maxX)), imageWidth - 1);
-		int boundBoxMinY = max(static_cast<int>(floor(tri.minY)), 0);
-		int boundBoxMaxY = min(static_cast<int>(ceil(tri.maxY)), imageHeight - 1);
-
-		for (int y = boundBoxMinY; y <= boundBoxMaxY; ++y){
-			for (int x = boundBoxMinX; x <= boundBoxMaxX; ++x){
-				float alpha, beta, gamma;
-				baryc_triangle_task3(x, y, tri.vertices[0], tri.vertices[1], tri.vertices[2], alpha, beta, gamma);
-
-				if (alpha >= 0 && beta >= 0 && gamma >= 0){
-					unsigned char r = static_cast<unsigned char>(alpha * tri.vertices[0].r + beta * tri.vertices[1].r + gamma * tri.vertices[2].r);
-					unsigned char g = static_cast<unsigned char>(alpha * tri.vertices[0].g + beta * tri.vertices[1].g + gamma * tri.vertices[2].g);
-					unsigned char b = static_cast<unsigned char>(alpha * tri.vertices[0].b + beta * tri.vertices[1].b + gamma * tri.vertices[2].b);
-
-					image.setPixel(x, y, r, g, b);
-				}
-			}
+// Draws screen with every SIMD level up to the requested one and reports any
+// pixel that differs from reference, the scalar result.
+bool verify_simd(const ScreenMesh& screen, const RasterState& state, const RenderOptions& options, const Image& reference, ostream& log){
+	bool ok = true;
+	for (SimdLevel level : { SimdLevel::SSE41, SimdLevel::AVX2 }){
+		if (level > options.simdLevel){
+			break;
 		}
+		Rasterizer rasterizer(reference.getWidth(), reference.getHeight(), options.tileSize, options.pool);
+		rasterizer.setSimdLevel(level);
+		rasterizer.setSampleCount(options.samples);
+		rasterizer.draw(screen, state);
+		Image image(reference.getWidth(), reference.getHeight());
+		rasterizer.resolve(image);
+		size_t mismatched = count_mismatched(reference, image);
+		log << "SIMD check " << simd_level_name(level) << ": " << (mismatched ? "FAILED, " : "ok, ") << mismatched << " pixels differ from scalar" << endl;
+		ok = ok && mismatched == 0;
 	}
-
-	image.writeToFile(outFName);
+	return ok;
 }
 
-
-
-
-void task_five(vector<Vertex>& vertices, const string& outFName, int imageWidth, int imageHeight) {
-	Image image(imageWidth, imageHeight);
-	vector<float> zBuf(imageWidth * imageHeight, numeric_limits<float>::lowest());
-
-	float minZ = numeric_limits<float>::max();
-	float maxZ = numeric_limits<float>::lowest();
-	for (const auto& vertex : vertices) {
-		minZ = min(minZ, vertex.z);
-		maxZ = max(maxZ, vertex.z);
+void print_stats(const Rasterizer& rasterizer, const CullStats& culled, const ClipStats& clipped, const RenderOptions& options, ostream& log){
+	if (options.useCamera){
+		log << "Off-screen triangles: " << clipped.culled << ", clipped: " << clipped.clipped << " into " << clipped.added << endl;
 	}
-
-	float minX, maxX, minY, maxY;
-	compute_bounding_box(vertices, minX, maxX, minY, maxY);
-
-	float scaleX = imageWidth / (maxX - minX);
-	float scaleY = imageHeight / (maxY - minY);
-	float finalScale = min(scaleX, scaleY);
-	float translationX = (imageWidth - finalScale * (maxX + minX)) / 2;
-	float translationY = (imageHeight - finalScale * (minY + maxY)) / 2;
-
-	for (size_t i = 0; i < vertices.size(); i += 3) {
-		Triangle tri;
-		for (int j = 0; j < 3; ++j) {
-			tri.vertices[j].x = finalScale * vertices[i + j].x + translationX;
-			tri.vertices[j].y = finalScale * vertices[i + j].y + translationY;
-			tri.vertices[j].z = vertices[i + j].z;
+	if (options.cull != CullMode::None){
+		log << "Culled triangles: " << culled.facing << " by facing, " << culled.degenerate << " degenerate" << endl;
+	}
+	if (options.depthStats){
+		DepthStats stats = rasterizer.getDepthStats();
+		size_t covered = rasterizer.countCoveredPixels();
+		log << "Depth complexity: " << stats.fragments << " fragments, " << stats.shaded << " shaded";
+		if (covered > 0){
+			log << " over " << covered << " pixels (" << static_cast<double>(stats.fragments) / covered << " per pixel)";
 		}
+		log << ", coarse depth rejected " << stats.trianglesRejected << " triangle tiles and " << stats.blocksRejected << " blocks" << endl;
+	}
+}
 
-		compute_bounding_box({ tri.vertices[0], tri.vertices[1], tri.vertices[2] }, tri.minX, tri.maxX, tri.minY, tri.maxY);
-
-		int boundBoxMinX = max(static_cast<int>(floor(tri.minX)), 0);
-		int boundBoxMaxX = min(static_cast<int>(ceil(tri.maxX)), imageWidth - 1);
-		int boundBoxMinY = max(static_cast<int>(floor(tri.minY)), 0);
-		int boundBoxMaxY = min(static_cast<int>(ceil(tri.maxY)), imageHeight - 1);
-
-		for (int y = boundBoxMinY; y <= boundBoxMaxY; ++y) {
-			for (int x = boundBoxMinX; x <= boundBoxMaxX; ++x) {
-				float alpha, beta, gamma;
-				baryc_triangle_task3(x, y, tri.vertices[0], tri.vertices[1], tri.vertices[2], alpha, beta, gamma);
-
-				if (alpha >= 0 && beta >= 0 && gamma >= 0) {
-					float zPixel = alpha * tri.vertices[0].z + beta * tri.vertices[1].z + gamma * tri.vertices[2].z;
-					int zi = y * imageWidth + x;
+// Draws mesh into image, whose size sets the frame, and reports statistics
+// to log.
+bool render(Mesh& mesh, const Task& task, const RenderOptions& options, Image& image, ostream& log){
+	const int imageWidth = image.getWidth();
+	const int imageHeight = image.getHeight();
+	MeshBounds bounds;
+	ViewTransform view;
+	RasterState state;
+	setup_frame(mesh, task, imageWidth, imageHeight, options, bounds, view, state);
+	ScreenMesh screen = setup_screen_mesh(mesh, state.shade.mode, 0);
+	ClipStats clipped;
+	process_vertices(mesh, view, imageWidth, imageHeight, options.simdLevel, screen, clipped);
+
+	Rasterizer rasterizer(imageWidth, imageHeight, options.tileSize, options.pool);
+	rasterizer.setSimdLevel(options.verifySimd ? SimdLevel::Scalar : options.simdLevel);
+	rasterizer.setSampleCount(options.samples);
+	rasterizer.draw(screen, state);
+	rasterizer.resolve(image);
+	print_stats(rasterizer, rasterizer.getCullStats(), clipped, options, log);
+
+	// Tiles never reach outside the image, so any dropped write is a bug.
+	bool ok = image.reportDropped(log);
+	return (!options.verifySimd || verify_simd(screen, state, options, image, log)) && ok;
+}
 
-					if (zPixel > zBuf[zi]) {
-						unsigned char redVal = static_cast<unsigned char>((zPixel - minZ) / (maxZ - minZ) * 255);
-						image.setPixel(x, y, redVal, 0, 0);
-						zBuf[zi] = zPixel;
-					}
-				}
-			}
+// Draws the faces of stream a chunk at a time into one rasterizer, whose
+// tiles keep color and depth between chunks. Only the vertex attributes of
+// the file and one chunk of faces are in memory at any point.
+bool render_streamed(ObjStream& stream, const Task& task, const RenderOptions& options, Image& image, ostream& log){
+	const int imageWidth = image.getWidth();
+	const int imageHeight = image.getHeight();
+	Mesh positions = stream.getPositions();
+	MeshBounds bounds;
+	ViewTransform view;
+	RasterState state;
+	setup_frame(positions, task, imageWidth, imageHeight, options, bounds, view, state);
+	positions = Mesh();
+
+	Rasterizer rasterizer(imageWidth, imageHeight, options.tileSize, options.pool);
+	rasterizer.setSimdLevel(options.simdLevel);
+	rasterizer.setSampleCount(options.samples);
+	CullStats culled;
+	ClipStats clipped;
+	Mesh chunk;
+	size_t firstTriangle = 0;
+	while (stream.readChunk(options.streamChunk, chunk)){
+		if (task.editVertices){
+			task.editVertices(chunk, bounds);
 		}
+		ScreenMesh screen = setup_screen_mesh(chunk, state.shade.mode, firstTriangle);
+		ClipStats chunkClipped;
+		process_vertices(chunk, view, imageWidth, imageHeight, options.simdLevel, screen, chunkClipped);
+		rasterizer.draw(screen, state);
+
+		culled.facing += rasterizer.getCullStats().facing;
+		culled.degenerate += rasterizer.getCullStats().degenerate;
+		clipped.culled += chunkClipped.culled;
+		clipped.clipped += chunkClipped.clipped;
+		clipped.added += chunkClipped.added;
+		firstTriangle += chunk.getTriangleCount();
 	}
 
-	image.writeToFile(outFName);
+	rasterizer.resolve(image);
+	print_stats(rasterizer, culled, clipped, options, log);
+	return image.reportDropped(log);
 }
 
-
-
-
-
-void task_six(vector<Vertex>& vertices, const string& outFName, int imageWidth, int imageHeight, const vector<float>& norBuf) {
-	Image image(imageWidth, imageHeight);
-	vector<float> zBuf(imageWidth * imageHeight, numeric_limits<float>::lowest()); 
-
-	for (size_t i = 0; i < vertices.size(); i++) {
-		vertices[i].normX = norBuf[3 * i];
-		vertices[i].normY = norBuf[3 * i + 1];
-		vertices[i].normZ = norBuf[3 * i + 2];
+// Draws the whole mesh of meshName and reports any pixel that differs from
+// reference, the streamed result.
+bool verify_stream(const string& meshName, const Task& task, const RenderOptions& options, const Image& reference, ostream& log){
+	Mesh mesh;
+	string err;
+	if (!load_obj_mesh(meshName, mesh, err)){
+		log << err << endl;
+		return false;
 	}
+	Image image(reference.getWidth(), reference.getHeight());
+	ostringstream ignored;
+	if (!render(mesh, task, options, image, ignored)){
+		log << ignored.str();
+		return false;
+	}
+	size_t mismatched = count_mismatched(reference, image);
+	log << "Stream check: " << (mismatched ? "FAILED, " : "ok, ") << mismatched << " pixels differ from the whole mesh" << endl;
+	return mismatched == 0;
+}
 
-	float minX, maxX, minY, maxY;
-	compute_bounding_box(vertices, minX, maxX, minY, maxY);
-
-	float scaleX = imageWidth / (maxX - minX);
-	float scaleY = imageHeight / (maxY - minY);
-	float finalScale = min(scaleX, scaleY);
-	float translationX = (imageWidth - finalScale * (maxX + minX)) / 2;
-	float translationY = (imageHeight - finalScale * (minY + maxY)) / 2;
-
-	for (size_t i = 0; i < vertices.size(); i += 3) {
-		Triangle tri;
-		for (int j = 0; j < 3; ++j) {
-			tri.vertices[j].x = finalScale * vertices[i + j].x + translationX;
-			tri.vertices[j].y = finalScale * vertices[i + j].y + translationY;
-			tri.vertices[j].z = vertices[i + j].z;
-			tri.vertices[j].normX = vertices[i + j].normX;
-			tri.vertices[j].normY = vertices[i + j].normY;
-			tri.vertices[j].normZ = vertices[i + j].normZ;
-		}
-
-		compute_bounding_box({ tri.vertices[0], tri.vertices[1], tri.vertices[2] }, tri.minX, tri.maxX, tri.minY, tri.maxY);
-
-		int boundBoxMinX = max(static_cast<int>(floor(tri.minX)), 0);
-		int boundBoxMaxX = min(static_cast<int>(ceil(tri.maxX)), imageWidth - 1);
-		int boundBoxMinY = max(static_cast<int>(floor(tri.minY)), 0);
-		int boundBoxMaxY = min(static_cast<int>(ceil(tri.maxY)), imageHeight - 1);
-
-		for (int y = boundBoxMinY; y <= boundBoxMaxY; ++y) {
-			for (int x = boundBoxMinX; x <= boundBoxMaxX; ++x) {
-				float alpha, beta, gamma;
-				baryc_triangle_task3(x, y, tri.vertices[0], tri.vertices[1], tri.vertices[2], alpha, beta, gamma);
-
-				if (alpha >= 0 && beta >= 0 && gamma >= 0) {
-					float normX = alpha * tri.vertices[0].normX + beta * tri.vertices[1].normX + gamma * tri.vertices[2].normX;
-					float normY = alpha * tri.vertices[0].normY + beta * tri.vertices[1].normY + gamma * tri.vertices[2].normY;
-					float normZ = alpha * tri.vertices[0].normZ + beta * tri.vertices[1].normZ + gamma * tri.vertices[2].normZ;
-
-					float zPixel = alpha * tri.vertices[0].z + beta * tri.vertices[1].z + gamma * tri.vertices[2].z;
-					int zi = y * imageWidth + x;
-
-					if (zPixel > zBuf[zi]) {
-						unsigned char r = static_cast<unsigned char>((normX * 0.5f + 0.5f) * 255);
-						unsigned char g = static_cast<unsigned char>((normY * 0.5f + 0.5f) * 255);
-						unsigned char b = static_cast<unsigned char>((normZ * 0.5f + 0.5f) * 255);
-
-						image.setPixel(x, y, r, g, b);
-						zBuf[zi] = zPixel;
-					}
-				}
+// Parses the options in args, starting at first, into options. Job files
+// take the same options as the command line.
+bool parse_options(const vector<string>& args, size_t first, RenderOptions& options, string& err){
+	for (size_t i = first; i < args.size(); ++i) {
+		const string& arg = args[i];
+		bool hasValue = i + 1 < args.size();
+		if (arg == "--tile" && hasValue) {
+			options.tileSize = stoi(args[++i]);
+		} else if (arg == "--threads" && hasValue) {
+			options.threadCount = stoi(args[++i]);
+		} else if (arg == "--simd" && hasValue) {
+			// Never ask for more than the CPU supports.
+			const string& name = args[++i];
+			SimdLevel level = name == "avx2" ? SimdLevel::AVX2 : name == "sse4.1" ? SimdLevel::SSE41 : SimdLevel::Scalar;
+			options.simdLevel = min(level, options.simdLevel);
+		} else if (arg == "--camera" && i + 3 < args.size()) {
+			options.useCamera = true;
+			for (int k = 0; k < 3; ++k) {
+				options.eye[k] = stof(args[++i]);
 			}
+		} else if (arg == "--cull" && hasValue) {
+			const string& mode = args[++i];
+			if (mode == "none") {
+				options.cull = CullMode::None;
+			} else if (mode == "degenerate") {
+				options.cull = CullMode::Degenerate;
+			} else if (mode == "back") {
+				options.cull = CullMode::Back;
+			} else if (mode == "front") {
+				options.cull = CullMode::Front;
+			} else {
+				err = "Unknown cull mode " + mode;
+				return false;
+			}
+		} else if (arg == "--no-hiz") {
+			options.hierarchicalZ = false;
+		} else if (arg == "--deferred") {
+			options.deferred = true;
+		} else if (arg == "--msaa" && hasValue) {
+			options.samples = stoi(args[++i]);
+			if (options.samples != 2 && options.samples != 4 && options.samples != 8) {
+				err = "--msaa takes 2, 4 or 8 samples";
+				return false;
+			}
+		} else if (arg == "--texture" && hasValue) {
+			options.textureName = args[++i];
+		} else if (arg == "--depth-stats") {
+			options.depthStats = true;
+		} else if (arg == "--stream" && hasValue) {
+			options.streamChunk = stoul(args[++i]);
+		} else if (arg == "--png" && hasValue) {
+			if (!parse_png_level(args[++i], options.png)) {
+				err = "--png takes store, fast or best";
+				return false;
+			}
+		} else if (arg == "--verify-simd") {
+			options.verifySimd = true;
+		} else if (arg == "--verify-stream") {
+			options.verifyStream = true;
+		} else {
+			err = "Unknown option " + arg;
+			return false;
 		}
 	}
 
-	image.writeToFile(outFName);
+	if (options.streamChunk > 0 && options.verifySimd) {
+		err = "--verify-simd needs the whole mesh and cannot be used with --stream";
+		return false;
+	}
+	if (options.samples > 1 && options.verifySimd) {
+		// MSAA has only the scalar kernel, so there would be nothing to compare.
+		err = "--verify-simd checks the SIMD kernels, which --msaa does not use";
+		return false;
+	}
+	if (options.streamChunk == 0 && options.verifyStream) {
+		err = "--verify-stream compares against --stream and needs it";
+		return false;
+	}
+	if (options.samples > 1 && options.deferred) {
+		err = "--deferred shades per pixel and cannot be used with --msaa";
+		return false;
+	}
+	return true;
 }
 
-
-
-
-
-
-
-
-void task_seven(vector<Vertex>& vertices, const string& outFName, int imageWidth, int imageHeight, const vector<float>& norBuf) {
-	Image image(imageWidth, imageHeight);
-	vector<float> zBuf(imageWidth * imageHeight, numeric_limits<float>::lowest());
-
-	const float light[3] = { 1 / sqrt(3), 1 / sqrt(3), 1 / sqrt(3) };
-
-	for (size_t i = 0; i < vertices.size(); i++) {
-		vertices[i].normX = norBuf[3 * i];
-		vertices[i].normY = norBuf[3 * i + 1];
-		vertices[i].normZ = norBuf[3 * i + 2];
+// Loads the image for a texture task, or makes the checkerboard.
+bool load_texture(const string& textureName, Texture& texture, string& err){
+	if (textureName.empty()){
+		make_checkerboard(texture);
+		return true;
 	}
+	return texture.load(textureName, err);
+}
 
-	float minX, maxX, minY, maxY;
-	compute_bounding_box(vertices, minX, maxX, minY, maxY);
+// One line of a job file: the five positional arguments of a single render,
+// then any options for it alone.
+struct RenderJob {
+	string meshName;
+	string outFName;
+	int imageWidth, imageHeight;
+	Task task;
+	RenderOptions options;
+};
 
-	float scaleX = imageWidth / (maxX - minX);
-	float scaleY = imageHeight / (maxY - minY);
-	float finalScale = min(scaleX, scaleY);
-	float translationX = (imageWidth - finalScale * (maxX + minX)) / 2;
-	float translationY = (imageHeight - finalScale * (minY + maxY)) / 2;
-
-	for (size_t i = 0; i < vertices.size(); i += 3) {
-		Triangle tri;
-		for (int j = 0; j < 3; ++j) {
-			tri.vertices[j].x = finalScale * vertices[i + j].x + translationX;
-			tri.vertices[j].y = finalScale * vertices[i + j].y + translationY;
-			tri.vertices[j].z = vertices[i + j].z;
-			tri.vertices[j].normX = vertices[i + j].normX;
-			tri.vertices[j].normY = vertices[i + j].normY;
-			tri.vertices[j].normZ = vertices[i + j].normZ;
+// Reads one job per line; blank lines and lines starting with # are
+// skipped. Every job starts from defaults, the options given after the job
+// file on the command line.
+bool read_job_file(const string& filename, const RenderOptions& defaults, vector<RenderJob>& jobs, string& err){
+	ifstream file(filename);
+	if (!file){
+		err = "Cannot open " + filename;
+		return false;
+	}
+	string line;
+	for (int lineNumber = 1; getline(file, line); ++lineNumber){
+		istringstream words(line);
+		vector<string> args;
+		for (string word; words >> word; ){
+			args.push_back(word);
 		}
-
-		compute_bounding_box({ tri.vertices[0], tri.vertices[1], tri.vertices[2] }, tri.minX, tri.maxX, tri.minY, tri.maxY);
-
-		int boundBoxMinX = max(static_cast<int>(floor(tri.minX)), 0);
-		int boundBoxMaxX = min(static_cast<int>(ceil(tri.maxX)), imageWidth - 1);
-		int boundBoxMinY = max(static_cast<int>(floor(tri.minY)), 0);
-		int boundBoxMaxY = min(static_cast<int>(ceil(tri.maxY)), imageHeight - 1);
-
-		for (int y = boundBoxMinY; y <= boundBoxMaxY; ++y) {
-			for (int x = boundBoxMinX; x <= boundBoxMaxX; ++x) {
-				float alpha, beta, gamma;
-				baryc_triangle_task3(x, y, tri.vertices[0], tri.vertices[1], tri.vertices[2], alpha, beta, gamma);
-
-				if (alpha >= 0 && beta >= 0 && gamma >= 0) {
-					float normX = alpha * tri.vertices[0].normX + beta * tri.vertices[1].normX + gamma * tri.vertices[2].normX;
-					float normY = alpha * tri.vertices[0].normY + beta * tri.vertices[1].normY + gamma * tri.vertices[2].normY;
-					float normZ = alpha * tri.vertices[0].normZ + beta * tri.vertices[1].normZ + gamma * tri.vertices[2].normZ;
-
-					float length = sqrt(normX * normX + normY * normY + normZ * normZ);
-					normX /= length;
-					normY /= length;
-					normZ /= length;
-
-					float dot = max(normX * light[0] + normY * light[1] + normZ * light[2], 0.0f);
-
-					unsigned char cIntensity = static_cast<unsigned char>(dot * 255);
-
-					int zIndex = y * imageWidth + x;
-					float pixelZ = alpha * tri.vertices[0].z + beta * tri.vertices[1].z + gamma * tri.vertices[2].z;
-					if (pixelZ > zBuf[zIndex]) {
-						image.setPixel(x, y, cIntensity, cIntensity, cIntensity);
-						zBuf[zIndex] = pixelZ;
-					}
-				}
+		if (args.empty() || args[0][0] == '#'){
+			continue;
+		}
+		string where = filename + ":" + to_string(lineNumber) + ": ";
+		RenderJob job;
+		job.options = defaults;
+		try {
+			if (args.size() < 5){
+				err = where + "expected <object>.obj <output name> <x-axis> <y-axis> <Task #>";
+				return false;
+			}
+			job.meshName = args[0];
+			job.outFName = args[1];
+			job.imageWidth = stoi(args[2]);
+			job.imageHeight = stoi(args[3]);
+			if (!make_task(stoi(args[4]), job.task)){
+				err = where + "unknown task " + args[4];
+				return false;
 			}
+			if (!parse_options(args, 5, job.options, err)){
+				err = where + err;
+				return false;
+			}
+		} catch (const logic_error&) {
+			err = where + "bad number";
+			return false;
 		}
+		jobs.push_back(job);
 	}
-
-	image.writeToFile(outFName);
+	return true;
 }
 
-
-
-
-
-
-void task_eight(vector<Vertex>& vertices, const string& outFName, int imageWidth, int imageHeight, const vector<float>& norBuf) {
-	Image image(imageWidth, imageHeight);
-	vector<float> zBuf(imageWidth * imageHeight, numeric_limits<float>::lowest());
-
-	const float light[3] = { 1 / sqrt(3), 1 / sqrt(3), 1 / sqrt(3) };
-	const float theta = 3.141592653589 / 4; // π/4
-
-	for (size_t i = 0; i < vertices.size(); i++) {
-		float x = vertices[i].x;
-		float z = vertices[i].z;
-		vertices[i].x = cos(theta) * x + sin(theta) * z;
-		vertices[i].z = -sin(theta) * x + cos(theta) * z;
-
-		float normX = norBuf[3 * i];
-		float normZ = norBuf[3 * i + 2];
-		vertices[i].normX = cos(theta) * normX + sin(theta) * normZ;
-		vertices[i].normY = norBuf[3 * i + 1];
-		vertices[i].normZ = -sin(theta) * normX + cos(theta) * normZ;
+// Runs every job in the file on one pool. Each distinct mesh and texture is
+// loaded once up front; the jobs then run concurrently, one per worker, each
+// drawing its own copy of the mesh single-threaded, and hand their images to
+// a writer thread so no worker waits on PNG encoding.
+bool run_batch(vector<RenderJob>& jobs, int threadCount){
+	WorkStealingPool pool(threadCount);
+
+	vector<string> meshNames, textureNames;
+	for (const RenderJob& job : jobs){
+		if (job.options.streamChunk == 0 && find(meshNames.begin(), meshNames.end(), job.meshName) == meshNames.end()){
+			meshNames.push_back(job.meshName);
+		}
+		bool textured = job.task.state.shade.mode == Shading::Texture;
+		if (textured && find(textureNames.begin(), textureNames.end(), job.options.textureName) == textureNames.end()){
+			textureNames.push_back(job.options.textureName);
+		}
 	}
-
-	float minX, maxX, minY, maxY;
-	compute_bounding_box(vertices, minX, maxX, minY, maxY);
-
-	float scaleX = imageWidth / (maxX - minX);
-	float scaleY = imageHeight / (maxY - minY);
-	float finalScale = min(scaleX, scaleY);
-	float translationX = (imageWidth - finalScale * (maxX + minX)) / 2;
-	float translationY = (imageHeight - finalScale * (minY + maxY)) / 2;
-
-	for (size_t i = 0; i < vertices.size(); i += 3) {
-		Triangle tri;
-		for (int j = 0; j < 3; ++j) {
-			tri.vertices[j].x = finalScale * vertices[i + j].x + translationX;
-			tri.vertices[j].y = finalScale * vertices[i + j].y + translationY;
-			tri.vertices[j].z = vertices[i + j].z;
-			tri.vertices[j].normX = vertices[i + j].normX;
-			tri.vertices[j].normY = vertices[i + j].normY;
-			tri.vertices[j].normZ = vertices[i + j].normZ;
+	vector<Mesh> meshes(meshNames.size());
+	vector<string> meshErrors(meshNames.size());
+	vector<char> meshLoaded(meshNames.size());
+	pool.run(static_cast<int>(meshNames.size()), [&](int i){
+		meshLoaded[i] = load_obj_mesh(meshNames[i], meshes[i], meshErrors[i]);
+	});
+	vector<Texture> textures(textureNames.size());
+	vector<string> textureErrors(textureNames.size());
+	vector<char> textureLoaded(textureNames.size());
+	pool.run(static_cast<int>(textureNames.size()), [&](int i){
+		textureLoaded[i] = load_texture(textureNames[i], textures[i], textureErrors[i]);
+	});
+
+	ImageWriter writer;
+	atomic<int> failed(0);
+	pool.run(static_cast<int>(jobs.size()), [&](int j){
+		RenderJob& job = jobs[j];
+		ostringstream log;
+		bool ok = true;
+		if (job.task.state.shade.mode == Shading::Texture){
+			size_t t = find(textureNames.begin(), textureNames.end(), job.options.textureName) - textureNames.begin();
+			job.options.texture = &textures[t];
+			if (!textureLoaded[t]){
+				log << textureErrors[t] << endl;
+				ok = false;
+			}
 		}
-
-		compute_bounding_box({ tri.vertices[0], tri.vertices[1], tri.vertices[2] }, tri.minX, tri.maxX, tri.minY, tri.maxY);
-
-		int boundBoxMinX = max(static_cast<int>(floor(tri.minX)), 0);
-		int boundBoxMaxX = min(static_cast<int>(ceil(tri.maxX)), imageWidth - 1);
-		int boundBoxMinY = max(static_cast<int>(floor(tri.minY)), 0);
-		int boundBoxMaxY = min(static_cast<int>(ceil(tri.maxY)), imageHeight - 1);
-
-		for (int y = boundBoxMinY; y <= boundBoxMaxY; ++y) {
-			for (int x = boundBoxMinX; x <= boundBoxMaxX; ++x) {
-				float alpha, beta, gamma;
-				baryc_triangle_task3(x, y, tri.vertices[0], tri.vertices[1], tri.vertices[2], alpha, beta, gamma);
-
-				if (alpha >= 0 && beta >= 0 && gamma >= 0) {
-					float normX = alpha * tri.vertices[0].normX + beta * tri.vertices[1].normX + gamma * tri.vertices[2].normX;
-					float normY = alpha * tri.vertices[0].normY + beta * tri.vertices[1].normY + gamma * tri.vertices[2].normY;
-					float normZ = alpha * tri.vertices[0].normZ + beta * tri.vertices[1].normZ + gamma * tri.vertices[2].normZ;
-
-					float length = sqrt(normX * normX + normY * normY + normZ * normZ);
-					normX /= length;
-					normY /= length;
-					normZ /= length;
-
-
-					float dot = max(normX * light[0] + normY * light[1] + normZ * light[2], 0.0f);
-					unsigned char cIntensity = static_cast<unsigned char>(dot * 255);
-
-
-					int zIndex = y * imageWidth + x;
-					float pixelZ = alpha * tri.vertices[0].z + beta * tri.vertices[1].z + gamma * tri.vertices[2].z;
-					if (pixelZ > zBuf[zIndex]) {
-						image.setPixel(x, y, cIntensity, cIntensity, cIntensity);
-						zBuf[zIndex] = pixelZ;
-					}
-				}
+		auto image = make_unique<Image>(job.imageWidth, job.imageHeight, Image::isFloatFormat(job.outFName));
+		if (ok && job.options.streamChunk > 0){
+			ObjStream stream;
+			string errStr;
+			if (stream.open(job.meshName, errStr)){
+				ok = render_streamed(stream, job.task, job.options, *image, log);
+				ok = (!job.options.verifyStream || verify_stream(job.meshName, job.task, job.options, *image, log)) && ok;
+			} else {
+				log << errStr << endl;
+				ok = false;
+			}
+		} else if (ok){
+			size_t m = find(meshNames.begin(), meshNames.end(), job.meshName) - meshNames.begin();
+			if (meshLoaded[m]){
+				Mesh mesh = meshes[m];
+				ok = render(mesh, job.task, job.options, *image, log);
+			} else {
+				log << meshErrors[m] << endl;
+				ok = false;
 			}
 		}
-	}
+		if (ok){
+			writer.submit(move(image), job.outFName, job.options.png, log.str());
+		} else {
+			failed.fetch_add(1);
+			cerr << "Failed " << job.outFName << ": " << log.str();
+		}
+	});
+	writer.finish();
 
-	image.writeToFile(outFName);
+	cout << "Rendered " << jobs.size() - failed.load() << " of " << jobs.size() << " jobs" << endl;
+	return failed.load() == 0;
 }
 
+int main(int argc, char** argv) {
+	// Rebuilds the binary caches that loading otherwise creates on first use.
+	if (argc >= 3 && string(argv[1]) == "--convert") {
+		for (int i = 2; i < argc; ++i) {
+			string errStr;
+			if (!convert_obj_to_cache(argv[i], mesh_cache_name(argv[i]), errStr)) {
+				cerr << errStr << endl;
+				return 1;
+			}
+			cout << "Wrote " << mesh_cache_name(argv[i]) << endl;
+		}
+		return 0;
+	}
 
+	vector<string> args(argv, argv + argc);
+	RenderOptions options;
+	string errStr;
+	if (argc >= 3 && args[1] == "--batch") {
+		// Jobs run one per worker, so a batch uses every hardware thread
+		// unless --threads says otherwise.
+		options.threadCount = 0;
+		vector<RenderJob> jobs;
+		if (!parse_options(args, 3, options, errStr) || !read_job_file(args[2], options, jobs, errStr)) {
+			cerr << errStr << endl;
+			return 1;
+		}
+		return run_batch(jobs, options.threadCount) ? 0 : 1;
+	}
 
-
-
-
-
-
-
-int main(int argc, char** argv) {
 	if (argc < 6){
-		cout << "Usage: ./A1 ../../resources/*object*.obj <output name> <x-axis> <y-axis> <Task #>" << endl;
+		cout << "Usage: ./A1 ../../resources/*object*.obj <output name> <x-axis> <y-axis> <Task #> [--tile <size>] [--threads <count>] [--simd scalar|sse4.1|avx2] [--verify-simd] [--camera <x> <y> <z>] [--cull none|degenerate|back|front] [--no-hiz] [--depth-stats] [--deferred] [--msaa 2|4|8] [--texture <image>] [--stream <triangles per chunk>] [--verify-stream] [--png store|fast|best]" << endl;
+		cout << "       ./A1 --convert <object>.obj..." << endl;
+		cout << "       ./A1 --batch <job file> [options for every job], on every hardware thread unless --threads is given" << endl;
+		cout << "The output name picks the format: .png, .ppm or .raw (8-bit), .pfm or .hdr (float)." << endl;
 		return 1;
 	}
 	string meshName = argv[1];
@@ -600,84 +705,65 @@ int main(int argc, char** argv) {
 	int imageWidth = stoi(argv[3]);
 	int imageHeight = stoi(argv[4]);
 	int taskNumber = stoi(argv[5]);
+	if (!parse_options(args, 6, options, errStr)) {
+		cerr << errStr << endl;
+		return 1;
+	}
 
-	vector<float> posBuf; // List of vertex positions
-	vector<float> norBuf; // List of vertex normals, not used in Task 1
-	vector<float> texBuf; // List of vertex texture coords, not used in Task 1
-	tinyobj::attrib_t attrib;
-	vector<tinyobj::shape_t> shapes;
-	vector<tinyobj::material_t> materials;
-	string errStr;
+	// 1 keeps everything on this thread.
+	unique_ptr<WorkStealingPool> pool;
+	if (options.threadCount != 1) {
+		pool = make_unique<WorkStealingPool>(options.threadCount);
+		options.pool = pool.get();
+	}
 
-	bool rc = tinyobj::LoadObj(&attrib, &shapes, &materials, &errStr, meshName.c_str());
-	if (!rc){
-		cerr << errStr << endl;
+	Task task;
+	if (!make_task(taskNumber, task)){
+		cerr << "Unknown task " << taskNumber << endl;
 		return 1;
 	}
 
-	// Some OBJ files have different indices for vertex positions, normals,
-	// and texture coordinates. For example, a cube corner vertex may have
-	// three different normals. Here, we are going to duplicate all such
-	// vertices.
-	// Loop over shapes
-	for (size_t s = 0; s < shapes.size(); s++) {
-		size_t index_offset = 0;
-		for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
-			size_t fv = shapes[s].mesh.num_face_vertices[f];
-			// Loop over faces (polygons)
-			for (size_t v = 0; v < fv; v++) {
-				// access to vertex
-				tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-				posBuf.push_back(attrib.vertices[3 * idx.vertex_index + 0]);
-				posBuf.push_back(attrib.vertices[3 * idx.vertex_index + 1]);
-				posBuf.push_back(attrib.vertices[3 * idx.vertex_index + 2]);
-				if (!attrib.normals.empty()) {
-					norBuf.push_back(attrib.normals[3 * idx.normal_index + 0]);
-					norBuf.push_back(attrib.normals[3 * idx.normal_index + 1]);
-					norBuf.push_back(attrib.normals[3 * idx.normal_index + 2]);
-				}
-				if (!attrib.texcoords.empty()) {
-					texBuf.push_back(attrib.texcoords[2 * idx.texcoord_index + 0]);
-					texBuf.push_back(attrib.texcoords[2 * idx.texcoord_index + 1]);
-				}
-			}
-			index_offset += fv;
-			// per-face material (IGNORE)
-			shapes[s].mesh.material_ids[f];
+	Texture texture;
+	if (task.state.shade.mode == Shading::Texture){
+		if (!load_texture(options.textureName, texture, errStr)){
+			cerr << errStr << endl;
+			return 1;
+		}
+		options.texture = &texture;
+	}
+
+	Image image(imageWidth, imageHeight, Image::isFloatFormat(outFName));
+	future<bool> written;
+	bool ok;
+	if (options.streamChunk > 0){
+		ObjStream stream;
+		if (!stream.open(meshName, errStr)){
+			cerr << errStr << endl;
+			return 1;
+		}
+		ok = render_streamed(stream, task, options, image, cout);
+		ok = (!options.verifyStream || verify_stream(meshName, task, options, image, cout)) && ok;
+		written = image.writeToFileAsync(outFName, options.png);
+		cout << "Number of vertex positions: " << stream.getPositions().getVertexCount() << endl;
+		cout << "Number of triangles: " << stream.getTriangleCount() << endl;
+	} else {
+		Mesh mesh;
+		if (!load_obj_mesh(meshName, mesh, errStr)){
+			cerr << errStr << endl;
+			return 1;
 		}
+		ok = render(mesh, task, options, image, cout);
+		written = image.writeToFileAsync(outFName, options.png);
+		cout << "Number of vertices: " << mesh.getVertexCount() << endl;
+		cout << "Number of triangles: " << mesh.getTriangleCount() << endl;
 	}
 
-	vector<Vertex> vertices;
-	for (size_t i = 0; i < posBuf.size(); i += 3) {
-		Vertex v;
-		v.x = posBuf[i];
-		v.y = posBuf[i + 1];
-		v.z = posBuf[i + 2];
-		v.normX = norBuf[i];
-		v.normY = norBuf[i + 1];
-		v.normZ = norBuf[i + 2];
-		vertices.push_back(v);
-	}
-
-	if (taskNumber == 1){
-		task_one(vertices, outFName, imageWidth, imageHeight);
-	} else if (taskNumber == 2){
-		task_two(vertices, outFName, imageWidth, imageHeight);
-	} else if (taskNumber == 3){
-		task_three(vertices, outFName, imageWidth, imageHeight);
-	} else if (taskNumber == 4) {
-		task_four(vertices, outFName, imageWidth, imageHeight);
-	} else if (taskNumber == 5) {
-		task_five(vertices, outFName, imageWidth, imageHeight);
-	} else if (taskNumber == 6) {
-		task_six(vertices, outFName, imageWidth, imageHeight, norBuf);
-	} else if (taskNumber == 7) {
-		task_seven(vertices, outFName, imageWidth, imageHeight, norBuf);
-	} else if (taskNumber == 8) {
-		task_eight(vertices, outFName, imageWidth, imageHeight, norBuf);
-	}
-
-	cout << "Number of vertices: " << posBuf.size() / 3 << endl;
-
-	return 0;
+	// The counts above went out while the image was still encoding.
+	if (written.get()) {
+		cout << "Wrote to " << outFName << endl;
+	} else {
+		cerr << "Couldn't write to " << outFName << endl;
+		ok = false;
+	}
+	return ok ? 0 : 1;
 }
@@ -3,6 +3,7 @@
 
 #include "GLSL.h"
 #include "Program.h"
+#include "MeshCache.h"
 
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "tiny_obj_loader.h"
@@ -22,45 +23,33 @@ Shape::~Shape()
 
 void Shape::loadMesh(const string &meshName)
 {
-	// Load geometry
-	tinyobj::attrib_t attrib;
-	std::vector<tinyobj::shape_t> shapes;
-	std::vector<tinyobj::material_t> materials;
-	string warnStr, errStr;
-	bool rc = tinyobj::LoadObj(&attrib, &shapes, &materials, &warnStr, &errStr, meshName.c_str());
-	if(!rc) {
+	// Load geometry from the binary cache next to the OBJ file, which is
+	// rebuilt whenever the OBJ is newer.
+	MeshCache cache;
+	string errStr;
+	if(!cache.open(meshName, errStr)) {
 		cerr << errStr << endl;
 	} else {
-		// Some OBJ files have different indices for vertex positions, normals,
-		// and texture coordinates. For example, a cube corner vertex may have
-		// three different normals. Here, we are going to duplicate all such
-		// vertices.
-		// Loop over shapes
-		for(size_t s = 0; s < shapes.size(); s++) {
-			// Loop over faces (polygons)
-			size_t index_offset = 0;
-			for(size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
-				size_t fv = shapes[s].mesh.num_face_vertices[f];
-				// Loop over vertices in the face.
-				for(size_t v = 0; v < fv; v++) {
-					// access to vertex
-					tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-					posBuf.push_back(attrib.vertices[3*idx.vertex_index+0]);
-					posBuf.push_back(attrib.vertices[3*idx.vertex_index+1]);
-					posBuf.push_back(attrib.vertices[3*idx.vertex_index+2]);
-					if(!attrib.normals.empty()) {
-						norBuf.push_back(attrib.normals[3*idx.normal_index+0]);
-						norBuf.push_back(attrib.normals[3*idx.normal_index+1]);
-						norBuf.push_back(attrib.normals[3*idx.normal_index+2]);
-					}
-					if(!attrib.texcoords.empty()) {
-						texBuf.push_back(attrib.texcoords[2*idx.texcoord_index+0]);
-						texBuf.push_back(attrib.texcoords[2*idx.texcoord_index+1]);
-					}
-				}
-				index_offset += fv;
-				// per-face material (IGNORE)
-				shapes[s].mesh.material_ids[f];
+		// The cache shares vertices between faces, but the buffers here are
+		// drawn without an index buffer, so every face corner gets its own
+		// copy.
+		const uint32_t* indices = cache.getIndices();
+		const float* pos[3] = { cache.getPositions(0), cache.getPositions(1), cache.getPositions(2) };
+		const float* nor[3] = { cache.getNormals(0), cache.getNormals(1), cache.getNormals(2) };
+		const float* tex[2] = { cache.getTexcoords(0), cache.getTexcoords(1) };
+		for(uint32_t i = 0; i < cache.getIndexCount(); i++) {
+			uint32_t v = indices[i];
+			posBuf.push_back(pos[0][v]);
+			posBuf.push_back(pos[1][v]);
+			posBuf.push_back(pos[2][v]);
+			if(cache.hasNormals()) {
+				norBuf.push_back(nor[0][v]);
+				norBuf.push_back(nor[1][v]);
+				norBuf.push_back(nor[2][v]);
+			}
+			if(cache.hasTexcoords()) {
+				texBuf.push_back(tex[0][v]);
+				texBuf.push_back(tex[1][v]);
 			}
 		}
 	}
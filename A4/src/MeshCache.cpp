@@ -0,0 +1,334 @@
+#include <unordered_map>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <cstring>
+#include <limits>
+#include "MeshCache.h"
+#include "tiny_obj_loader.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+static const uint32_t MESH_CACHE_VERSION = 1;
+static const uint32_t BYTE_ORDER_MARK = 0x01020304u;
+
+// Arrays in file order; vertex arrays a mesh lacks take no space.
+enum {
+	ARRAY_X, ARRAY_Y, ARRAY_Z,
+	ARRAY_NX, ARRAY_NY, ARRAY_NZ,
+	ARRAY_U, ARRAY_V,
+	ARRAY_INDICES,
+	ARRAY_COUNT
+};
+
+static size_t align16(size_t n)
+{
+	return (n + 15) & ~static_cast<size_t>(15);
+}
+
+static bool has_array(const MeshCacheHeader& header, int array)
+{
+	if (array >= ARRAY_NX && array <= ARRAY_NZ) {
+		return (header.flags & MESH_CACHE_NORMALS) != 0;
+	}
+	if (array == ARRAY_U || array == ARRAY_V) {
+		return (header.flags & MESH_CACHE_TEXCOORDS) != 0;
+	}
+	return true;
+}
+
+// Byte offset of every array, and of the end of the file at ARRAY_COUNT.
+static void array_offsets(const MeshCacheHeader& header, size_t* offsets)
+{
+	size_t offset = align16(sizeof(MeshCacheHeader));
+	for (int array = 0; array < ARRAY_COUNT; ++array) {
+		offsets[array] = offset;
+		if (array == ARRAY_INDICES) {
+			offset += align16(header.indexCount * sizeof(uint32_t));
+		} else if (has_array(header, array)) {
+			offset += align16(header.vertexCount * sizeof(float));
+		}
+	}
+	offsets[ARRAY_COUNT] = offset;
+}
+
+// Builds the whole cache file in memory.
+static bool build_cache(const string& objName, vector<unsigned char>& bytes, string& err)
+{
+	tinyobj::attrib_t attrib;
+	vector<tinyobj::shape_t> shapes;
+	vector<tinyobj::material_t> materials;
+	if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &err, objName.c_str())) {
+		return false;
+	}
+
+	const bool hasNormals = !attrib.normals.empty();
+	const bool hasTexcoords = !attrib.texcoords.empty();
+	vector<float> components[ARRAY_INDICES];
+	vector<uint32_t> indices;
+	unordered_map<CornerKey, uint32_t, CornerHash> vertexOf;
+	for (const auto& shape : shapes) {
+		for (const tinyobj::index_t& idx : shape.mesh.indices) {
+			CornerKey key = { idx.vertex_index, hasNormals ? idx.normal_index : -1, hasTexcoords ? idx.texcoord_index : -1 };
+			auto found = vertexOf.find(key);
+			if (found != vertexOf.end()) {
+				indices.push_back(found->second);
+				continue;
+			}
+			uint32_t v = static_cast<uint32_t>(components[ARRAY_X].size());
+			vertexOf.emplace(key, v);
+			indices.push_back(v);
+			for (int k = 0; k < 3; ++k) {
+				components[ARRAY_X + k].push_back(attrib.vertices[3 * key.position + k]);
+				components[ARRAY_NX + k].push_back(key.normal < 0 ? 0.0f : attrib.normals[3 * key.normal + k]);
+			}
+			for (int k = 0; k < 2; ++k) {
+				components[ARRAY_U + k].push_back(key.texcoord < 0 ? 0.0f : attrib.texcoords[2 * key.texcoord + k]);
+			}
+		}
+	}
+
+	MeshCacheHeader header;
+	memcpy(header.magic, "MSHC", 4);
+	header.version = MESH_CACHE_VERSION;
+	header.byteOrder = BYTE_ORDER_MARK;
+	header.flags = (hasNormals ? MESH_CACHE_NORMALS : 0) | (hasTexcoords ? MESH_CACHE_TEXCOORDS : 0);
+	header.vertexCount = static_cast<uint32_t>(components[ARRAY_X].size());
+	header.indexCount = static_cast<uint32_t>(indices.size());
+	for (int k = 0; k < 3; ++k) {
+		header.boundsMin[k] = numeric_limits<float>::max();
+		header.boundsMax[k] = -numeric_limits<float>::max();
+		for (float c : components[ARRAY_X + k]) {
+			header.boundsMin[k] = min(header.boundsMin[k], c);
+			header.boundsMax[k] = max(header.boundsMax[k], c);
+		}
+	}
+
+	size_t offsets[ARRAY_COUNT + 1];
+	array_offsets(header, offsets);
+	bytes.assign(offsets[ARRAY_COUNT], 0);
+	memcpy(bytes.data(), &header, sizeof(header));
+	for (int array = 0; array < ARRAY_INDICES; ++array) {
+		if (has_array(header, array) && header.vertexCount > 0) {
+			memcpy(bytes.data() + offsets[array], components[array].data(), header.vertexCount * sizeof(float));
+		}
+	}
+	if (header.indexCount > 0) {
+		memcpy(bytes.data() + offsets[ARRAY_INDICES], indices.data(), header.indexCount * sizeof(uint32_t));
+	}
+	return true;
+}
+
+static bool write_file(const string& filename, const vector<unsigned char>& bytes, string& err)
+{
+	string tempName = filename + ".tmp";
+	{
+		ofstream out(tempName, ios::binary | ios::trunc);
+		out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+		if (!out) {
+			err = "Cannot write " + tempName;
+			return false;
+		}
+	}
+	error_code ec;
+	filesystem::rename(tempName, filename, ec);
+	if (ec) {
+		filesystem::remove(tempName, ec);
+		err = "Cannot write " + filename;
+		return false;
+	}
+	return true;
+}
+
+string mesh_cache_name(const string& objName)
+{
+	return objName + ".mcache";
+}
+
+bool convert_obj_to_cache(const string& objName, const string& cacheName, string& err)
+{
+	vector<unsigned char> bytes;
+	return build_cache(objName, bytes, err) && write_file(cacheName, bytes, err);
+}
+
+MeshCache::MeshCache() :
+	header(nullptr),
+	data(nullptr),
+	size(0),
+	mapping(nullptr)
+{
+}
+
+MeshCache::~MeshCache()
+{
+	close();
+}
+
+bool MeshCache::open(const string& objName, string& err)
+{
+	close();
+	string cacheName = mesh_cache_name(objName);
+	error_code objError, cacheError;
+	auto objTime = filesystem::last_write_time(objName, objError);
+	auto cacheTime = filesystem::last_write_time(cacheName, cacheError);
+	// A cache without its OBJ is still usable.
+	bool current = !cacheError && (objError || cacheTime >= objTime);
+	if (current && openCache(cacheName, err)) {
+		return true;
+	}
+
+	vector<unsigned char> bytes;
+	if (!build_cache(objName, bytes, err)) {
+		return false;
+	}
+	string writeErr;
+	if (write_file(cacheName, bytes, writeErr) && openCache(cacheName, err)) {
+		return true;
+	}
+	owned = move(bytes);
+	return attach(owned.data(), owned.size(), err);
+}
+
+bool MeshCache::openCache(const string& cacheName, string& err)
+{
+	close();
+#ifdef _WIN32
+	HANDLE file = CreateFileA(cacheName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		err = "Cannot open " + cacheName;
+		return false;
+	}
+	LARGE_INTEGER fileSize;
+	GetFileSizeEx(file, &fileSize);
+	HANDLE fileMapping = fileSize.QuadPart > 0 ? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+	void* view = fileMapping ? MapViewOfFile(fileMapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	// The view keeps the mapping alive on its own.
+	if (fileMapping) {
+		CloseHandle(fileMapping);
+	}
+	CloseHandle(file);
+	if (!view) {
+		err = "Cannot map " + cacheName;
+		return false;
+	}
+	size_t mappedSize = static_cast<size_t>(fileSize.QuadPart);
+#else
+	int fd = ::open(cacheName.c_str(), O_RDONLY);
+	if (fd < 0) {
+		err = "Cannot open " + cacheName;
+		return false;
+	}
+	struct stat info;
+	void* view = nullptr;
+	if (fstat(fd, &info) == 0 && info.st_size > 0) {
+		view = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	::close(fd);
+	if (!view || view == MAP_FAILED) {
+		err = "Cannot map " + cacheName;
+		return false;
+	}
+	size_t mappedSize = static_cast<size_t>(info.st_size);
+#endif
+	mapping = view;
+	size = mappedSize;
+	if (!attach(static_cast<const unsigned char*>(view), mappedSize, err)) {
+		err = cacheName + ": " + err;
+		close();
+		return false;
+	}
+	return true;
+}
+
+void MeshCache::close()
+{
+	if (mapping) {
+#ifdef _WIN32
+		UnmapViewOfFile(mapping);
+#else
+		munmap(mapping, size);
+#endif
+	}
+	header = nullptr;
+	data = nullptr;
+	size = 0;
+	mapping = nullptr;
+	owned.clear();
+}
+
+// Checks that bytes hold a whole cache this build can read, then points the
+// views at it.
+bool MeshCache::attach(const unsigned char* bytes, size_t byteCount, string& err)
+{
+	const MeshCacheHeader* h = reinterpret_cast<const MeshCacheHeader*>(bytes);
+	if (byteCount < sizeof(MeshCacheHeader) || memcmp(h->magic, "MSHC", 4) != 0) {
+		err = "not a mesh cache";
+		return false;
+	}
+	if (h->version != MESH_CACHE_VERSION || h->byteOrder != BYTE_ORDER_MARK) {
+		err = "mesh cache from an incompatible version";
+		return false;
+	}
+	size_t offsets[ARRAY_COUNT + 1];
+	array_offsets(*h, offsets);
+	if (byteCount != offsets[ARRAY_COUNT] || h->indexCount % 3 != 0) {
+		err = "truncated mesh cache";
+		return false;
+	}
+	const uint32_t* indices = reinterpret_cast<const uint32_t*>(bytes + offsets[ARRAY_INDICES]);
+	for (uint32_t i = 0; i < h->indexCount; ++i) {
+		if (indices[i] >= h->vertexCount) {
+			err = "mesh cache index out of range";
+			return false;
+		}
+	}
+	header = h;
+	data = bytes;
+	size = byteCount;
+	return true;
+}
+
+const float* MeshCache::getArray(int array) const
+{
+	if (!header || !has_array(*header, array)) {
+		return nullptr;
+	}
+	size_t offsets[ARRAY_COUNT + 1];
+	array_offsets(*header, offsets);
+	return reinterpret_cast<const float*>(data + offsets[array]);
+}
+
+const float* MeshCache::getPositions(int k) const
+{
+	return getArray(ARRAY_X + k);
+}
+
+const float* MeshCache::getNormals(int k) const
+{
+	return getArray(ARRAY_NX + k);
+}
+
+const float* MeshCache::getTexcoords(int k) const
+{
+	return getArray(ARRAY_U + k);
+}
+
+const uint32_t* MeshCache::getIndices() const
+{
+	if (!header) {
+		return nullptr;
+	}
+	size_t offsets[ARRAY_COUNT + 1];
+	array_offsets(*header, offsets);
+	return reinterpret_cast<const uint32_t*>(data + offsets[ARRAY_INDICES]);
+}
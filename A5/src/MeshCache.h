@@ -0,0 +1,98 @@
+#pragma once
+#ifndef _MESHCACHE_H_
+#define _MESHCACHE_H_
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+// Binary form of an OBJ mesh, laid out so it can be mapped and used in place.
+// The file is this header followed by one float array per vertex component
+// (x, y, z, then nx, ny, nz and u, v when present) and the uint32 index
+// buffer, three indices per triangle. Each array starts on a 16-byte
+// boundary. OBJ corners that share position, normal and texture coordinate
+// become one vertex, numbered in order of first use.
+struct MeshCacheHeader {
+	char magic[4];      // "MSHC"
+	uint32_t version;
+	uint32_t byteOrder; // 0x01020304 as written
+	uint32_t flags;
+	uint32_t vertexCount;
+	uint32_t indexCount;
+	float boundsMin[3];
+	float boundsMax[3];
+};
+
+const uint32_t MESH_CACHE_NORMALS = 1;
+const uint32_t MESH_CACHE_TEXCOORDS = 2;
+
+// An OBJ corner as zero-based position, normal and texture coordinate
+// indices, -1 where the corner or the file has none. Corners with equal keys
+// become one vertex.
+struct CornerKey {
+	int position, normal, texcoord;
+	bool operator==(const CornerKey& other) const
+	{
+		return position == other.position && normal == other.normal && texcoord == other.texcoord;
+	}
+};
+
+struct CornerHash {
+	size_t operator()(const CornerKey& key) const
+	{
+		uint64_t h = static_cast<uint32_t>(key.position);
+		h = h * 0x9e3779b97f4a7c15ull ^ static_cast<uint32_t>(key.normal);
+		h = h * 0x9e3779b97f4a7c15ull ^ static_cast<uint32_t>(key.texcoord);
+		return static_cast<size_t>(h ^ h >> 29);
+	}
+};
+
+// Read-only view of a mesh cache. open() looks for the cache next to the OBJ
+// file and converts the OBJ first when the cache is missing or older than it,
+// so only the first run after an edit parses text. The arrays are views into
+// the mapped file and stay valid until close() or destruction.
+class MeshCache
+{
+public:
+	MeshCache();
+	virtual ~MeshCache();
+	// If the cache cannot be written (say, a read-only directory) the
+	// converted mesh is kept in memory instead.
+	bool open(const std::string& objName, std::string& err);
+	// Maps an existing cache file without looking at its OBJ.
+	bool openCache(const std::string& cacheName, std::string& err);
+	void close();
+	uint32_t getVertexCount() const { return header ? header->vertexCount : 0; }
+	uint32_t getIndexCount() const { return header ? header->indexCount : 0; }
+	bool hasNormals() const { return header && (header->flags & MESH_CACHE_NORMALS); }
+	bool hasTexcoords() const { return header && (header->flags & MESH_CACHE_TEXCOORDS); }
+	// Component k of every vertex; nullptr when the mesh has no such
+	// attribute.
+	const float* getPositions(int k) const;
+	const float* getNormals(int k) const;
+	const float* getTexcoords(int k) const;
+	const uint32_t* getIndices() const;
+	const float* getBoundsMin() const { return header->boundsMin; }
+	const float* getBoundsMax() const { return header->boundsMax; }
+
+private:
+	bool attach(const unsigned char* bytes, size_t size, std::string& err);
+	const float* getArray(int array) const;
+
+	const MeshCacheHeader* header;
+	const unsigned char* data;
+	size_t size;
+	void* mapping;
+	std::vector<unsigned char> owned;
+};
+
+// The cache file open() uses for objName.
+std::string mesh_cache_name(const std::string& objName);
+
+// Parses objName and writes its cache to cacheName. The file is written
+// under a temporary name and renamed into place, so a reader never sees a
+// partial cache.
+bool convert_obj_to_cache(const std::string& objName, const std::string& cacheName, std::string& err);
+
+#endif
@@ -0,0 +1,105 @@
+#include <filesystem>
+#include <fstream>
+#include <cstring>
+#include "Accumulator.h"
+
+using namespace std;
+
+static const uint32_t ACCUMULATOR_VERSION = 1;
+static const uint32_t BYTE_ORDER_MARK = 0x01020304u;
+
+Accumulator::Accumulator(int w, int h) :
+	width(w),
+	height(h),
+	passes(0),
+	sums(3 * static_cast<size_t>(w) * h, 0.0)
+{
+}
+
+Accumulator::~Accumulator()
+{
+}
+
+void Accumulator::add(int pixel, const double* rgb)
+{
+	double* sum = &sums[3 * static_cast<size_t>(pixel)];
+	sum[0] += rgb[0];
+	sum[1] += rgb[1];
+	sum[2] += rgb[2];
+}
+
+void Accumulator::getMean(int pixel, double* rgb) const
+{
+	const double* sum = &sums[3 * static_cast<size_t>(pixel)];
+	for (int k = 0; k < 3; ++k) {
+		rgb[k] = passes > 0 ? sum[k] / passes : 0.0;
+	}
+}
+
+bool Accumulator::save(const string& filename, const string& settings, string& err) const
+{
+	AccumulatorHeader header;
+	memcpy(header.magic, "ACCU", 4);
+	header.version = ACCUMULATOR_VERSION;
+	header.byteOrder = BYTE_ORDER_MARK;
+	header.width = static_cast<uint32_t>(width);
+	header.height = static_cast<uint32_t>(height);
+	header.passes = static_cast<uint32_t>(passes);
+	header.settingsLength = static_cast<uint32_t>(settings.size());
+
+	string tempName = filename + ".tmp";
+	{
+		ofstream out(tempName, ios::binary | ios::trunc);
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.write(settings.data(), settings.size());
+		out.write(reinterpret_cast<const char*>(sums.data()), sums.size() * sizeof(double));
+		if (!out) {
+			err = "Cannot write " + tempName;
+			return false;
+		}
+	}
+	error_code ec;
+	filesystem::rename(tempName, filename, ec);
+	if (ec) {
+		filesystem::remove(tempName, ec);
+		err = "Cannot write " + filename;
+		return false;
+	}
+	return true;
+}
+
+bool Accumulator::load(const string& filename, const string& settings, string& err)
+{
+	ifstream in(filename, ios::binary);
+	if (!in) {
+		err = "Cannot open " + filename;
+		return false;
+	}
+	AccumulatorHeader header;
+	if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) || memcmp(header.magic, "ACCU", 4) != 0) {
+		err = filename + " is not a checkpoint";
+		return false;
+	}
+	if (header.version != ACCUMULATOR_VERSION || header.byteOrder != BYTE_ORDER_MARK) {
+		err = filename + " was written by another version or machine";
+		return false;
+	}
+	if (header.width != static_cast<uint32_t>(width) || header.height != static_cast<uint32_t>(height)) {
+		err = filename + " holds a " + to_string(header.width) + "x" + to_string(header.height) + " image";
+		return false;
+	}
+	string saved(header.settingsLength, '\0');
+	in.read(&saved[0], saved.size());
+	if (in && saved != settings) {
+		err = filename + " was rendered with " + saved;
+		return false;
+	}
+	vector<double> loaded(sums.size());
+	if (!in.read(reinterpret_cast<char*>(loaded.data()), loaded.size() * sizeof(double))) {
+		err = filename + " is truncated";
+		return false;
+	}
+	sums = move(loaded);
+	passes = static_cast<int>(header.passes);
+	return true;
+}
@@ -0,0 +1,52 @@
+#pragma once
+#ifndef _ACCUMULATOR_H_
+#define _ACCUMULATOR_H_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// Checkpoint file of an Accumulator: this header, then settingsLength bytes
+// naming the settings the passes were rendered with, then the sums as
+// 3 * width * height doubles, bottom row first.
+struct AccumulatorHeader {
+	char magic[4];      // "ACCU"
+	uint32_t version;
+	uint32_t byteOrder; // 0x01020304 as written
+	uint32_t width;
+	uint32_t height;
+	uint32_t passes;
+	uint32_t settingsLength;
+};
+
+// Per-pixel sums of the colors of every pass so far, for rendering in
+// passes. During a pass each pixel is added to once, by whichever thread
+// renders it, so adds need no locking. Saved to a checkpoint, the sums let a
+// render stop and carry on later as if it had never stopped.
+class Accumulator
+{
+public:
+	Accumulator(int width, int height);
+	virtual ~Accumulator();
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+	int getPasses() const { return passes; }
+	// pixel is y * width + x with y counted from the bottom, as in
+	// Image::setPixel.
+	void add(int pixel, const double* rgb);
+	void endPass() { ++passes; }
+	// The mean of the passes so far; black before the first.
+	void getMean(int pixel, double* rgb) const;
+	// Written to a temporary file first, so an interrupted save leaves the
+	// last checkpoint whole. settings must match on load.
+	bool save(const std::string& filename, const std::string& settings, std::string& err) const;
+	bool load(const std::string& filename, const std::string& settings, std::string& err);
+
+private:
+	int width;
+	int height;
+	int passes;
+	std::vector<double> sums;
+};
+
+#endif
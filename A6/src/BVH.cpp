@@ -0,0 +1,168 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "BVH.h"
+
+using namespace std;
+
+static const int BINS = 16;
+static const uint32_t MAX_LEAF = 4;
+// Keeps traversal inside its fixed stack.
+static const int MAX_DEPTH = 60;
+
+AABB::AABB()
+{
+	for (int k = 0; k < 3; ++k) {
+		lo[k] = numeric_limits<float>::max();
+		hi[k] = -numeric_limits<float>::max();
+	}
+}
+
+void AABB::grow(const AABB& box)
+{
+	for (int k = 0; k < 3; ++k) {
+		lo[k] = min(lo[k], box.lo[k]);
+		hi[k] = max(hi[k], box.hi[k]);
+	}
+}
+
+void AABB::grow(const float* point)
+{
+	for (int k = 0; k < 3; ++k) {
+		lo[k] = min(lo[k], point[k]);
+		hi[k] = max(hi[k], point[k]);
+	}
+}
+
+float AABB::area() const
+{
+	float d[3];
+	for (int k = 0; k < 3; ++k) {
+		d[k] = max(hi[k] - lo[k], 0.0f);
+	}
+	return 2.0f * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
+
+BVH::BVH()
+{
+}
+
+BVH::~BVH()
+{
+}
+
+void BVH::build(const vector<AABB>& bounds)
+{
+	nodes.clear();
+	primitives.resize(bounds.size());
+	if (bounds.empty()) {
+		return;
+	}
+	vector<Build> prims(bounds.size());
+	for (size_t i = 0; i < bounds.size(); ++i) {
+		primitives[i] = static_cast<uint32_t>(i);
+		prims[i].box = bounds[i];
+		// Hits computed in float can land a rounding error outside the
+		// exact box, so every box grows by a little relative to its size
+		// and position.
+		for (int k = 0; k < 3; ++k) {
+			float pad = 1e-5f * (1.0f + max(fabs(bounds[i].lo[k]), fabs(bounds[i].hi[k])) + (bounds[i].hi[k] - bounds[i].lo[k]));
+			prims[i].box.lo[k] -= pad;
+			prims[i].box.hi[k] += pad;
+			prims[i].centroid[k] = prims[i].box.center(k);
+		}
+	}
+	nodes.reserve(2 * bounds.size());
+	buildNode(prims, 0, static_cast<uint32_t>(bounds.size()), 0);
+}
+
+uint32_t BVH::buildNode(vector<Build>& prims, uint32_t first, uint32_t count, int depth)
+{
+	uint32_t index = static_cast<uint32_t>(nodes.size());
+	nodes.emplace_back();
+	AABB box, centroids;
+	for (uint32_t i = first; i < first + count; ++i) {
+		box.grow(prims[primitives[i]].box);
+		centroids.grow(prims[primitives[i]].centroid);
+	}
+	for (int k = 0; k < 3; ++k) {
+		nodes[index].lo[k] = box.lo[k];
+		nodes[index].hi[k] = box.hi[k];
+	}
+
+	// Cost of a split relative to testing every primitive here, with a
+	// node visit costing as much as one primitive test.
+	float bestCost = numeric_limits<float>::max();
+	int bestAxis = -1, bestBin = 0;
+	float area = box.area();
+	for (int axis = 0; axis < 3 && count > 1; ++axis) {
+		float extent = centroids.hi[axis] - centroids.lo[axis];
+		if (!(extent > 0.0f)) {
+			continue;
+		}
+		float scale = BINS / extent;
+		AABB binBox[BINS];
+		uint32_t binCount[BINS] = {};
+		for (uint32_t i = first; i < first + count; ++i) {
+			const Build& p = prims[primitives[i]];
+			int b = min(static_cast<int>((p.centroid[axis] - centroids.lo[axis]) * scale), BINS - 1);
+			binBox[b].grow(p.box);
+			++binCount[b];
+		}
+		// Sweep from the right for the cost of every right side, then from
+		// the left.
+		float rightArea[BINS];
+		uint32_t rightCount[BINS];
+		AABB right;
+		uint32_t n = 0;
+		for (int b = BINS - 1; b > 0; --b) {
+			right.grow(binBox[b]);
+			n += binCount[b];
+			rightArea[b] = right.area();
+			rightCount[b] = n;
+		}
+		AABB left;
+		n = 0;
+		for (int b = 0; b < BINS - 1; ++b) {
+			left.grow(binBox[b]);
+			n += binCount[b];
+			if (n == 0 || rightCount[b + 1] == 0) {
+				continue;
+			}
+			float cost = 1.0f + (left.area() * n + rightArea[b + 1] * rightCount[b + 1]) / area;
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin = b;
+			}
+		}
+	}
+
+	bool leaf = bestAxis < 0 || depth >= MAX_DEPTH || (count <= MAX_LEAF && bestCost >= count);
+	if (leaf && count <= 0xffff) {
+		nodes[index].offset = first;
+		nodes[index].count = static_cast<uint16_t>(count);
+		nodes[index].axis = 0;
+		return index;
+	}
+
+	uint32_t leftCount;
+	if (leaf) {
+		// Too many to count in a leaf and nothing to split them by; halve
+		// the list as it stands.
+		bestAxis = 0;
+		leftCount = count / 2;
+	} else {
+		float scale = BINS / (centroids.hi[bestAxis] - centroids.lo[bestAxis]);
+		uint32_t* middle = partition(&primitives[first], &primitives[first] + count, [&](uint32_t p) {
+			return min(static_cast<int>((prims[p].centroid[bestAxis] - centroids.lo[bestAxis]) * scale), BINS - 1) <= bestBin;
+		});
+		leftCount = static_cast<uint32_t>(middle - &primitives[first]);
+	}
+	buildNode(prims, first, leftCount, depth + 1);
+	uint32_t second = buildNode(prims, first + leftCount, count - leftCount, depth + 1);
+	nodes[index].offset = second;
+	nodes[index].count = 0;
+	nodes[index].axis = static_cast<uint16_t>(bestAxis);
+	return index;
+}
@@ -0,0 +1,159 @@
+#pragma once
+#ifndef _BVH_H_
+#define _BVH_H_
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+struct AABB {
+	float lo[3];
+	float hi[3];
+
+	// Starts empty, so the first grow() sets it.
+	AABB();
+	void grow(const AABB& box);
+	void grow(const float* point);
+	float area() const;
+	float center(int axis) const { return 0.5f * (lo[axis] + hi[axis]); }
+};
+
+// Interior nodes are followed directly by their first child; offset holds
+// the index of the second. Leaves hold count primitives from offset on in
+// the build order. 32 bytes, so two nodes share a cache line.
+struct BVHNode {
+	float lo[3];
+	float hi[3];
+	uint32_t offset;
+	uint16_t count; // 0 for interior nodes
+	uint16_t axis;  // split axis of interior nodes
+};
+
+// Bounding volume hierarchy over primitives known only by their boxes,
+// built top down with binned surface area heuristic splits and stored as a
+// flat depth-first node array.
+class BVH
+{
+public:
+	BVH();
+	virtual ~BVH();
+	void build(const std::vector<AABB>& bounds);
+	bool empty() const { return nodes.empty(); }
+	int getNodeCount() const { return static_cast<int>(nodes.size()); }
+	// The primitives in the order the leaves refer to them. A caller that
+	// stores its primitives in this order tests every leaf as one run.
+	const std::vector<uint32_t>& getOrder() const { return primitives; }
+	// Walks the nodes the ray enters before tMax, nearer child first, and
+	// calls test(first, count, tMax) for the run of each leaf, as positions
+	// in getOrder(). test may shrink tMax to cull farther nodes (closest
+	// hit) and returns true to stop the walk (any hit).
+	template <typename Test>
+	void intersect(const double* origin, const double* direction, double& tMax, Test test) const;
+	// The same walk for a packet of rays, one per bit of lanes.
+	// enter(node, lanes) returns the lanes that enter the node and
+	// test(first, count, mask) gets those that entered a leaf; test may clear
+	// bits of lanes, and the walk ends once none is left. Children are
+	// visited in the order direction, one ray of the packet, would take them.
+	template <typename Enter, typename Test>
+	void intersectPacket(const double* direction, unsigned& lanes, Enter enter, Test test) const;
+
+private:
+	struct Build {
+		AABB box;
+		float centroid[3];
+	};
+
+	uint32_t buildNode(std::vector<Build>& prims, uint32_t first, uint32_t count, int depth);
+	bool enters(const BVHNode& node, const double* origin, const double* inverse, double tMax) const;
+
+	std::vector<BVHNode> nodes;
+	std::vector<uint32_t> primitives;
+};
+
+inline bool BVH::enters(const BVHNode& node, const double* origin, const double* inverse, double tMax) const
+{
+	double t0 = 0.0, t1 = tMax;
+	for (int k = 0; k < 3; ++k) {
+		double a = (node.lo[k] - origin[k]) * inverse[k];
+		double b = (node.hi[k] - origin[k]) * inverse[k];
+		if (a > b) {
+			std::swap(a, b);
+		}
+		// Written so a NaN (origin on a slab of a flat box) leaves the
+		// interval as it was.
+		t0 = a > t0 ? a : t0;
+		t1 = b < t1 ? b : t1;
+	}
+	return t0 <= t1;
+}
+
+template <typename Test>
+void BVH::intersect(const double* origin, const double* direction, double& tMax, Test test) const
+{
+	if (nodes.empty()) {
+		return;
+	}
+	const double inverse[3] = { 1.0 / direction[0], 1.0 / direction[1], 1.0 / direction[2] };
+	uint32_t stack[64];
+	int top = 0;
+	uint32_t index = 0;
+	for (;;) {
+		const BVHNode& node = nodes[index];
+		if (enters(node, origin, inverse, tMax)) {
+			if (node.count > 0) {
+				if (test(node.offset, node.count, tMax)) {
+					return;
+				}
+			} else {
+				uint32_t nearChild = index + 1, farChild = node.offset;
+				if (direction[node.axis] < 0.0) {
+					std::swap(nearChild, farChild);
+				}
+				stack[top++] = farChild;
+				index = nearChild;
+				continue;
+			}
+		}
+		if (top == 0) {
+			return;
+		}
+		index = stack[--top];
+	}
+}
+
+template <typename Enter, typename Test>
+void BVH::intersectPacket(const double* direction, unsigned& lanes, Enter enter, Test test) const
+{
+	if (nodes.empty() || lanes == 0) {
+		return;
+	}
+	uint32_t stack[64];
+	int top = 0;
+	uint32_t index = 0;
+	for (;;) {
+		const BVHNode& node = nodes[index];
+		unsigned mask = enter(node, lanes);
+		if (mask != 0) {
+			if (node.count > 0) {
+				test(node.offset, node.count, mask);
+				if (lanes == 0) {
+					return;
+				}
+			} else {
+				uint32_t nearChild = index + 1, farChild = node.offset;
+				if (direction[node.axis] < 0.0) {
+					std::swap(nearChild, farChild);
+				}
+				stack[top++] = farChild;
+				index = nearChild;
+				continue;
+			}
+		}
+		if (top == 0) {
+			return;
+		}
+		index = stack[--top];
+	}
+}
+
+#endif
@@ -0,0 +1,304 @@
+#include "PacketKernels.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define PACKET_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define PACKET_TARGET(isa)
+#else
+#define PACKET_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+using namespace std;
+
+#ifdef PACKET_X86
+
+// The ray tracer's EPSILON.
+static const double EPSILON = 1e-5;
+
+// Every test below repeats the single-ray code operation for operation, so
+// each lane rounds exactly as its ray would on its own.
+
+PACKET_TARGET("avx2")
+static inline unsigned lanes_of(__m256d mask)
+{
+	return static_cast<unsigned>(_mm256_movemask_pd(mask));
+}
+
+PACKET_TARGET("avx2")
+static inline __m256d dot3(const __m256d* a, const __m256d* b)
+{
+	return _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(a[0], b[0]), _mm256_mul_pd(a[1], b[1])), _mm256_mul_pd(a[2], b[2]));
+}
+
+PACKET_TARGET("avx2")
+static inline __m128 dot3(const __m128* a, const __m128* b)
+{
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]), _mm_mul_ps(a[1], b[1])), _mm_mul_ps(a[2], b[2]));
+}
+
+PACKET_TARGET("avx2")
+static inline void cross3(const __m128* a, const __m128* b, __m128* r)
+{
+	r[0] = _mm_sub_ps(_mm_mul_ps(a[1], b[2]), _mm_mul_ps(a[2], b[1]));
+	r[1] = _mm_sub_ps(_mm_mul_ps(a[2], b[0]), _mm_mul_ps(a[0], b[2]));
+	r[2] = _mm_sub_ps(_mm_mul_ps(a[0], b[1]), _mm_mul_ps(a[1], b[0]));
+}
+
+struct Lanes {
+	__m256d o[3], d[3];
+	__m128 of[3], df[3];
+	__m256d dd; // direction . direction, the sphere test's a
+};
+
+PACKET_TARGET("avx2")
+static inline void load_lanes(const RayPacket& rays, Lanes& r)
+{
+	for (int k = 0; k < 3; ++k) {
+		r.o[k] = _mm256_loadu_pd(rays.origin[k]);
+		r.d[k] = _mm256_loadu_pd(rays.direct[k]);
+		r.of[k] = _mm_loadu_ps(rays.originF[k]);
+		r.df[k] = _mm_loadu_ps(rays.directF[k]);
+	}
+	r.dd = dot3(r.d, r.d);
+}
+
+// Nearer root of a t^2 + b t + c = 0 that is not behind the origin, as the
+// sphere and ellipsoid tests pick it.
+PACKET_TARGET("avx2")
+static inline __m256d quadric_root(__m256d a, __m256d b, __m256d c, unsigned& hit)
+{
+	const __m256d zero = _mm256_setzero_pd();
+	__m256d discrim = _mm256_sub_pd(_mm256_mul_pd(b, b), _mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(4.0), a), c));
+	__m256d root = _mm256_sqrt_pd(discrim);
+	__m256d negB = _mm256_xor_pd(b, _mm256_set1_pd(-0.0));
+	__m256d twoA = _mm256_mul_pd(_mm256_set1_pd(2.0), a);
+	__m256d nearT = _mm256_div_pd(_mm256_sub_pd(negB, root), twoA);
+	__m256d farT = _mm256_div_pd(_mm256_add_pd(negB, root), twoA);
+	__m256d t = _mm256_blendv_pd(nearT, farT, _mm256_cmp_pd(nearT, zero, _CMP_LT_OQ));
+	hit = lanes_of(_mm256_and_pd(_mm256_cmp_pd(discrim, zero, _CMP_GE_OQ), _mm256_cmp_pd(t, zero, _CMP_GE_OQ)));
+	return t;
+}
+
+// The distance kernels return t for every lane and set the lanes that hit
+// primitive i; only triangles fill in u and v.
+
+PACKET_TARGET("avx2")
+static inline __m256d distance(const Lanes& r, const SphereSpan& spheres, uint32_t i, __m256d&, __m256d&, unsigned& hit)
+{
+	__m256d oc[3];
+	for (int k = 0; k < 3; ++k) {
+		oc[k] = _mm256_sub_pd(r.o[k], _mm256_set1_pd(spheres.center[3 * i + k]));
+	}
+	double radius = spheres.radius[i];
+	__m256d b = _mm256_mul_pd(_mm256_set1_pd(2.0), dot3(oc, r.d));
+	__m256d c = _mm256_sub_pd(dot3(oc, oc), _mm256_set1_pd(radius * radius));
+	return quadric_root(r.dd, b, c, hit);
+}
+
+PACKET_TARGET("avx2")
+static inline __m256d distance(const Lanes& r, const EllipsoidSpan& ellipsoids, uint32_t i, __m256d&, __m256d&, unsigned& hit)
+{
+	__m256d oc[3], d[3];
+	for (int k = 0; k < 3; ++k) {
+		__m256d scale = _mm256_set1_pd(ellipsoids.scale[3 * i + k]);
+		oc[k] = _mm256_div_pd(_mm256_sub_pd(r.o[k], _mm256_set1_pd(ellipsoids.center[3 * i + k])), scale);
+		d[k] = _mm256_div_pd(r.d[k], scale);
+	}
+	__m256d b = _mm256_mul_pd(_mm256_set1_pd(2.0), dot3(oc, d));
+	__m256d c = _mm256_sub_pd(dot3(oc, oc), _mm256_set1_pd(1.0));
+	return quadric_root(dot3(d, d), b, c, hit);
+}
+
+PACKET_TARGET("avx2")
+static inline __m256d distance(const Lanes& r, const PlaneSpan& planes, uint32_t i, __m256d&, __m256d&, unsigned& hit)
+{
+	__m256d n[3], toPoint[3];
+	for (int k = 0; k < 3; ++k) {
+		n[k] = _mm256_set1_pd(planes.normal[3 * i + k]);
+		toPoint[k] = _mm256_sub_pd(_mm256_set1_pd(planes.point[3 * i + k]), r.o[k]);
+	}
+	__m256d denom = dot3(n, r.d);
+	__m256d t = _mm256_div_pd(dot3(toPoint, n), denom);
+	__m256d absDenom = _mm256_andnot_pd(_mm256_set1_pd(-0.0), denom);
+	hit = lanes_of(_mm256_and_pd(_mm256_cmp_pd(absDenom, _mm256_set1_pd(EPSILON), _CMP_GT_OQ), _mm256_cmp_pd(t, _mm256_setzero_pd(), _CMP_GE_OQ)));
+	return t;
+}
+
+// Slab test. max(x, y) is x > y ? x : y and min(x, y) is x < y ? x : y,
+// so each step keeps its operand on a NaN just as the scalar comparisons do.
+PACKET_TARGET("avx2")
+static inline __m256d distance(const Lanes& r, const CubeSpan& cubes, uint32_t i, __m256d&, __m256d&, unsigned& hit)
+{
+	const __m256d zero = _mm256_setzero_pd();
+	__m256d tMin, tMax;
+	__m256d miss = zero;
+	for (int k = 0; k < 3; ++k) {
+		__m256d a = _mm256_div_pd(_mm256_sub_pd(_mm256_set1_pd(cubes.lo[3 * i + k]), r.o[k]), r.d[k]);
+		__m256d b = _mm256_div_pd(_mm256_sub_pd(_mm256_set1_pd(cubes.hi[3 * i + k]), r.o[k]), r.d[k]);
+		__m256d lo = _mm256_min_pd(b, a);
+		__m256d hi = _mm256_max_pd(a, b);
+		if (k == 0) {
+			tMin = lo;
+			tMax = hi;
+			continue;
+		}
+		miss = _mm256_or_pd(miss, _mm256_or_pd(_mm256_cmp_pd(tMin, hi, _CMP_GT_OQ), _mm256_cmp_pd(lo, tMax, _CMP_GT_OQ)));
+		tMin = _mm256_max_pd(lo, tMin);
+		tMax = _mm256_min_pd(hi, tMax);
+	}
+	__m256d t = _mm256_blendv_pd(tMax, tMin, _mm256_cmp_pd(tMin, zero, _CMP_GE_OQ));
+	hit = lanes_of(_mm256_andnot_pd(miss, _mm256_cmp_pd(t, zero, _CMP_GE_OQ)));
+	return t;
+}
+
+// Moller-Trumbore in float, with the determinant and everything divided by
+// it in double, as intersect_triangle does.
+PACKET_TARGET("avx2")
+static inline __m256d distance(const Lanes& r, const TriangleSpan& triangles, uint32_t i, __m256d& u, __m256d& v, unsigned& hit)
+{
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d one = _mm256_set1_pd(1.0);
+	__m128 edge1[3], edge2[3], tvec[3];
+	for (int k = 0; k < 3; ++k) {
+		edge1[k] = _mm_set1_ps(triangles.edge1[3 * i + k]);
+		edge2[k] = _mm_set1_ps(triangles.edge2[3 * i + k]);
+		tvec[k] = _mm_sub_ps(r.of[k], _mm_set1_ps(triangles.vert0[3 * i + k]));
+	}
+	__m128 pvec[3], qvec[3];
+	cross3(r.df, edge2, pvec);
+	cross3(tvec, edge1, qvec);
+
+	__m256d det = _mm256_cvtps_pd(dot3(edge1, pvec));
+	__m256d invDet = _mm256_div_pd(one, det);
+	__m256d miss = _mm256_and_pd(_mm256_cmp_pd(det, _mm256_set1_pd(-EPSILON), _CMP_GT_OQ), _mm256_cmp_pd(det, _mm256_set1_pd(EPSILON), _CMP_LT_OQ));
+	u = _mm256_mul_pd(_mm256_cvtps_pd(dot3(tvec, pvec)), invDet);
+	miss = _mm256_or_pd(miss, _mm256_or_pd(_mm256_cmp_pd(u, zero, _CMP_LT_OQ), _mm256_cmp_pd(u, one, _CMP_GT_OQ)));
+	v = _mm256_mul_pd(_mm256_cvtps_pd(dot3(r.df, qvec)), invDet);
+	miss = _mm256_or_pd(miss, _mm256_or_pd(_mm256_cmp_pd(v, zero, _CMP_LT_OQ), _mm256_cmp_pd(_mm256_add_pd(u, v), one, _CMP_GT_OQ)));
+	__m256d t = _mm256_mul_pd(_mm256_cvtps_pd(dot3(edge2, qvec)), invDet);
+	hit = lanes_of(_mm256_andnot_pd(miss, _mm256_cmp_pd(t, _mm256_set1_pd(EPSILON), _CMP_GT_OQ)));
+	return t;
+}
+
+PACKET_TARGET("avx2")
+static unsigned enter_box_avx2(const RayPacket& rays, unsigned lanes, const float* lo, const float* hi, const double* tMax)
+{
+	// The same min/max reading of BVH::enters' comparisons as the cube test.
+	__m256d t0 = _mm256_setzero_pd();
+	__m256d t1 = _mm256_loadu_pd(tMax);
+	for (int k = 0; k < 3; ++k) {
+		__m256d origin = _mm256_loadu_pd(rays.origin[k]);
+		__m256d inverse = _mm256_loadu_pd(rays.inverse[k]);
+		__m256d a = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(lo[k]), origin), inverse);
+		__m256d b = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(hi[k]), origin), inverse);
+		t0 = _mm256_max_pd(_mm256_min_pd(b, a), t0);
+		t1 = _mm256_min_pd(_mm256_max_pd(a, b), t1);
+	}
+	return lanes & lanes_of(_mm256_cmp_pd(t0, t1, _CMP_LE_OQ));
+}
+
+template <typename Span>
+PACKET_TARGET("avx2")
+static void closest_avx2(const RayPacket& rays, unsigned lanes, const Span& span, uint32_t first, uint32_t count, PacketHits& hits)
+{
+	Lanes r;
+	load_lanes(rays, r);
+	for (uint32_t i = first; i < first + count; ++i) {
+		unsigned hit;
+		__m256d u = _mm256_setzero_pd(), v = _mm256_setzero_pd();
+		__m256d t = distance(r, span, i, u, v, hit);
+		// Nearer than the lane's hit so far, or as near with a lower shape.
+		hit &= lanes & lanes_of(_mm256_cmp_pd(t, _mm256_loadu_pd(hits.t), _CMP_LE_OQ));
+		if (hit == 0) {
+			continue;
+		}
+		double ts[PACKET_SIZE], us[PACKET_SIZE], vs[PACKET_SIZE];
+		_mm256_storeu_pd(ts, t);
+		_mm256_storeu_pd(us, u);
+		_mm256_storeu_pd(vs, v);
+		int shape = span.shape[i];
+		for (int lane = 0; lane < PACKET_SIZE; ++lane) {
+			if ((hit >> lane & 1) && (ts[lane] < hits.t[lane] || shape < hits.shape[lane])) {
+				hits.t[lane] = ts[lane];
+				hits.u[lane] = us[lane];
+				hits.v[lane] = vs[lane];
+				hits.shape[lane] = shape;
+				hits.type[lane] = span.type;
+				hits.slot[lane] = i;
+			}
+		}
+	}
+}
+
+template <typename Span>
+PACKET_TARGET("avx2")
+static unsigned occluded_avx2(const RayPacket& rays, unsigned lanes, const double* maxDist, const Span& span, uint32_t first, uint32_t count)
+{
+	Lanes r;
+	load_lanes(rays, r);
+	__m256d limit = _mm256_loadu_pd(maxDist);
+	unsigned occluded = 0;
+	for (uint32_t i = first; i < first + count && occluded != lanes; ++i) {
+		unsigned hit;
+		__m256d u, v;
+		__m256d t = distance(r, span, i, u, v, hit);
+		occluded |= hit & lanes & lanes_of(_mm256_cmp_pd(t, limit, _CMP_LT_OQ));
+	}
+	return occluded;
+}
+
+static const PacketKernels AVX2_KERNELS = {
+	enter_box_avx2,
+	closest_avx2<SphereSpan>,
+	closest_avx2<EllipsoidSpan>,
+	closest_avx2<PlaneSpan>,
+	closest_avx2<CubeSpan>,
+	closest_avx2<TriangleSpan>,
+	occluded_avx2<SphereSpan>,
+	occluded_avx2<EllipsoidSpan>,
+	occluded_avx2<PlaneSpan>,
+	occluded_avx2<CubeSpan>,
+	occluded_avx2<TriangleSpan>
+};
+
+#endif
+
+SimdLevel detect_simd_level()
+{
+#if defined(PACKET_X86) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx2 = false;
+	if (maxLeaf >= 7 && osxsave && (_xgetbv(0) & 6) == 6) {
+		__cpuidex(info, 7, 0);
+		avx2 = (info[1] & (1 << 5)) != 0;
+	}
+	return avx2 ? SimdLevel::AVX2 : SimdLevel::Scalar;
+#elif defined(PACKET_X86)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") ? SimdLevel::AVX2 : SimdLevel::Scalar;
+#else
+	return SimdLevel::Scalar;
+#endif
+}
+
+const char* simd_level_name(SimdLevel level)
+{
+	return level == SimdLevel::AVX2 ? "avx2" : "scalar";
+}
+
+const PacketKernels* select_packet_kernels(SimdLevel level)
+{
+#ifdef PACKET_X86
+	if (level == SimdLevel::AVX2) {
+		return &AVX2_KERNELS;
+	}
+#endif
+	return nullptr;
+}
@@ -0,0 +1,104 @@
+#pragma once
+#ifndef _PACKETKERNELS_H_
+#define _PACKETKERNELS_H_
+
+#include <cstdint>
+
+// Instruction sets the packet kernels are built for. The best one the CPU
+// supports is picked at run time; without one, packets are tested a lane at
+// a time with the single-ray code. Either way a lane gets the same bits as
+// the ray traced on its own.
+enum class SimdLevel {
+	Scalar,
+	AVX2
+};
+
+const int PACKET_SIZE = 4;
+
+// Up to four rays, one per lane. Triangles are tested in float, so the rays
+// are kept in both precisions; inverse holds 1 / direct for box tests.
+struct RayPacket {
+	double origin[3][PACKET_SIZE];
+	double direct[3][PACKET_SIZE];
+	double inverse[3][PACKET_SIZE];
+	float originF[3][PACKET_SIZE];
+	float directF[3][PACKET_SIZE];
+	unsigned lanes; // bit i is set when lane i holds a ray
+};
+
+// Nearest hit of every lane so far. Equal distances go to the lower shape.
+// type and slot say which array the primitive is in and where; u and v are
+// its barycentrics when it is a triangle.
+struct PacketHits {
+	double t[PACKET_SIZE];
+	double u[PACKET_SIZE];
+	double v[PACKET_SIZE];
+	int shape[PACKET_SIZE];
+	int type[PACKET_SIZE];
+	uint32_t slot[PACKET_SIZE];
+};
+
+// The primitives of one kind as the kernels read them: fields are packed
+// xyz triples, shape holds the scene index of each primitive and type is
+// recorded with its hits.
+struct SphereSpan {
+	const double* center;
+	const double* radius;
+	const int* shape;
+	int type;
+};
+
+struct EllipsoidSpan {
+	const double* center;
+	const double* scale;
+	const int* shape;
+	int type;
+};
+
+struct PlaneSpan {
+	const double* point;
+	const double* normal;
+	const int* shape;
+	int type;
+};
+
+struct CubeSpan {
+	const double* lo;
+	const double* hi;
+	const int* shape;
+	int type;
+};
+
+struct TriangleSpan {
+	const float* vert0;
+	const float* edge1;
+	const float* edge2;
+	const int* shape;
+	int type;
+};
+
+// enterBox returns the lanes of lanes that enter the box lo-hi between 0
+// and their tMax, as BVH::enters decides it. The other kernels test
+// primitives [first, first + count) against the lanes in lanes: the closest
+// kernels update hits and the occluded kernels return the lanes hit closer
+// than their maxDist.
+struct PacketKernels {
+	unsigned (*enterBox)(const RayPacket& rays, unsigned lanes, const float* lo, const float* hi, const double* tMax);
+	void (*closestSpheres)(const RayPacket& rays, unsigned lanes, const SphereSpan& spheres, uint32_t first, uint32_t count, PacketHits& hits);
+	void (*closestEllipsoids)(const RayPacket& rays, unsigned lanes, const EllipsoidSpan& ellipsoids, uint32_t first, uint32_t count, PacketHits& hits);
+	void (*closestPlanes)(const RayPacket& rays, unsigned lanes, const PlaneSpan& planes, uint32_t first, uint32_t count, PacketHits& hits);
+	void (*closestCubes)(const RayPacket& rays, unsigned lanes, const CubeSpan& cubes, uint32_t first, uint32_t count, PacketHits& hits);
+	void (*closestTriangles)(const RayPacket& rays, unsigned lanes, const TriangleSpan& triangles, uint32_t first, uint32_t count, PacketHits& hits);
+	unsigned (*occludedSpheres)(const RayPacket& rays, unsigned lanes, const double* maxDist, const SphereSpan& spheres, uint32_t first, uint32_t count);
+	unsigned (*occludedEllipsoids)(const RayPacket& rays, unsigned lanes, const double* maxDist, const EllipsoidSpan& ellipsoids, uint32_t first, uint32_t count);
+	unsigned (*occludedPlanes)(const RayPacket& rays, unsigned lanes, const double* maxDist, const PlaneSpan& planes, uint32_t first, uint32_t count);
+	unsigned (*occludedCubes)(const RayPacket& rays, unsigned lanes, const double* maxDist, const CubeSpan& cubes, uint32_t first, uint32_t count);
+	unsigned (*occludedTriangles)(const RayPacket& rays, unsigned lanes, const double* maxDist, const TriangleSpan& triangles, uint32_t first, uint32_t count);
+};
+
+SimdLevel detect_simd_level();
+const char* simd_level_name(SimdLevel level);
+// Null for SimdLevel::Scalar, whose packets are tested lane by lane.
+const PacketKernels* select_packet_kernels(SimdLevel level);
+
+#endif
@@ -0,0 +1,44 @@
+#pragma once
+#ifndef _RANDOM_H_
+#define _RANDOM_H_
+
+#include <cstdint>
+
+// PCG32 generator (O'Neill, pcg-random.org). Small enough to give every
+// pixel its own: the state is derived from a seed and a stream number (e.g.
+// the pixel index) through SplitMix64, so neighbouring streams start far
+// apart and a pixel draws the same numbers whichever thread renders it.
+class Random
+{
+public:
+	Random(uint64_t seed, uint64_t stream)
+	{
+		state = mix(seed + mix(stream));
+		next();
+	}
+
+	uint32_t next()
+	{
+		uint64_t old = state;
+		state = old * 6364136223846793005ULL + 1442695040888963407ULL;
+		uint32_t xorshifted = static_cast<uint32_t>(((old >> 18) ^ old) >> 27);
+		uint32_t rot = static_cast<uint32_t>(old >> 59);
+		return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+	}
+
+	// Uniform in [0, 1).
+	double uniform() { return next() * (1.0 / 4294967296.0); }
+
+private:
+	static uint64_t mix(uint64_t z)
+	{
+		z += 0x9e3779b97f4a7c15ULL;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return z ^ (z >> 31);
+	}
+
+	uint64_t state;
+};
+
+#endif
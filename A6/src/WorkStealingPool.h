@@ -0,0 +1,54 @@
+#pragma once
+#ifndef _WORKSTEALINGPOOL_H_
+#define _WORKSTEALINGPOOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads that run batches of independent tasks. Each
+// worker owns a deque seeded with a contiguous block of task indices; it pops
+// from the back of its own deque and, once that is empty, steals from the
+// front of the others. The calling thread works as worker 0, so a pool of one
+// thread runs everything inline.
+class WorkStealingPool
+{
+public:
+	// threadCount <= 0 uses every hardware thread.
+	explicit WorkStealingPool(int threadCount);
+	virtual ~WorkStealingPool();
+	// Runs task(i) for every i in [0, taskCount) and returns once all of them
+	// have finished. Not reentrant: tasks must not call run() themselves.
+	void run(int taskCount, const std::function<void(int)>& task);
+	int getThreadCount() const { return threadCount; }
+
+private:
+	struct Queue {
+		std::mutex mutex;
+		std::deque<int> tasks;
+	};
+
+	bool pop(int self, int& task);
+	void drain(int self);
+	void workerLoop(int self);
+
+	int threadCount;
+	std::vector<std::unique_ptr<Queue>> queues;
+	std::vector<std::thread> workers;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	const std::function<void(int)>* job;
+	unsigned generation;
+	int active;
+	bool stopping;
+	std::atomic<int> remaining;
+};
+
+#endif
@@ -2,6 +2,9 @@
 #include <string>
 #include <vector>
 #include <cmath>
+#include <chrono>
+#include <filesystem>
+#include <functional>
 #include <optional>
 #include <limits>
 #include <glm/glm.hpp>
@@ -15,7 +18,13 @@
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "tiny_obj_loader.h"
 
+#include "Accumulator.h"
 #include "Image.h"
+#include "MeshCache.h"
+#include "BVH.h"
+#include "PacketKernels.h"
+#include "Random.h"
+#include "WorkStealingPool.h"
 
 // This allows you to skip the `` in front of C++ standard library
 // functions. You can also say `using cout` to be more selective.
@@ -25,6 +34,18 @@ const double EPSILON = 1e-5;
 
 const int AO_SAMPLES = 64;
 const double AO_MAX_DIST = 2.0;
+// Adaptive AO always traces this many samples, then stops once the standard
+// error of the occluded fraction is below AO_TOLERANCE.
+const int AO_MIN_SAMPLES = 16;
+const double AO_TOLERANCE = 0.02;
+
+// How scene 9 samples ambient occlusion. The default fires maxSamples
+// uniform hemisphere rays; adaptive draws cosine-weighted ones from a
+// shifted Halton sequence and spends up to maxSamples where they disagree.
+struct AOSettings {
+	bool adaptive = false;
+	int maxSamples = AO_SAMPLES;
+};
 
 struct BoundingSphere {
 	glm::vec3 center;
@@ -91,9 +112,9 @@ Vec3 operator*(double scalar, const Vec3& v) {
 	return Vec3(v.x * scalar, v.y * scalar, v.z * scalar);
 }
 
-Vec3 create_uniform_hemisphere_sample(const Vec3& normal) {
-	double u = static_cast<double>(rand()) / RAND_MAX;
-	double v = static_cast<double>(rand()) / RAND_MAX;
+Vec3 create_uniform_hemisphere_sample(const Vec3& normal, Random& rng) {
+	double u = rng.uniform();
+	double v = rng.uniform();
 	double theta = 2 * M_PI * u;
 	double phi = acos(2 * v - 1);
 	double x = sin(phi) * cos(theta);
@@ -106,65 +127,100 @@ Vec3 create_uniform_hemisphere_sample(const Vec3& normal) {
 	return randVec.normalize();
 }
 
+// The first two dimensions of the Halton sequence: the radical inverse of
+// i in base 2 and in base 3.
+double halton2(uint32_t i) {
+	i = (i << 16) | (i >> 16);
+	i = ((i & 0x00ff00ffu) << 8) | ((i & 0xff00ff00u) >> 8);
+	i = ((i & 0x0f0f0f0fu) << 4) | ((i & 0xf0f0f0f0u) >> 4);
+	i = ((i & 0x33333333u) << 2) | ((i & 0xccccccccu) >> 2);
+	i = ((i & 0x55555555u) << 1) | ((i & 0xaaaaaaaau) >> 1);
+	return i * (1.0 / 4294967296.0);
+}
+
+double halton3(uint32_t i) {
+	double digit = 1.0, result = 0.0;
+	while (i > 0) {
+		digit /= 3.0;
+		result += digit * (i % 3);
+		i /= 3;
+	}
+	return result;
+}
+
+// Direction about normal with density proportional to the cosine, from a
+// point of the unit square.
+Vec3 create_cosine_hemisphere_sample(const Vec3& normal, double u, double v) {
+	// Tangent frame without a branch on the normal (Duff et al., 2017).
+	double sign = copysign(1.0, normal.z);
+	double a = -1.0 / (sign + normal.z);
+	double b = normal.x * normal.y * a;
+	Vec3 tangent(1.0 + sign * normal.x * normal.x * a, sign * b, -sign * normal.x);
+	Vec3 bitangent(b, sign + normal.y * normal.y * a, -normal.y);
+	double r = sqrt(u);
+	double theta = 2 * M_PI * v;
+	return r * cos(theta) * tangent + r * sin(theta) * bitangent + sqrt(max(0.0, 1.0 - u)) * normal;
+}
+
 
 struct Hit {
 	double s;
 	Vec3 x;
 	Vec3 n;
-	glm::vec3 color;
-	bool textured;
 
-	Hit(double s, Vec3 x, Vec3 n, glm::vec3 color = glm::vec3(), bool textured = false) : s(s), x(x), n(n), color(color), textured(textured) {}
+	Hit(double s, Vec3 x, Vec3 n) : s(s), x(x), n(n) {}
 };
 
+// Lets PrimitiveStore file every shape with the others of its kind.
+enum class ShapeType { Sphere, Ellipsoid, Plane, Cube, Triangle };
+const int SHAPE_TYPES = 5;
+
 class Shape {
 public:
+	ShapeType type;
 	Vec3 diffuse;
 	Vec3 specular;
 	Vec3 ambient;
 	double exponent;
 	double reflectiveness;
 
-	Shape(const Vec3& diff, const Vec3& spec, const Vec3& ambi, double expo, double reflect)
-		: diffuse(diff), specular(spec), ambient(ambi), exponent(expo), reflectiveness(reflect) {}
-
-	virtual optional<Hit> intersect(const Vec3& rayOrigin, const Vec3& rayDirect) const = 0;
+	Shape(ShapeType type, const Vec3& diff, const Vec3& spec, const Vec3& ambi, double expo, double reflect)
+		: type(type), diffuse(diff), specular(spec), ambient(ambi), exponent(expo), reflectiveness(reflect) {}
 
 	virtual ~Shape() = default;
-	virtual Vec3 normalAt(const Vec3& point) const = 0;
+	// Box around the shape, or false when it has none (a plane).
+	virtual bool bounds(AABB& box) const {
+		return false;
+	}
 };
 
+AABB box_around(const Vec3& center, const Vec3& halfSize) {
+	AABB box;
+	box.lo[0] = static_cast<float>(center.x - halfSize.x);
+	box.lo[1] = static_cast<float>(center.y - halfSize.y);
+	box.lo[2] = static_cast<float>(center.z - halfSize.z);
+	box.hi[0] = static_cast<float>(center.x + halfSize.x);
+	box.hi[1] = static_cast<float>(center.y + halfSize.y);
+	box.hi[2] = static_cast<float>(center.z + halfSize.z);
+	return box;
+}
+
 class Sphere : public Shape {
 public:
 	Vec3 position;
 	Vec3 scale;
-	Vec3 normalAt(const Vec3& point) const override {
+	Vec3 normalAt(const Vec3& point) const {
 		return (point - position).normalize();
 	}
 
 	Sphere(const Vec3& pos, const Vec3& sc, const Vec3& diff, const Vec3& spec, const Vec3& ambi, double expo, double reflect)
-		: Shape(diff, spec, ambi, expo, reflect), position(pos), scale(sc) {}
+		: Shape(ShapeType::Sphere, diff, spec, ambi, expo, reflect), position(pos), scale(sc) {}
 
-	optional<Hit> Sphere::intersect(const Vec3& rayOrigin, const Vec3& rayDirect) const override {
-		Vec3 rayOriginToCenterVec = rayOrigin - position;
-		double a = rayDirect.dot(rayDirect);
-		double b = 2.0 * rayOriginToCenterVec.dot(rayDirect);
-		double c = rayOriginToCenterVec.dot(rayOriginToCenterVec) - (scale.x * scale.x);
-		double discrim = b * b - 4 * a * c;
-		if (discrim < 0) {
-			return nullopt;
-		}
-		double t = (-b - sqrt(discrim)) / (2 * a);
-		if (t < 0) {
-			t = (-b + sqrt(discrim)) / (2 * a);
-			if (t < 0) return nullopt;
-		}
-		Vec3 hitPoint = rayOrigin + t * rayDirect;
-		Vec3 normal = normalAt(hitPoint);
-		double distance = t;
-		return Hit(distance, hitPoint, normal);
+	// Intersections take scale.x as the radius.
+	bool bounds(AABB& box) const override {
+		box = box_around(position, Vec3(scale.x, scale.x, scale.x));
+		return true;
 	}
-
 };
 
 class TexturedSphere : public Sphere {
@@ -180,50 +236,23 @@ public:
 		double v = 0.5 - asin(localHit.y) / M_PI;
 		return texture.getColorAt(u, v);
 	}
-
-	virtual optional<Hit> intersect(const Vec3& rayOrigin, const Vec3& rayDirect) const override {
-		auto intersectResult = Sphere::intersect(rayOrigin, rayDirect);
-		if (intersectResult) {
-			Hit hit = intersectResult.value();
-			glm::vec3 texColor = getColorFromTexture(hit.x);
-			hit.color = texColor;
-			hit.textured = true;
-			return hit;
-		}
-		return nullopt;
-	}
 };
 
 class Ellipsoid : public Shape {
 public:
 	Vec3 position;
 	Vec3 scale;
-	Vec3 normalAt(const Vec3& point) const override {
+	Vec3 normalAt(const Vec3& point) const {
 		Vec3 normalizedPoint = (point - position) / scale;
 		return Vec3(normalizedPoint.x / scale.x, normalizedPoint.y / scale.y, normalizedPoint.z / scale.z).normalize();
 	}
 
 	Ellipsoid(const Vec3& pos, const Vec3& sc, const Vec3& diff, const Vec3& spec, const Vec3& ambi, double expo, double reflect)
-		: Shape(diff, spec, ambi, expo, reflect), position(pos), scale(sc) {}
+		: Shape(ShapeType::Ellipsoid, diff, spec, ambi, expo, reflect), position(pos), scale(sc) {}
 
-	optional<Hit> Ellipsoid::intersect(const Vec3& rayOrigin, const Vec3& rayDirect) const override {
-		Vec3 rayOriginToCenterVec = (rayOrigin - position) / scale;
-		Vec3 rayDirectionVec = rayDirect / scale;
-		double a = rayDirectionVec.dot(rayDirectionVec);
-		double b = 2.0 * rayOriginToCenterVec.dot(rayDirectionVec);
-		double c = rayOriginToCenterVec.dot(rayOriginToCenterVec) - 1.0;
-		double discrim = b * b - 4 * a * c;
-		if (discrim < 0) {
-			return nullopt;
-		}
-		double t = (-b - sqrt(discrim)) / (2 * a);
-		if (t < 0) {
-			t = (-b + sqrt(discrim)) / (2 * a);
-			if (t < 0) return nullopt;
-		}
-		Vec3 hitPoint = rayOrigin + t * rayDirect;
-		Vec3 normal = normalAt(hitPoint);
-		return Hit(t, hitPoint, normal);
+	bool bounds(AABB& box) const override {
+		box = box_around(position, Vec3(fabs(scale.x), fabs(scale.y), fabs(scale.z)));
+		return true;
 	}
 };
 
@@ -231,28 +260,9 @@ class Plane : public Shape {
 public:
 	Vec3 position;
 	Vec3 normal;
-	Vec3 normalAt(const Vec3&) const override {
-		return normal;
-	}
 
 	Plane(const Vec3& pos, const Vec3& norm, const Vec3& diff, const Vec3& spec, const Vec3& ambi, double expo, double reflect)
-		: Shape(diff, spec, ambi, expo, reflect), position(pos), normal(norm) {}
-
-	optional<Hit> Plane::intersect(const Vec3& rayOrigin, const Vec3& rayDirect) const override {
-		double denom = normal.dot(rayDirect);
-		if (abs(denom) > EPSILON) {
-			Vec3 posRayOrigin = position - rayOrigin;
-			double t = posRayOrigin.dot(normal) / denom;
-			if (t >= 0) {
-				Vec3 hitPoint = rayOrigin + t * rayDirect;
-				Vec3 normalAtPoint = normal;
-				return Hit(t, hitPoint, normalAtPoint);
-			}
-		}
-		return nullopt;
-	}
-
-
+		: Shape(ShapeType::Plane, diff, spec, ambi, expo, reflect), position(pos), normal(norm) {}
 };
 
 class Cube : public Shape { //Used ChatGPT 3.5 to get a cube Shape similar to how the other shapes were implemented... 
@@ -263,58 +273,15 @@ public:
 
 	// Constructor initializing the cube along with its material properties
 	Cube(const Vec3& pos, double size, const Vec3& diff, const Vec3& spec, const Vec3& ambi, double expo, double reflect)
-		: Shape(diff, spec, ambi, expo, reflect), position(pos), size(size) {}
-
-	// Method to determine if a ray intersects with the cube
-	optional<Hit> intersect(const Vec3& rayOrigin, const Vec3& rayDirect) const override {
-		// Calculate the minimum and maximum bounds of the cube
-		Vec3 minBound = position - Vec3(size / 2, size / 2, size / 2);
-		Vec3 maxBound = position + Vec3(size / 2, size / 2, size / 2);
-
-		// Intersection logic for the X-axis
-		double tMin = (minBound.x - rayOrigin.x) / rayDirect.x;
-		double tMax = (maxBound.x - rayOrigin.x) / rayDirect.x;
-		if (tMin > tMax) swap(tMin, tMax);
+		: Shape(ShapeType::Cube, diff, spec, ambi, expo, reflect), position(pos), size(size) {}
 
-		// Intersection logic for the Y-axis
-		double tyMin = (minBound.y - rayOrigin.y) / rayDirect.y;
-		double tyMax = (maxBound.y - rayOrigin.y) / rayDirect.y;
-		if (tyMin > tyMax) swap(tyMin, tyMax);
-
-		// Exit early if no valid intersection exists
-		if ((tMin > tyMax) || (tyMin > tMax))
-			return nullopt;
-
-		// Update min and max t values for valid intersection intervals
-		if (tyMin > tMin) tMin = tyMin;
-		if (tyMax < tMax) tMax = tyMax;
-
-		// Intersection logic for the Z-axis
-		double tzMin = (minBound.z - rayOrigin.z) / rayDirect.z;
-		double tzMax = (maxBound.z - rayOrigin.z) / rayDirect.z;
-		if (tzMin > tzMax) swap(tzMin, tzMax);
-
-		if ((tMin > tzMax) || (tzMin > tMax))
-			return nullopt;
-
-		if (tzMin > tMin) tMin = tzMin;
-		if (tzMax < tMax) tMax = tzMax;
-
-		// Ensure we only consider intersections in the positive ray direction
-		if (tMin < 0 && tMax < 0)
-			return nullopt;
-
-		double t = tMin >= 0 ? tMin : tMax;
-		if (t < 0)
-			return nullopt;
-
-		// Calculate the hit point and determine the normal at that point
-		Vec3 hitPoint = rayOrigin + t * rayDirect;
-		return Hit(t, hitPoint, normalAt(hitPoint));
+	bool bounds(AABB& box) const override {
+		box = box_around(position, Vec3(size / 2, size / 2, size / 2));
+		return true;
 	}
 
 	// Calculate the normal at a given point on the cube's surface
-	Vec3 normalAt(const Vec3& point) const override {
+	Vec3 normalAt(const Vec3& point) const {
 		Vec3 centerToPoint = point - position;
 		Vec3 absVec = Vec3(fabs(centerToPoint.x), fabs(centerToPoint.y), fabs(centerToPoint.z));
 
@@ -329,10 +296,8 @@ public:
 };
 
 
-bool intersect_triangle(const glm::vec3& orig, const glm::vec3& dir, const glm::vec3& vert0, const glm::vec3& vert1, const glm::vec3& vert2, double& t, double& u, double& v) {
+bool intersect_triangle(const glm::vec3& orig, const glm::vec3& dir, const glm::vec3& vert0, const glm::vec3& edge1, const glm::vec3& edge2, double& t, double& u, double& v) {
 	//I interpreted this code from raytri.c code @ https://fileadmin.cs.lth.se/cs/Personal/Tomas_Akenine-Moller/raytri/
-	glm::vec3 edge1 = vert1 - vert0;
-	glm::vec3 edge2 = vert2 - vert0;
 	glm::vec3 pvec = glm::cross(dir, edge2);
 
 	double det = glm::dot(edge1, pvec);
@@ -369,30 +334,530 @@ public:
 	Triangle(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2,
 		const glm::vec3& n0, const glm::vec3& n1, const glm::vec3& n2,
 		const Vec3& diff, const Vec3& spec, const Vec3& ambi, double expo)
-		: Shape(diff, spec, ambi, expo, 0.0), vert0(v0), vert1(v1), vert2(v2),
+		: Shape(ShapeType::Triangle, diff, spec, ambi, expo, 0.0), vert0(v0), vert1(v1), vert2(v2),
 		norm0(n0), norm1(n1), norm2(n2) {}
 
-	optional<Hit> intersect(const Vec3& rayOrigin, const Vec3& rayDirection) const override {
-		double t, u, v;
-		bool intersect = intersect_triangle(glm::vec3(rayOrigin.x, rayOrigin.y, rayOrigin.z),
-			glm::vec3(rayDirection.x, rayDirection.y, rayDirection.z), vert0, vert1, vert2, t, u, v);
-		if (intersect && t > 0) {
-			glm::vec3 interpNormal = (1.0f - static_cast<float>(u) - static_cast<float>(v)) * norm0 +
-				static_cast<float>(u) * norm1 +
-				static_cast<float>(v) * norm2;
-			interpNormal = glm::normalize(interpNormal);
+	bool bounds(AABB& box) const override {
+		box = AABB();
+		box.grow(&vert0.x);
+		box.grow(&vert1.x);
+		box.grow(&vert2.x);
+		return true;
+	}
+};
 
-			glm::vec3 hitPoint = glm::vec3(rayOrigin.x, rayOrigin.y, rayOrigin.z) +
-				static_cast<float>(t) * glm::vec3(rayDirection.x, rayDirection.y, rayDirection.z);
 
-			return Hit(t, Vec3(hitPoint.x, hitPoint.y, hitPoint.z), Vec3(interpNormal.x, interpNormal.y, interpNormal.z));
+// Primitives that last blocked a ray: one primitive, or the leaf run a
+// packet was blocked in, as positions in the arrays of its type. Nearby
+// shadow and AO rays are mostly blocked by the same ones, so queries test
+// them before walking the BVHs.
+struct Occluder {
+	int type = -1;
+	uint32_t first = 0;
+	uint32_t count = 0;
+};
+
+// Puts a ray in one lane of a packet. The float copy is rounded as
+// PrimitiveStore rounds a single ray.
+void set_lane(RayPacket& rays, int lane, const Vec3& origin, const Vec3& direct) {
+	const double o[3] = { origin.x, origin.y, origin.z };
+	const double d[3] = { direct.x, direct.y, direct.z };
+	for (int k = 0; k < 3; ++k) {
+		rays.origin[k][lane] = o[k];
+		rays.direct[k][lane] = d[k];
+		rays.inverse[k][lane] = 1.0 / d[k];
+		rays.originF[k][lane] = static_cast<float>(o[k]);
+		rays.directF[k][lane] = static_cast<float>(d[k]);
+	}
+	rays.lanes |= 1u << lane;
+}
+
+// The shapes of a scene regrouped by type, with one array per field, so an
+// intersection test walks contiguous memory and computes only a distance.
+// Every type but planes has its own BVH and keeps its arrays in that BVH's
+// order, which makes each leaf a single run of them; planes have no bounds
+// and are tested as one run against every ray. Only the closest hit is
+// turned into a Hit, from the shape it came from.
+//
+// Packets of rays walk each BVH together, testing nodes and primitives with
+// the SIMD kernels for the level the store was made with. At
+// SimdLevel::Scalar every lane is traced as a single ray.
+class PrimitiveStore {
+public:
+	PrimitiveStore(const vector<unique_ptr<Shape>>& shapes, SimdLevel level) : shapes(shapes), kernels(select_packet_kernels(level)) {
+		for (int i = 0; i < static_cast<int>(shapes.size()); ++i) {
+			order[static_cast<int>(shapes[i]->type)].push_back(i);
+		}
+		for (int type = 0; type < SHAPE_TYPES; ++type) {
+			vector<int>& group = order[type];
+			if (static_cast<ShapeType>(type) == ShapeType::Plane || group.empty()) {
+				continue;
+			}
+			vector<AABB> boxes(group.size());
+			for (size_t i = 0; i < group.size(); ++i) {
+				shapes[group[i]]->bounds(boxes[i]);
+			}
+			bvh[type].build(boxes);
+			vector<int> sorted;
+			for (uint32_t i : bvh[type].getOrder()) {
+				sorted.push_back(group[i]);
+			}
+			group.swap(sorted);
+		}
+
+		for (int i : order[static_cast<int>(ShapeType::Sphere)]) {
+			const Sphere& sphere = static_cast<const Sphere&>(*shapes[i]);
+			sphereCenter.push_back(sphere.position);
+			sphereRadius.push_back(sphere.scale.x);
+		}
+		for (int i : order[static_cast<int>(ShapeType::Ellipsoid)]) {
+			const Ellipsoid& ellipsoid = static_cast<const Ellipsoid&>(*shapes[i]);
+			ellipsoidCenter.push_back(ellipsoid.position);
+			ellipsoidScale.push_back(ellipsoid.scale);
+		}
+		for (int i : order[static_cast<int>(ShapeType::Plane)]) {
+			const Plane& plane = static_cast<const Plane&>(*shapes[i]);
+			planePoint.push_back(plane.position);
+			planeNormal.push_back(plane.normal);
+		}
+		for (int i : order[static_cast<int>(ShapeType::Cube)]) {
+			const Cube& cube = static_cast<const Cube&>(*shapes[i]);
+			cubeMin.push_back(cube.position - Vec3(cube.size / 2, cube.size / 2, cube.size / 2));
+			cubeMax.push_back(cube.position + Vec3(cube.size / 2, cube.size / 2, cube.size / 2));
+		}
+		for (int i : order[static_cast<int>(ShapeType::Triangle)]) {
+			const Triangle& triangle = static_cast<const Triangle&>(*shapes[i]);
+			triangleVert0.push_back(triangle.vert0);
+			triangleEdge1.push_back(triangle.vert1 - triangle.vert0);
+			triangleEdge2.push_back(triangle.vert2 - triangle.vert0);
+		}
+
+		static_assert(sizeof(Vec3) == 3 * sizeof(double) && sizeof(glm::vec3) == 3 * sizeof(float), "the kernels read fields as packed triples");
+		sphereSpan = { reinterpret_cast<const double*>(sphereCenter.data()), sphereRadius.data(), order[static_cast<int>(ShapeType::Sphere)].data(), static_cast<int>(ShapeType::Sphere) };
+		ellipsoidSpan = { reinterpret_cast<const double*>(ellipsoidCenter.data()), reinterpret_cast<const double*>(ellipsoidScale.data()), order[static_cast<int>(ShapeType::Ellipsoid)].data(), static_cast<int>(ShapeType::Ellipsoid) };
+		cubeSpan = { reinterpret_cast<const double*>(cubeMin.data()), reinterpret_cast<const double*>(cubeMax.data()), order[static_cast<int>(ShapeType::Cube)].data(), static_cast<int>(ShapeType::Cube) };
+		planeSpan = { reinterpret_cast<const double*>(planePoint.data()), reinterpret_cast<const double*>(planeNormal.data()), order[static_cast<int>(ShapeType::Plane)].data(), static_cast<int>(ShapeType::Plane) };
+		triangleSpan = { reinterpret_cast<const float*>(triangleVert0.data()), reinterpret_cast<const float*>(triangleEdge1.data()), reinterpret_cast<const float*>(triangleEdge2.data()), order[static_cast<int>(ShapeType::Triangle)].data(), static_cast<int>(ShapeType::Triangle) };
+	}
+
+	// The nearest hit along the ray and its shape. Equal distances go to the
+	// shape added first, as when every shape was tested in order.
+	optional<Hit> closestHit(const Vec3& rayOrigin, const Vec3& rayDirect, const Shape*& hitShape) const {
+		Ray ray(rayOrigin, rayDirect);
+		ShapeType closestType = ShapeType::Sphere;
+		int closestShape = -1;
+		double closestT = numeric_limits<double>::infinity(), closestU = 0.0, closestV = 0.0;
+		for (int type = 0; type < SHAPE_TYPES; ++type) {
+			auto keep = [&](uint32_t i, double t, double u, double v) {
+				int shape = order[type][i];
+				if (t < closestT || (t == closestT && shape < closestShape)) {
+					closestType = static_cast<ShapeType>(type);
+					closestShape = shape;
+					closestT = t;
+					closestU = u;
+					closestV = v;
+				}
+				return false;
+			};
+			walk(type, ray, closestT, keep);
+		}
+		if (closestShape < 0) {
+			hitShape = nullptr;
+			return nullopt;
+		}
+		hitShape = shapes[closestShape].get();
+		return makeHit(closestType, *hitShape, ray, closestT, closestU, closestV);
+	}
+
+	// Whether any shape is hit closer than maxDist, trying last first and
+	// recording the blocker in it.
+	bool anyHit(const Vec3& rayOrigin, const Vec3& rayDirect, double maxDist, Occluder& last) const {
+		Ray ray(rayOrigin, rayDirect);
+		auto occludes = [&](uint32_t, double t, double, double) {
+			return t < maxDist;
+		};
+		if (last.count > 0 && batch(static_cast<ShapeType>(last.type), last.first, last.count, ray, occludes)) {
+			return true;
+		}
+		for (int type = 0; type < SHAPE_TYPES; ++type) {
+			auto record = [&](uint32_t i, double t, double, double) {
+				if (t < maxDist) {
+					last = { type, i, 1 };
+					return true;
+				}
+				return false;
+			};
+			double tMax = maxDist;
+			if (walk(type, ray, tMax, record)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// closestHit for every lane of the packet. Lanes without a hit are left
+	// with shape -1.
+	void closestHits(const RayPacket& rays, PacketHits& hits) const {
+		for (int lane = 0; lane < PACKET_SIZE; ++lane) {
+			hits.t[lane] = numeric_limits<double>::infinity();
+			hits.shape[lane] = -1;
+		}
+		if (!kernels) {
+			for (int lane = 0; lane < PACKET_SIZE; ++lane) {
+				if (rays.lanes >> lane & 1) {
+					closestLane(rays, lane, hits);
+				}
+			}
+			return;
+		}
+		double lead[3];
+		for (int type = 0; type < SHAPE_TYPES; ++type) {
+			if (order[type].empty()) {
+				continue;
+			}
+			auto test = [&](uint32_t first, uint32_t count, unsigned mask) {
+				closestBatch(type, rays, mask, first, count, hits);
+			};
+			if (static_cast<ShapeType>(type) == ShapeType::Plane) {
+				test(0, static_cast<uint32_t>(order[type].size()), rays.lanes);
+			}
+			else {
+				unsigned lanes = rays.lanes;
+				bvh[type].intersectPacket(leadDirection(rays, lead), lanes, [&](const BVHNode& node, unsigned mask) {
+					return enter(rays, mask, node, hits.t);
+				}, test);
+			}
+		}
+	}
+
+	// The Hit of one lane after closestHits, as closestHit returns it.
+	optional<Hit> laneHit(const RayPacket& rays, const PacketHits& hits, int lane, const Shape*& hitShape) const {
+		if (hits.shape[lane] < 0) {
+			hitShape = nullptr;
+			return nullopt;
+		}
+		hitShape = shapes[hits.shape[lane]].get();
+		return makeHit(static_cast<ShapeType>(hits.type[lane]), *hitShape, laneRay(rays, lane), hits.t[lane], hits.u[lane], hits.v[lane]);
+	}
+
+	// The lanes of the packet that hit a shape closer than their maxDist,
+	// with last used as by anyHit.
+	unsigned anyHits(const RayPacket& rays, const double* maxDist, Occluder& last) const {
+		if (!kernels) {
+			unsigned occluded = 0;
+			for (int lane = 0; lane < PACKET_SIZE; ++lane) {
+				if (!(rays.lanes >> lane & 1)) {
+					continue;
+				}
+				const Ray ray = laneRay(rays, lane);
+				if (anyHit(ray.origin, ray.direct, maxDist[lane], last)) {
+					occluded |= 1u << lane;
+				}
+			}
+			return occluded;
+		}
+		unsigned open = rays.lanes;
+		if (last.count > 0) {
+			open &= ~occludedBatch(last.type, rays, open, maxDist, last.first, last.count);
+		}
+		double lead[3];
+		for (int type = 0; type < SHAPE_TYPES && open != 0; ++type) {
+			if (order[type].empty()) {
+				continue;
+			}
+			auto test = [&](uint32_t first, uint32_t count, unsigned mask) {
+				unsigned blocked = occludedBatch(type, rays, mask, maxDist, first, count);
+				if (blocked != 0) {
+					open &= ~blocked;
+					last = { type, first, count };
+				}
+			};
+			if (static_cast<ShapeType>(type) == ShapeType::Plane) {
+				test(0, static_cast<uint32_t>(order[type].size()), open);
+			}
+			else {
+				bvh[type].intersectPacket(leadDirection(rays, lead), open, [&](const BVHNode& node, unsigned mask) {
+					return enter(rays, mask, node, maxDist);
+				}, test);
+			}
+		}
+		return rays.lanes & ~open;
+	}
+
+private:
+	// The ray as every kernel wants it; triangles are tested in float.
+	struct Ray {
+		Vec3 origin, direct;
+		glm::vec3 originF, directF;
+		double o[3], d[3];
+
+		Ray(const Vec3& origin, const Vec3& direct) : origin(origin), direct(direct),
+			originF(origin.x, origin.y, origin.z), directF(direct.x, direct.y, direct.z),
+			o{ origin.x, origin.y, origin.z }, d{ direct.x, direct.y, direct.z } {}
+	};
+
+	static Ray laneRay(const RayPacket& rays, int lane) {
+		return Ray(Vec3(rays.origin[0][lane], rays.origin[1][lane], rays.origin[2][lane]), Vec3(rays.direct[0][lane], rays.direct[1][lane], rays.direct[2][lane]));
+	}
+
+	// Direction of the first ray, which orders the BVH walk of the packet.
+	static const double* leadDirection(const RayPacket& rays, double* direction) {
+		int lane = 0;
+		while (lane + 1 < PACKET_SIZE && !(rays.lanes >> lane & 1)) {
+			++lane;
+		}
+		for (int k = 0; k < 3; ++k) {
+			direction[k] = rays.direct[k][lane];
+		}
+		return direction;
+	}
+
+	// Without kernels a lane is traced on its own: a walk shared by the
+	// packet visits every node any of its rays enters.
+	void closestLane(const RayPacket& rays, int lane, PacketHits& hits) const {
+		const Ray ray = laneRay(rays, lane);
+		for (int type = 0; type < SHAPE_TYPES; ++type) {
+			auto keep = [&](uint32_t i, double t, double u, double v) {
+				int shape = order[type][i];
+				if (t < hits.t[lane] || (t == hits.t[lane] && shape < hits.shape[lane])) {
+					hits.t[lane] = t;
+					hits.u[lane] = u;
+					hits.v[lane] = v;
+					hits.shape[lane] = shape;
+					hits.type[lane] = type;
+					hits.slot[lane] = i;
+				}
+				return false;
+			};
+			walk(type, ray, hits.t[lane], keep);
+		}
+	}
+
+	unsigned enter(const RayPacket& rays, unsigned lanes, const BVHNode& node, const double* tMax) const {
+		return kernels->enterBox(rays, lanes, node.lo, node.hi, tMax);
+	}
+
+	void closestBatch(int type, const RayPacket& rays, unsigned lanes, uint32_t first, uint32_t count, PacketHits& hits) const {
+		switch (static_cast<ShapeType>(type)) {
+		case ShapeType::Sphere:
+			kernels->closestSpheres(rays, lanes, sphereSpan, first, count, hits);
+			break;
+		case ShapeType::Ellipsoid:
+			kernels->closestEllipsoids(rays, lanes, ellipsoidSpan, first, count, hits);
+			break;
+		case ShapeType::Plane:
+			kernels->closestPlanes(rays, lanes, planeSpan, first, count, hits);
+			break;
+		case ShapeType::Cube:
+			kernels->closestCubes(rays, lanes, cubeSpan, first, count, hits);
+			break;
+		case ShapeType::Triangle:
+			kernels->closestTriangles(rays, lanes, triangleSpan, first, count, hits);
+			break;
+		}
+	}
+
+	unsigned occludedBatch(int type, const RayPacket& rays, unsigned lanes, const double* maxDist, uint32_t first, uint32_t count) const {
+		switch (static_cast<ShapeType>(type)) {
+		case ShapeType::Sphere:
+			return kernels->occludedSpheres(rays, lanes, maxDist, sphereSpan, first, count);
+		case ShapeType::Ellipsoid:
+			return kernels->occludedEllipsoids(rays, lanes, maxDist, ellipsoidSpan, first, count);
+		case ShapeType::Plane:
+			return kernels->occludedPlanes(rays, lanes, maxDist, planeSpan, first, count);
+		case ShapeType::Cube:
+			return kernels->occludedCubes(rays, lanes, maxDist, cubeSpan, first, count);
+		case ShapeType::Triangle:
+			return kernels->occludedTriangles(rays, lanes, maxDist, triangleSpan, first, count);
+		}
+		return 0;
+	}
+
+	// Offers every hit of one type to found(i, t, u, v) through the BVH, or
+	// all of them for planes; i is the position in the type's arrays and u,
+	// v are barycentrics for triangles. found returns true to stop.
+	template <typename Found>
+	bool walk(int type, const Ray& ray, double& tMax, Found found) const {
+		if (order[type].empty()) {
+			return false;
+		}
+		if (static_cast<ShapeType>(type) == ShapeType::Plane) {
+			return batch(ShapeType::Plane, 0, static_cast<uint32_t>(order[type].size()), ray, found);
+		}
+		bool stopped = false;
+		bvh[type].intersect(ray.o, ray.d, tMax, [&](uint32_t first, uint32_t count, double&) {
+			stopped = batch(static_cast<ShapeType>(type), first, count, ray, found);
+			return stopped;
+		});
+		return stopped;
+	}
+
+	template <typename Found>
+	bool batch(ShapeType type, uint32_t first, uint32_t count, const Ray& ray, Found& found) const {
+		uint32_t end = first + count;
+		double t, u = 0.0, v = 0.0;
+		switch (type) {
+		case ShapeType::Sphere:
+			for (uint32_t i = first; i < end; ++i) {
+				if (hitSphere(i, ray, t) && found(i, t, u, v)) {
+					return true;
+				}
+			}
+			break;
+		case ShapeType::Ellipsoid:
+			for (uint32_t i = first; i < end; ++i) {
+				if (hitEllipsoid(i, ray, t) && found(i, t, u, v)) {
+					return true;
+				}
+			}
+			break;
+		case ShapeType::Plane:
+			for (uint32_t i = first; i < end; ++i) {
+				if (hitPlane(i, ray, t) && found(i, t, u, v)) {
+					return true;
+				}
+			}
+			break;
+		case ShapeType::Cube:
+			for (uint32_t i = first; i < end; ++i) {
+				if (hitCube(i, ray, t) && found(i, t, u, v)) {
+					return true;
+				}
+			}
+			break;
+		case ShapeType::Triangle:
+			for (uint32_t i = first; i < end; ++i) {
+				if (intersect_triangle(ray.originF, ray.directF, triangleVert0[i], triangleEdge1[i], triangleEdge2[i], t, u, v) && found(i, t, u, v)) {
+					return true;
+				}
+			}
+			break;
+		}
+		return false;
+	}
+
+	bool hitSphere(uint32_t i, const Ray& ray, double& t) const {
+		Vec3 rayOriginToCenterVec = ray.origin - sphereCenter[i];
+		double a = ray.direct.dot(ray.direct);
+		double b = 2.0 * rayOriginToCenterVec.dot(ray.direct);
+		double c = rayOriginToCenterVec.dot(rayOriginToCenterVec) - (sphereRadius[i] * sphereRadius[i]);
+		double discrim = b * b - 4 * a * c;
+		if (discrim < 0) {
+			return false;
+		}
+		t = (-b - sqrt(discrim)) / (2 * a);
+		if (t < 0) {
+			t = (-b + sqrt(discrim)) / (2 * a);
+		}
+		return t >= 0;
+	}
+
+	bool hitEllipsoid(uint32_t i, const Ray& ray, double& t) const {
+		Vec3 rayOriginToCenterVec = (ray.origin - ellipsoidCenter[i]) / ellipsoidScale[i];
+		Vec3 rayDirectionVec = ray.direct / ellipsoidScale[i];
+		double a = rayDirectionVec.dot(rayDirectionVec);
+		double b = 2.0 * rayOriginToCenterVec.dot(rayDirectionVec);
+		double c = rayOriginToCenterVec.dot(rayOriginToCenterVec) - 1.0;
+		double discrim = b * b - 4 * a * c;
+		if (discrim < 0) {
+			return false;
+		}
+		t = (-b - sqrt(discrim)) / (2 * a);
+		if (t < 0) {
+			t = (-b + sqrt(discrim)) / (2 * a);
 		}
-		return nullopt;
+		return t >= 0;
 	}
 
-	Vec3 normalAt(const Vec3& point) const override {
-		return Vec3(0, 0, 0);
+	bool hitPlane(uint32_t i, const Ray& ray, double& t) const {
+		double denom = planeNormal[i].dot(ray.direct);
+		if (abs(denom) <= EPSILON) {
+			return false;
+		}
+		t = (planePoint[i] - ray.origin).dot(planeNormal[i]) / denom;
+		return t >= 0;
 	}
+
+	// Slab test against the cube's bounds; t is where the ray enters it, or
+	// leaves it when the origin is inside.
+	bool hitCube(uint32_t i, const Ray& ray, double& t) const {
+		const Vec3& minBound = cubeMin[i];
+		const Vec3& maxBound = cubeMax[i];
+
+		double tMin = (minBound.x - ray.origin.x) / ray.direct.x;
+		double tMax = (maxBound.x - ray.origin.x) / ray.direct.x;
+		if (tMin > tMax) swap(tMin, tMax);
+
+		double tyMin = (minBound.y - ray.origin.y) / ray.direct.y;
+		double tyMax = (maxBound.y - ray.origin.y) / ray.direct.y;
+		if (tyMin > tyMax) swap(tyMin, tyMax);
+
+		if ((tMin > tyMax) || (tyMin > tMax))
+			return false;
+
+		if (tyMin > tMin) tMin = tyMin;
+		if (tyMax < tMax) tMax = tyMax;
+
+		double tzMin = (minBound.z - ray.origin.z) / ray.direct.z;
+		double tzMax = (maxBound.z - ray.origin.z) / ray.direct.z;
+		if (tzMin > tzMax) swap(tzMin, tzMax);
+
+		if ((tMin > tzMax) || (tzMin > tMax))
+			return false;
+
+		if (tzMin > tMin) tMin = tzMin;
+		if (tzMax < tMax) tMax = tzMax;
+
+		t = tMin >= 0 ? tMin : tMax;
+		return t >= 0;
+	}
+
+	Hit makeHit(ShapeType type, const Shape& shape, const Ray& ray, double t, double u, double v) const {
+		switch (type) {
+		case ShapeType::Sphere: {
+			Vec3 hitPoint = ray.origin + t * ray.direct;
+			return Hit(t, hitPoint, static_cast<const Sphere&>(shape).normalAt(hitPoint));
+		}
+		case ShapeType::Ellipsoid: {
+			Vec3 hitPoint = ray.origin + t * ray.direct;
+			return Hit(t, hitPoint, static_cast<const Ellipsoid&>(shape).normalAt(hitPoint));
+		}
+		case ShapeType::Plane:
+			return Hit(t, ray.origin + t * ray.direct, static_cast<const Plane&>(shape).normal);
+		case ShapeType::Cube: {
+			Vec3 hitPoint = ray.origin + t * ray.direct;
+			return Hit(t, hitPoint, static_cast<const Cube&>(shape).normalAt(hitPoint));
+		}
+		default: {
+			const Triangle& triangle = static_cast<const Triangle&>(shape);
+			glm::vec3 interpNormal = (1.0f - static_cast<float>(u) - static_cast<float>(v)) * triangle.norm0 +
+				static_cast<float>(u) * triangle.norm1 +
+				static_cast<float>(v) * triangle.norm2;
+			interpNormal = glm::normalize(interpNormal);
+			glm::vec3 hitPoint = ray.originF + static_cast<float>(t) * ray.directF;
+			return Hit(t, Vec3(hitPoint.x, hitPoint.y, hitPoint.z), Vec3(interpNormal.x, interpNormal.y, interpNormal.z));
+		}
+		}
+	}
+
+	const vector<unique_ptr<Shape>>& shapes;
+	const PacketKernels* kernels; // null at SimdLevel::Scalar
+	// The shapes of each type, as indices into shapes, in the order of that
+	// type's arrays.
+	vector<int> order[SHAPE_TYPES];
+	BVH bvh[SHAPE_TYPES]; // empty for planes
+	vector<Vec3> sphereCenter;
+	vector<double> sphereRadius;
+	vector<Vec3> ellipsoidCenter, ellipsoidScale;
+	vector<Vec3> planePoint, planeNormal;
+	vector<Vec3> cubeMin, cubeMax;
+	vector<glm::vec3> triangleVert0, triangleEdge1, triangleEdge2;
+	// The same arrays as the packet kernels take them.
+	SphereSpan sphereSpan;
+	EllipsoidSpan ellipsoidSpan;
+	PlaneSpan planeSpan;
+	CubeSpan cubeSpan;
+	TriangleSpan triangleSpan;
 };
 
 
@@ -474,193 +939,380 @@ double length(const Vec3& v) {
 }
 
 
-bool is_shadowed(const Vec3& point, const Vec3& lightDir, const vector<unique_ptr<Shape>>& shapes, const double lightDist) {
-	for (const auto& shape : shapes) {
-		auto shadowIntersect = shape->intersect(point + lightDir * EPSILON, lightDir);
-		if (shadowIntersect) {
-			Hit shadowHit = shadowIntersect.value();
-			if (shadowHit.s < lightDist) {
-				return true;
-			}
-		}
+// Occluders of the queries a worker thread made last, one for the shadow
+// rays of each light and one for AO rays.
+struct OcclusionCache {
+	vector<Occluder> lights;
+	Occluder ambient;
+};
+
+thread_local OcclusionCache occlusionCache;
+
+Occluder& light_occluder(size_t light) {
+	if (occlusionCache.lights.size() <= light) {
+		occlusionCache.lights.resize(light + 1);
 	}
-	return false;
+	return occlusionCache.lights[light];
 }
 
+bool is_shadowed(const Vec3& point, const Vec3& lightDir, const PrimitiveStore& shapes, const double lightDist, size_t light) {
+	return shapes.anyHit(point + lightDir * EPSILON, lightDir, lightDist, light_occluder(light));
+}
 
-double calculate_ambient_occlusion(const Vec3& hitPoint, const Vec3& normal, const vector<unique_ptr<Shape>>& shapes) {
-	int occludedRays = 0;
-	Vec3 sampRay;
-	for (int i = 0; i < AO_SAMPLES; i++) {
-		sampRay = create_uniform_hemisphere_sample(normal);
-		if (is_shadowed(hitPoint, sampRay, shapes, AO_MAX_DIST)) {
-			occludedRays++;
-		}
+int count_lanes(unsigned lanes) {
+	int count = 0;
+	for (; lanes != 0; lanes &= lanes - 1) {
+		++count;
 	}
-	return static_cast<double>(occludedRays) / AO_SAMPLES;
+	return count;
 }
 
 
-Vec3 trace_ray(const Vec3& rayOrigin, const Vec3& rayDirect, const vector<unique_ptr<Shape>>& shapes, const BoundingSphere& boundingSphere, const vector<Light>& lights, const Vec3& cameraPos, int scene, int depth) {
-	if (depth >= 7) {  //Set to 2 for Scene 4, set to a higher value for Scene 5
-		return Vec3(0.0, 0.0, 0.0);
+double calculate_ambient_occlusion(const Vec3& hitPoint, const Vec3& normal, const PrimitiveStore& shapes, Random& rng, const AOSettings& aoSettings) {
+	// The samples share an origin, so they are traced a packet at a time.
+	int occludedRays = 0;
+	int samples = 0;
+	const double maxDist[PACKET_SIZE] = { AO_MAX_DIST, AO_MAX_DIST, AO_MAX_DIST, AO_MAX_DIST };
+	if (!aoSettings.adaptive) {
+		for (; samples < aoSettings.maxSamples; samples += PACKET_SIZE) {
+			RayPacket rays = {};
+			for (int lane = 0; lane < PACKET_SIZE && samples + lane < aoSettings.maxSamples; ++lane) {
+				Vec3 sampRay = create_uniform_hemisphere_sample(normal, rng);
+				set_lane(rays, lane, hitPoint + sampRay * EPSILON, sampRay);
+			}
+			occludedRays += count_lanes(shapes.anyHits(rays, maxDist, occlusionCache.ambient));
+		}
+		return static_cast<double>(occludedRays) / aoSettings.maxSamples;
 	}
 
-	if (!boundingSphere.intersect(glm::vec3(rayOrigin.x, rayOrigin.y, rayOrigin.z), glm::vec3(rayDirect.x, rayDirect.y, rayDirect.z))) {
-		return Vec3(0.0, 0.0, 0.0); //If ray doesn't intersect the bounding sphere
+	// Every hit shifts the sequence by its own random offset, so the error
+	// left is noise rather than a pattern repeated across the image.
+	double shiftU = rng.uniform();
+	double shiftV = rng.uniform();
+	int minSamples = min(AO_MIN_SAMPLES, aoSettings.maxSamples);
+	while (samples < aoSettings.maxSamples) {
+		RayPacket rays = {};
+		int lanes = min(PACKET_SIZE, aoSettings.maxSamples - samples);
+		for (int lane = 0; lane < lanes; ++lane) {
+			uint32_t i = static_cast<uint32_t>(samples + lane);
+			double u = halton2(i) + shiftU;
+			double v = halton3(i) + shiftV;
+			Vec3 sampRay = create_cosine_hemisphere_sample(normal, u < 1.0 ? u : u - 1.0, v < 1.0 ? v : v - 1.0);
+			set_lane(rays, lane, hitPoint + sampRay * EPSILON, sampRay);
+		}
+		occludedRays += count_lanes(shapes.anyHits(rays, maxDist, occlusionCache.ambient));
+		samples += lanes;
+		if (samples >= minSamples) {
+			// Binomial variance of the fraction: p (1 - p) / samples.
+			double p = static_cast<double>(occludedRays) / samples;
+			if (p * (1.0 - p) <= AO_TOLERANCE * AO_TOLERANCE * samples) {
+				break;
+			}
+		}
 	}
+	return static_cast<double>(occludedRays) / samples;
+}
 
-	Vec3 pixColor(0.0, 0.0, 0.0);
-	double minDist = numeric_limits<double>::infinity();
-
-	for (const auto& shape : shapes) {
-		auto intersectResult = shape->intersect(rayOrigin, rayDirect);
-
-		if (intersectResult) {
-			Hit hit = intersectResult.value();
-			if (hit.s < minDist) {
-				minDist = hit.s;
-				Vec3 accumColor(0.0, 0.0, 0.0);
+// Shadow rays from the hit of every lane in hits toward each light, traced
+// as one packet per light. Bit i of shadowed[k] is set when light k is
+// blocked for lane i.
+void trace_shadow_packets(const optional<Hit>* hits, const PrimitiveStore& shapes, const vector<Light>& lights, vector<unsigned>& shadowed) {
+	shadowed.assign(lights.size(), 0);
+	for (size_t k = 0; k < lights.size(); ++k) {
+		RayPacket rays = {};
+		double maxDist[PACKET_SIZE] = {};
+		for (int lane = 0; lane < PACKET_SIZE; ++lane) {
+			if (hits[lane]) {
+				Vec3 toLight = (lights[k].position - hits[lane]->x).normalize();
+				maxDist[lane] = length(lights[k].position - hits[lane]->x);
+				set_lane(rays, lane, hits[lane]->x + toLight * EPSILON, toLight);
+			}
+		}
+		if (rays.lanes != 0) {
+			shadowed[k] = shapes.anyHits(rays, maxDist, light_occluder(k));
+		}
+	}
+}
 
-				TexturedSphere* texturedSphere = dynamic_cast<TexturedSphere*>(shape.get());
-				if (texturedSphere != nullptr) {
-					glm::vec3 texColor = texturedSphere->getColorFromTexture(hit.x);
-					Vec3 baseColor(texColor.r, texColor.g, texColor.b);
 
-					for (const auto& light : lights) {
-						Vec3 toLight = (light.position - hit.x).normalize();
-						double lightDist = length(light.position - hit.x);
+// Light reaching the hit from every light, before reflection.
+// shadowed(k, toLight, lightDist) says whether light k is blocked.
+template <typename Shadowed>
+Vec3 shade_hit(const Hit& hit, const Shape* shape, const vector<Light>& lights, const Vec3& cameraPos, int scene, Shadowed shadowed) {
+	Vec3 accumColor(0.0, 0.0, 0.0);
 
-						if (!is_shadowed(hit.x, toLight, shapes, lightDist)) {
-							accumColor = accumColor + blinnPhong(hit.n, hit.x, light, baseColor, texturedSphere->specular, texturedSphere->ambient, texturedSphere->exponent, cameraPos);
-						}
-						else {
-							accumColor = accumColor + texturedSphere->ambient * baseColor;
-						}
-					}
-				}
-				else {
-					for (const auto& light : lights) {
-						Vec3 toLight = (light.position - hit.x).normalize();
-						double lightDist = length(light.position - hit.x);
-
-						if (!is_shadowed(hit.x, toLight, shapes, lightDist) || scene == 1) {
-							accumColor = accumColor + blinnPhong(hit.n, hit.x, light, shape->diffuse, shape->specular, shape->ambient, shape->exponent, cameraPos);
-						}
-						else {
-							accumColor = accumColor + shape->ambient;
-						}
-					}
-				}
+	const TexturedSphere* texturedSphere = dynamic_cast<const TexturedSphere*>(shape);
+	if (texturedSphere != nullptr) {
+		glm::vec3 texColor = texturedSphere->getColorFromTexture(hit.x);
+		Vec3 baseColor(texColor.r, texColor.g, texColor.b);
 
-				if (shape->reflectiveness > 0) {
-					Vec3 reflectDirect = rayDirect - 2 * rayDirect.dot(hit.n) * hit.n;
-					Vec3 reflectOrigin = hit.x + EPSILON * reflectDirect;
-					Vec3 reflectedColor = trace_ray(reflectOrigin, reflectDirect, shapes, boundingSphere, lights, reflectOrigin, scene, depth + 1);
-					accumColor = (1 - shape->reflectiveness) * accumColor + shape->reflectiveness * reflectedColor;
-				}
+		for (size_t k = 0; k < lights.size(); ++k) {
+			const Light& light = lights[k];
+			Vec3 toLight = (light.position - hit.x).normalize();
+			double lightDist = length(light.position - hit.x);
 
-				pixColor = accumColor;
+			if (!shadowed(k, toLight, lightDist)) {
+				accumColor = accumColor + blinnPhong(hit.n, hit.x, light, baseColor, texturedSphere->specular, texturedSphere->ambient, texturedSphere->exponent, cameraPos);
+			}
+			else {
+				accumColor = accumColor + texturedSphere->ambient * baseColor;
 			}
 		}
 	}
+	else {
+		for (size_t k = 0; k < lights.size(); ++k) {
+			const Light& light = lights[k];
+			Vec3 toLight = (light.position - hit.x).normalize();
+			double lightDist = length(light.position - hit.x);
 
-	return pixColor;
+			if (!shadowed(k, toLight, lightDist) || scene == 1) {
+				accumColor = accumColor + blinnPhong(hit.n, hit.x, light, shape->diffuse, shape->specular, shape->ambient, shape->exponent, cameraPos);
+			}
+			else {
+				accumColor = accumColor + shape->ambient;
+			}
+		}
+	}
+	return accumColor;
 }
 
 
-Vec3 trace_ray_scene9(const Vec3& rayOrigin, const Vec3& rayDirect, const vector<unique_ptr<Shape>>& shapes, const BoundingSphere& boundingSphere, const vector<Light>& lights, const Vec3& cameraPos, int depth) {
-	if (depth >= 7) {  //Set to 2 for Scene 4, set to higher value for Scene 5
-		return Vec3(0.0, 0.0, 0.0);
-	}
+// How deep reflections go. Rays at maxDepth or beyond, the primary ones
+// being at depth 0, see black. With roulette above 0, a path whose
+// throughput, the share of its color that reaches the pixel, falls below
+// roulette goes on only at random, with probability throughput / roulette,
+// and is weighted up to make up for the paths cut.
+struct BounceSettings {
+	int maxDepth = 7;
+	double roulette = 0;
+};
+
+const int MAX_DEPTH = 64;
 
-	if (!boundingSphere.intersect(glm::vec3(rayOrigin.x, rayOrigin.y, rayOrigin.z), glm::vec3(rayDirect.x, rayDirect.y, rayDirect.z))) {
-		return Vec3(0.0, 0.0, 0.0); //If ray doesn't intersect the bounding sphere
+// One hit on the way down a reflection path: its own color, and how it is
+// mixed with the color of the path below it.
+struct Bounce {
+	Vec3 local;
+	double localRatio;
+	double reflectRatio;
+	double weight; // undoes the Russian roulette cut below this hit
+};
+
+// Whether a path with the given throughput goes on, and if so the weight
+// that keeps it unbiased.
+bool survives_roulette(double& throughput, const BounceSettings& bounces, Random& rng, double& weight) {
+	if (throughput >= bounces.roulette) {
+		return true;
+	}
+	double survival = throughput / bounces.roulette;
+	if (rng.uniform() >= survival) {
+		return false;
 	}
+	weight = 1.0 / survival;
+	throughput = bounces.roulette;
+	return true;
+}
 
-	Vec3 pixColor(0.0, 0.0, 0.0);
-	double minDist = numeric_limits<double>::infinity();
+// Follows the mirror reflections from an already shaded hit, one ray at a
+// time: reflected rays scatter too much to keep sharing a packet. The
+// levels go on a fixed stack on the way down and are mixed on the way up,
+// in the order a recursive tracer would mix them.
+//
+// mix(shape, localRatio, reflectRatio) says whether a hit on shape is mixed
+// with what it reflects, and how; only reflective shapes are followed.
+// shade(hit, shape, cameraPos) gives the color of every later hit.
+template <typename Mix, typename Shade>
+Vec3 trace_reflections(const Vec3& accumColor, const Vec3& rayDirect, const Hit& hit, const Shape* shape, const PrimitiveStore& shapes, const BoundingSphere& boundingSphere, const BounceSettings& bounces, Random& rng, Mix mix, Shade shade) {
+	Bounce stack[MAX_DEPTH];
+	int top = 0;
+	Vec3 color = accumColor;
+	Hit current = hit;
+	Vec3 direct = rayDirect;
+	double throughput = 1.0;
+	for (int depth = 0; ; ++depth) {
+		Bounce level = { color, 0.0, 0.0, 1.0 };
+		if (!mix(shape, level.localRatio, level.reflectRatio)) {
+			break;
+		}
+		color = Vec3(0.0, 0.0, 0.0);
+		throughput *= level.reflectRatio;
+		bool follow = shape->reflectiveness > 0 && depth + 1 < bounces.maxDepth;
+		if (follow && bounces.roulette > 0) {
+			follow = survives_roulette(throughput, bounces, rng, level.weight);
+		}
+		stack[top++] = level;
+		if (!follow) {
+			break;
+		}
+
+		Vec3 reflectDirect = direct - 2 * direct.dot(current.n) * current.n;
+		Vec3 reflectOrigin = current.x + EPSILON * reflectDirect;
+		if (!boundingSphere.intersect(glm::vec3(reflectOrigin.x, reflectOrigin.y, reflectOrigin.z), glm::vec3(reflectDirect.x, reflectDirect.y, reflectDirect.z))) {
+			break;
+		}
+		auto next = shapes.closestHit(reflectOrigin, reflectDirect, shape);
+		if (!next) {
+			break;
+		}
+		current = next.value();
+		direct = reflectDirect;
+		color = shade(current, shape, reflectOrigin);
+	}
+	while (top > 0) {
+		const Bounce& level = stack[--top];
+		color = level.localRatio * level.local + level.reflectRatio * (level.weight * color);
+	}
+	return color;
+}
 
-	for (const auto& shape : shapes) {
-		auto intersectResult = shape->intersect(rayOrigin, rayDirect);
-		if (intersectResult) {
-			Hit hit = intersectResult.value();
-			if (hit.s < minDist) {
-				minDist = hit.s;
-				Vec3 accumColor(0.0, 0.0, 0.0);
+// Scenes 0-8 blend a reflective shape with what it reflects by its
+// reflectiveness.
+Vec3 add_reflection(const Vec3& accumColor, const Vec3& rayDirect, const Hit& hit, const Shape* shape, const PrimitiveStore& shapes, const BoundingSphere& boundingSphere, const vector<Light>& lights, int scene, const BounceSettings& bounces, Random& rng) {
+	auto mix = [](const Shape* shape, double& localRatio, double& reflectRatio) {
+		if (shape->reflectiveness <= 0) {
+			return false;
+		}
+		localRatio = 1 - shape->reflectiveness;
+		reflectRatio = shape->reflectiveness;
+		return true;
+	};
+	auto shade = [&](const Hit& hit, const Shape* shape, const Vec3& cameraPos) {
+		return shade_hit(hit, shape, lights, cameraPos, scene, [&](size_t k, const Vec3& toLight, double lightDist) {
+			return is_shadowed(hit.x, toLight, shapes, lightDist, k);
+		});
+	};
+	return trace_reflections(accumColor, rayDirect, hit, shape, shapes, boundingSphere, bounces, rng, mix, shade);
+}
 
-				double ao = calculate_ambient_occlusion(hit.x, hit.n, shapes);
+// Colors of up to four rays from one origin. The nearest hits and the
+// shadow rays are traced as packets, the reflections per lane; every lane
+// gets the color it would get on its own.
+void trace_packet(const Vec3& rayOrigin, const Vec3* rayDirects, int count, const PrimitiveStore& shapes, const BoundingSphere& boundingSphere, const vector<Light>& lights, const Vec3& cameraPos, int scene, const BounceSettings& bounces, Random* rngs, Vec3* colors) {
+	RayPacket rays = {};
+	for (int lane = 0; lane < count; ++lane) {
+		if (boundingSphere.intersect(glm::vec3(rayOrigin.x, rayOrigin.y, rayOrigin.z), glm::vec3(rayDirects[lane].x, rayDirects[lane].y, rayDirects[lane].z))) {
+			set_lane(rays, lane, rayOrigin, rayDirects[lane]);
+		}
+	}
+	PacketHits packetHits;
+	shapes.closestHits(rays, packetHits);
+	optional<Hit> hits[PACKET_SIZE];
+	const Shape* hitShapes[PACKET_SIZE];
+	for (int lane = 0; lane < PACKET_SIZE; ++lane) {
+		hits[lane] = shapes.laneHit(rays, packetHits, lane, hitShapes[lane]);
+	}
+	vector<unsigned> shadowed;
+	trace_shadow_packets(hits, shapes, lights, shadowed);
 
+	for (int lane = 0; lane < count; ++lane) {
+		if (!hits[lane]) {
+			colors[lane] = Vec3(0.0, 0.0, 0.0);
+			continue;
+		}
+		Vec3 accumColor = shade_hit(*hits[lane], hitShapes[lane], lights, cameraPos, scene, [&](size_t k, const Vec3&, double) {
+			return (shadowed[k] >> lane & 1) != 0;
+		});
+		colors[lane] = add_reflection(accumColor, rayDirects[lane], *hits[lane], hitShapes[lane], shapes, boundingSphere, lights, scene, bounces, rngs[lane]);
+	}
+}
 
-				Vec3 ambientAO = shape->diffuse * shape->ambient * (1.0 - ao);
 
-				for (const auto& light : lights) {
-					Vec3 toLight = (light.position - hit.x).normalize();
-					double lightDist = length(light.position - hit.x);
+// shade_hit for scene 9, whose ambient term is darkened by ambient occlusion.
+template <typename Shadowed>
+Vec3 shade_hit_scene9(const Hit& hit, const Shape* shape, double ao, const vector<Light>& lights, const Vec3& cameraPos, Shadowed shadowed) {
+	Vec3 accumColor(0.0, 0.0, 0.0);
+	Vec3 ambientAO = shape->diffuse * shape->ambient * (1.0 - ao);
 
-					if (!is_shadowed(hit.x, toLight, shapes, lightDist)) {
-						accumColor = accumColor + blinnPhong(hit.n, hit.x, light, shape->diffuse, shape->specular, ambientAO, shape->exponent, cameraPos);
-					}
-					else {
-						accumColor = accumColor + ambientAO;
-					}
-				}
-				Vec3 reflectedColor(0.0, 0.0, 0.0);
-				if (shape->reflectiveness > 0) {
-					Vec3 reflectDirect = rayDirect - 2 * rayDirect.dot(hit.n) * hit.n;
-					Vec3 reflectOrigin = hit.x + EPSILON * reflectDirect;
-					reflectedColor = trace_ray_scene9(reflectOrigin, reflectDirect, shapes, boundingSphere, lights, reflectOrigin, depth + 1);
-				}
+	for (size_t k = 0; k < lights.size(); ++k) {
+		const Light& light = lights[k];
+		Vec3 toLight = (light.position - hit.x).normalize();
+		double lightDist = length(light.position - hit.x);
 
-				double reflectionRatio = 0.3;
-				double localRatio = 0.7;
-				pixColor = localRatio * accumColor + reflectionRatio * reflectedColor;
-			}
+		if (!shadowed(k, toLight, lightDist)) {
+			accumColor = accumColor + blinnPhong(hit.n, hit.x, light, shape->diffuse, shape->specular, ambientAO, shape->exponent, cameraPos);
+		}
+		else {
+			accumColor = accumColor + ambientAO;
 		}
 	}
-	return pixColor;
+	return accumColor;
 }
 
 
-bool loadMesh(const string& meshName, vector<unique_ptr<Shape>>& shapes, BoundingSphere& boundingSphere, const Vec3& materialDiffuse, const Vec3& materialSpecular, const Vec3& materialAmbient, double exponent) {
-	tinyobj::attrib_t attrib;
-	vector<tinyobj::shape_t> lShapes;
-	vector<tinyobj::material_t> materials;
-	string err;
-
-	tinyobj::LoadObj(&attrib, &lShapes, &materials, &err, meshName.c_str());
+// Scene 9 keeps 0.7 of every hit's own color and adds 0.3 of what it
+// reflects, black for shapes that do not reflect.
+Vec3 add_reflection_scene9(const Vec3& accumColor, const Vec3& rayDirect, const Hit& hit, const Shape* shape, const PrimitiveStore& shapes, const BoundingSphere& boundingSphere, const vector<Light>& lights, Random& rng, const AOSettings& aoSettings, const BounceSettings& bounces) {
+	auto mix = [](const Shape*, double& localRatio, double& reflectRatio) {
+		localRatio = 0.7;
+		reflectRatio = 0.3;
+		return true;
+	};
+	auto shade = [&](const Hit& hit, const Shape* shape, const Vec3& cameraPos) {
+		double ao = calculate_ambient_occlusion(hit.x, hit.n, shapes, rng, aoSettings);
+		return shade_hit_scene9(hit, shape, ao, lights, cameraPos, [&](size_t k, const Vec3& toLight, double lightDist) {
+			return is_shadowed(hit.x, toLight, shapes, lightDist, k);
+		});
+	};
+	return trace_reflections(accumColor, rayDirect, hit, shape, shapes, boundingSphere, bounces, rng, mix, shade);
+}
 
-	glm::vec3 minV(numeric_limits<float>::max());
-	glm::vec3 maxV(-numeric_limits<float>::max());
+// trace_packet for scene 9. Each lane draws its occlusion samples from its
+// own generator, hit by hit down its reflections.
+void trace_packet_scene9(const Vec3& rayOrigin, const Vec3* rayDirects, int count, const PrimitiveStore& shapes, const BoundingSphere& boundingSphere, const vector<Light>& lights, const Vec3& cameraPos, Random* rngs, const AOSettings& aoSettings, const BounceSettings& bounces, Vec3* colors) {
+	RayPacket rays = {};
+	for (int lane = 0; lane < count; ++lane) {
+		if (boundingSphere.intersect(glm::vec3(rayOrigin.x, rayOrigin.y, rayOrigin.z), glm::vec3(rayDirects[lane].x, rayDirects[lane].y, rayDirects[lane].z))) {
+			set_lane(rays, lane, rayOrigin, rayDirects[lane]);
+		}
+	}
+	PacketHits packetHits;
+	shapes.closestHits(rays, packetHits);
+	optional<Hit> hits[PACKET_SIZE];
+	const Shape* hitShapes[PACKET_SIZE];
+	for (int lane = 0; lane < PACKET_SIZE; ++lane) {
+		hits[lane] = shapes.laneHit(rays, packetHits, lane, hitShapes[lane]);
+	}
+	vector<unsigned> shadowed;
+	trace_shadow_packets(hits, shapes, lights, shadowed);
 
-	for (const auto& shape : lShapes) {
-		size_t index_offset = 0;
-		for (size_t f = 0; f < shape.mesh.num_face_vertices.size(); f++) {
-			int fv = shape.mesh.num_face_vertices[f];
-			vector<glm::vec3> vertices;
-			vector<glm::vec3> normals;
+	for (int lane = 0; lane < count; ++lane) {
+		if (!hits[lane]) {
+			colors[lane] = Vec3(0.0, 0.0, 0.0);
+			continue;
+		}
+		double ao = calculate_ambient_occlusion(hits[lane]->x, hits[lane]->n, shapes, rngs[lane], aoSettings);
+		Vec3 accumColor = shade_hit_scene9(*hits[lane], hitShapes[lane], ao, lights, cameraPos, [&](size_t k, const Vec3&, double) {
+			return (shadowed[k] >> lane & 1) != 0;
+		});
+		colors[lane] = add_reflection_scene9(accumColor, rayDirects[lane], *hits[lane], hitShapes[lane], shapes, boundingSphere, lights, rngs[lane], aoSettings, bounces);
+	}
+}
 
-			for (size_t v = 0; v < fv; v++) {
-				tinyobj::index_t idx = shape.mesh.indices[index_offset + v];
-				glm::vec3 vertex(attrib.vertices[3 * idx.vertex_index + 0], attrib.vertices[3 * idx.vertex_index + 1], attrib.vertices[3 * idx.vertex_index + 2]);
-				vertices.push_back(vertex);
-				minV = glm::min(minV, vertex);
-				maxV = glm::max(maxV, vertex);
 
-				if (idx.normal_index >= 0) {
-					glm::vec3 normal(attrib.normals[3 * idx.normal_index + 0], attrib.normals[3 * idx.normal_index + 1], attrib.normals[3 * idx.normal_index + 2]);
-					normals.push_back(normal);
-				}
-				else {
-					normals.push_back(glm::vec3(0, 0, 0));
-				}
-			}
+bool loadMesh(const string& meshName, vector<unique_ptr<Shape>>& shapes, BoundingSphere& boundingSphere, const Vec3& materialDiffuse, const Vec3& materialSpecular, const Vec3& materialAmbient, double exponent) {
+	MeshCache cache;
+	string err;
+	if (!cache.open(meshName, err)) {
+		cerr << err << endl;
+		return false;
+	}
 
-			shapes.push_back(make_unique<Triangle>(vertices[0], vertices[1], vertices[2], normals[0], normals[1], normals[2], materialDiffuse, materialSpecular, materialAmbient, exponent));
-			index_offset += fv;
+	const uint32_t* indices = cache.getIndices();
+	const float* pos[3] = { cache.getPositions(0), cache.getPositions(1), cache.getPositions(2) };
+	const float* nor[3] = { cache.getNormals(0), cache.getNormals(1), cache.getNormals(2) };
+	for (uint32_t i = 0; i + 2 < cache.getIndexCount(); i += 3) {
+		glm::vec3 vertices[3];
+		glm::vec3 normals[3];
+		for (int c = 0; c < 3; c++) {
+			uint32_t v = indices[i + c];
+			vertices[c] = glm::vec3(pos[0][v], pos[1][v], pos[2][v]);
+			normals[c] = cache.hasNormals() ? glm::vec3(nor[0][v], nor[1][v], nor[2][v]) : glm::vec3(0, 0, 0);
 		}
+		shapes.push_back(make_unique<Triangle>(vertices[0], vertices[1], vertices[2], normals[0], normals[1], normals[2], materialDiffuse, materialSpecular, materialAmbient, exponent));
 	}
 
+	glm::vec3 minV = glm::make_vec3(cache.getBoundsMin());
+	glm::vec3 maxV = glm::make_vec3(cache.getBoundsMax());
 	glm::vec3 center = (minV + maxV) * 0.5f;
 	float radius = glm::distance(center, maxV);
 	boundingSphere = BoundingSphere(center, radius);
@@ -673,18 +1325,216 @@ bool loadMesh(const string& meshName, vector<unique_ptr<Shape>>& shapes, Boundin
 
 
 
+// PNG and the other 8-bit formats get the color clamped to [0, 1]; the
+// float plane, when the output has one, keeps it as traced.
+void store_color(unsigned char* rgb, float* linear, const Vec3& color) {
+	rgb[0] = static_cast<unsigned char>(min(max(color.x, 0.0), 1.0) * 255);
+	rgb[1] = static_cast<unsigned char>(min(max(color.y, 0.0), 1.0) * 255);
+	rgb[2] = static_cast<unsigned char>(min(max(color.z, 0.0), 1.0) * 255);
+	if (linear) {
+		linear[0] = static_cast<float>(color.x);
+		linear[1] = static_cast<float>(color.y);
+		linear[2] = static_cast<float>(color.z);
+	}
+}
+
+const int TILE_SIZE = 32;
+
+// Each square tile is one pool task that adds only its own pixels to the
+// accumulator. Every pixel seeds its own generator from its index and the
+// pass number, so the image does not depend on the thread count, on which
+// thread renders which tile, or on where a resumed render stopped.
+//
+// Pixels go to shade(pixels, count, rngs, colors) in 2x2 quads, one packet
+// each. Quads cut by the image edge repeat their first pixel in the unused
+// lanes.
+void render_tiles(Accumulator& accum, WorkStealingPool& pool, uint64_t seed, const function<void(const int*, int, Random*, Vec3*)>& shade) {
+	int width = accum.getWidth();
+	int height = accum.getHeight();
+	int tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+	int tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+	uint64_t firstStream = static_cast<uint64_t>(accum.getPasses()) * width * height;
+	pool.run(tilesX * tilesY, [&](int tile) {
+		int x0 = (tile % tilesX) * TILE_SIZE;
+		int y0 = (tile / tilesX) * TILE_SIZE;
+		int x1 = min(x0 + TILE_SIZE, width);
+		int y1 = min(y0 + TILE_SIZE, height);
+		for (int y = y0; y < y1; y += 2) {
+			for (int x = x0; x < x1; x += 2) {
+				int pixels[PACKET_SIZE];
+				int count = 0;
+				for (int lane = 0; lane < PACKET_SIZE; ++lane) {
+					int px = x + lane % 2, py = y + lane / 2;
+					if (px < x1 && py < y1) {
+						pixels[count++] = py * width + px;
+					}
+				}
+				fill(pixels + count, pixels + PACKET_SIZE, pixels[0]);
+				Random rngs[PACKET_SIZE] = { Random(seed, firstStream + pixels[0]), Random(seed, firstStream + pixels[1]), Random(seed, firstStream + pixels[2]), Random(seed, firstStream + pixels[3]) };
+				Vec3 colors[PACKET_SIZE];
+				shade(pixels, count, rngs, colors);
+				for (int lane = 0; lane < count; ++lane) {
+					const double rgb[3] = { colors[lane].x, colors[lane].y, colors[lane].z };
+					accum.add(pixels[lane], rgb);
+				}
+			}
+		}
+	});
+}
+
+// Puts the mean of the passes so far in the image.
+void resolve_image(const Accumulator& accum, Image& image) {
+	int width = accum.getWidth();
+	for (int py = 0; py < accum.getHeight(); ++py) {
+		unsigned char* row = image.getRow(py);
+		float* linearRow = image.getLinearRow(py);
+		for (int px = 0; px < width; ++px) {
+			double rgb[3];
+			accum.getMean(py * width + px, rgb);
+			store_color(row + 3 * px, linearRow ? linearRow + 3 * px : nullptr, Vec3(rgb[0], rgb[1], rgb[2]));
+		}
+	}
+}
+
+// How many passes to render and when to write what they have so far.
+struct ProgressSettings {
+	int passes = 1;
+	int snapshotPasses = 0;     // 0 for none by count
+	double snapshotSeconds = 0; // 0 for none by time
+	string checkpoint;          // empty for no checkpoint
+};
+
+// Writes image to filename by way of a temporary file with the same
+// extension, so a write cut short leaves the last snapshot whole.
+void write_snapshot(Image& image, const string& filename) {
+	filesystem::path path(filename);
+	filesystem::path tempPath = path;
+	tempPath.replace_extension(".tmp" + path.extension().string());
+	image.writeToFile(tempPath.string());
+	error_code ec;
+	filesystem::rename(tempPath, path, ec);
+	if (ec) {
+		cerr << "Cannot write " << filename << endl;
+	}
+}
+
+// Renders passes with render_tiles until there are progress.passes of them
+// and leaves their mean in the image. With a checkpoint, a render resumes
+// from it if it exists and saves it after every pass, so a render stopped
+// part way loses at most the pass in flight; settings names what else must
+// match for the passes to be added together.
+bool render_passes(Image& image, const string& imageFilename, WorkStealingPool& pool, uint64_t seed, const ProgressSettings& progress, const string& settings, const function<void(const int*, int, Random*, Vec3*)>& shade) {
+	Accumulator accum(image.getWidth(), image.getHeight());
+	string err;
+	if (!progress.checkpoint.empty() && filesystem::exists(progress.checkpoint)) {
+		if (!accum.load(progress.checkpoint, settings, err)) {
+			cerr << err << endl;
+			return false;
+		}
+		cout << "Resuming after pass " << accum.getPasses() << " from " << progress.checkpoint << endl;
+	}
+	auto lastSnapshot = chrono::steady_clock::now();
+	while (accum.getPasses() < progress.passes) {
+		render_tiles(accum, pool, seed, shade);
+		accum.endPass();
+		if (accum.getPasses() == progress.passes) {
+			break;
+		}
+		if (!progress.checkpoint.empty() && !accum.save(progress.checkpoint, settings, err)) {
+			cerr << err << endl;
+		}
+		auto now = chrono::steady_clock::now();
+		bool due = progress.snapshotPasses > 0 && accum.getPasses() % progress.snapshotPasses == 0;
+		due = due || (progress.snapshotSeconds > 0 && chrono::duration<double>(now - lastSnapshot).count() >= progress.snapshotSeconds);
+		if (due) {
+			cout << "Pass " << accum.getPasses() << " of " << progress.passes << endl;
+			resolve_image(accum, image);
+			write_snapshot(image, imageFilename);
+			lastSnapshot = now;
+		}
+	}
+	resolve_image(accum, image);
+	if (!progress.checkpoint.empty() && !accum.save(progress.checkpoint, settings, err)) {
+		cerr << err << endl;
+	}
+	return true;
+}
+
 int main(int argc, char** argv)
 {
 	if (argc < 4) {
-		cout << "Usage: A6 <SCENE> <IMAGE SIZE> <IMAGE FILENAME>" << endl;
+		cout << "Usage: A6 <SCENE> <IMAGE SIZE> <IMAGE FILENAME> [--threads <count>] [--seed <n>] [--simd scalar|avx2] [--ao uniform|adaptive] [--ao-samples <n>]" << endl;
+		cout << "             [--passes <n>] [--snapshot-every <passes>] [--snapshot-seconds <s>] [--checkpoint <file>]" << endl;
+		cout << "             [--max-depth <n>] [--roulette <throughput>]" << endl;
 		cout << "<SCENE> should be 0-9" << endl;
+		cout << "<IMAGE FILENAME> ending in .pfm or .hdr keeps colors above 1; .ppm and .raw skip compression" << endl;
+		cout << "--threads defaults to every hardware thread; --seed picks the ambient occlusion samples" << endl;
+		cout << "--simd caps the packet kernels, which default to the best the CPU has; every level renders the same image" << endl;
+		cout << "--ao adaptive stops sampling ambient occlusion early where it is settled; --ao-samples caps the rays per hit (64)" << endl;
+		cout << "--passes averages that many renders with fresh samples; snapshots rewrite the image on the way" << endl;
+		cout << "--max-depth limits reflections (2 for scene 4, 7 otherwise); --roulette cuts dim reflection paths at random, 0 never" << endl;
+		cout << "--checkpoint is saved after every pass and resumed from when it exists, so an interrupted render can be run again with the same options" << endl;
 		return 0;
 	}
 	int scene = stoi(argv[1]);
 	int imageSize = stoi(argv[2]);
 	string imageFilename(argv[3]);
+	int threadCount = 0;
+	uint64_t seed = 0;
+	SimdLevel simdLevel = detect_simd_level();
+	AOSettings aoSettings;
+	ProgressSettings progress;
+	BounceSettings bounces;
+	// Scenes 4 and 5 differ only in how deep their reflections go.
+	bounces.maxDepth = scene == 4 ? 2 : 7;
+	for (int i = 4; i < argc; ++i) {
+		string arg(argv[i]);
+		if (arg == "--threads" && i + 1 < argc) {
+			threadCount = stoi(argv[++i]);
+		}
+		else if (arg == "--seed" && i + 1 < argc) {
+			seed = stoull(argv[++i]);
+		}
+		else if (arg == "--simd" && i + 1 < argc) {
+			// Never ask for more than the CPU supports.
+			string name(argv[++i]);
+			simdLevel = min(name == "avx2" ? SimdLevel::AVX2 : SimdLevel::Scalar, simdLevel);
+		}
+		else if (arg == "--ao" && i + 1 < argc) {
+			aoSettings.adaptive = string(argv[++i]) == "adaptive";
+		}
+		else if (arg == "--ao-samples" && i + 1 < argc) {
+			aoSettings.maxSamples = max(1, stoi(argv[++i]));
+		}
+		else if (arg == "--passes" && i + 1 < argc) {
+			progress.passes = max(1, stoi(argv[++i]));
+		}
+		else if (arg == "--snapshot-every" && i + 1 < argc) {
+			progress.snapshotPasses = stoi(argv[++i]);
+		}
+		else if (arg == "--snapshot-seconds" && i + 1 < argc) {
+			progress.snapshotSeconds = stod(argv[++i]);
+		}
+		else if (arg == "--max-depth" && i + 1 < argc) {
+			bounces.maxDepth = min(max(1, stoi(argv[++i])), MAX_DEPTH);
+		}
+		else if (arg == "--roulette" && i + 1 < argc) {
+			bounces.roulette = stod(argv[++i]);
+		}
+		else if (arg == "--checkpoint" && i + 1 < argc) {
+			progress.checkpoint = argv[++i];
+		}
+		else {
+			cerr << "Unknown option " << arg << endl;
+			return 1;
+		}
+	}
+	WorkStealingPool pool(threadCount);
 
-	Image image(imageSize, imageSize);
+	Image image(imageSize, imageSize, Image::isFloatFormat(imageFilename));
+	// Everything besides the image size that a checkpoint's passes depend on.
+	string settings = "scene " + to_string(scene) + ", seed " + to_string(seed) + ", " + (aoSettings.adaptive ? "adaptive" : "uniform") + " AO with " + to_string(aoSettings.maxSamples) + " samples, depth " + to_string(bounces.maxDepth) + ", roulette " + to_string(bounces.roulette);
+	bool rendered = false;
 
 
 	vector<unique_ptr<Shape>> shapes;
@@ -706,15 +1556,16 @@ int main(int argc, char** argv)
 		shapes.push_back(make_unique<Sphere>(Vec3(0.0, 1.0, 0.0), Vec3(1.0, 1.0, 1.0), Vec3(0.0, 0.0, 1.0), Vec3(1.0, 1.0, 0.5), Vec3(0.1, 0.1, 0.1), 100.0, 0.0)); //Blue Sphere
 		lights.push_back(Light(Vec3(-2.0, 1.0, 1.0), 1.0));
 
-		
+		PrimitiveStore sceneShapes(shapes, simdLevel);
+		Vec3 origin(cameraPos.x, cameraPos.y, cameraPos.z);
 
-		for (int y = 0; y < imageSize; ++y) {
-			for (int x = 0; x < imageSize; ++x) {
-				Vec3 rayDirect = rays[y * imageSize + x];
-				Vec3 pixColor = trace_ray(Vec3(cameraPos.x, cameraPos.y, cameraPos.z), rayDirect, shapes, boundingSphere, lights, Vec3(cameraPos.x, cameraPos.y, cameraPos.z), scene, 0);
-				image.setPixel(x, y, static_cast<unsigned char>(min(max(pixColor.x, 0.0), 1.0) * 255), static_cast<unsigned char>(min(max(pixColor.y, 0.0), 1.0) * 255), static_cast<unsigned char>(min(max(pixColor.z, 0.0), 1.0) * 255));
+		rendered = render_passes(image, imageFilename, pool, seed, progress, settings, [&](const int* pixels, int count, Random* rngs, Vec3* colors) {
+			Vec3 directs[PACKET_SIZE];
+			for (int lane = 0; lane < count; ++lane) {
+				directs[lane] = rays[pixels[lane]];
 			}
-		}
+			trace_packet(origin, directs, count, sceneShapes, boundingSphere, lights, origin, scene, bounces, rngs, colors);
+		});
 	}
 	else {
 		Vec3 cameraPos(0, 0, 5);
@@ -814,33 +1665,26 @@ int main(int argc, char** argv)
 			shapes.push_back(make_unique<Sphere>(Vec3(1.5, 0.0, -1.5), Vec3(1.0, 1.0, 1.0), Vec3(0.5, 0.0, 0.8), Vec3(0.0, 0.0, 0.0), Vec3(0.1, 0.0, 0.2), 0, 1.0)); //Reflective Sphere 2
 
 		}
-		if (scene < 9) {
-			vector<Vec3> rays = create_rays(imageSize, imageSize, cameraPos, fov, zPlane);
-
-			for (int y = 0; y < imageSize; ++y) {
-				for (int x = 0; x < imageSize; ++x) {
-					Vec3 rayDirect = rays[y * imageSize + x];
-					Vec3 pixColor = trace_ray(cameraPos, rayDirect, shapes, boundingSphere, lights, cameraPos, scene, 0);
-
-					image.setPixel(x, y, static_cast<unsigned char>(min(max(pixColor.x, 0.0), 1.0) * 255), static_cast<unsigned char>(min(max(pixColor.y, 0.0), 1.0) * 255), static_cast<unsigned char>(min(max(pixColor.z, 0.0), 1.0) * 255));
-				}
+		PrimitiveStore sceneShapes(shapes, simdLevel);
+		vector<Vec3> rays = create_rays(imageSize, imageSize, cameraPos, fov, zPlane);
+		rendered = render_passes(image, imageFilename, pool, seed, progress, settings, [&](const int* pixels, int count, Random* rngs, Vec3* colors) {
+			Vec3 directs[PACKET_SIZE];
+			for (int lane = 0; lane < count; ++lane) {
+				directs[lane] = rays[pixels[lane]];
 			}
-		}
-		else {
-			vector<Vec3> rays = create_rays(imageSize, imageSize, cameraPos, fov, zPlane);
-
-			for (int y = 0; y < imageSize; ++y) {
-				for (int x = 0; x < imageSize; ++x) {
-					Vec3 rayDirect = rays[y * imageSize + x];
-					Vec3 pixColor = trace_ray_scene9(cameraPos, rayDirect, shapes, boundingSphere, lights, cameraPos, 0);
-
-					image.setPixel(x, y, static_cast<unsigned char>(min(max(pixColor.x, 0.0), 1.0) * 255), static_cast<unsigned char>(min(max(pixColor.y, 0.0), 1.0) * 255), static_cast<unsigned char>(min(max(pixColor.z, 0.0), 1.0) * 255));
-				}
+			if (scene < 9) {
+				trace_packet(cameraPos, directs, count, sceneShapes, boundingSphere, lights, cameraPos, scene, bounces, rngs, colors);
 			}
-		}
+			else {
+				trace_packet_scene9(cameraPos, directs, count, sceneShapes, boundingSphere, lights, cameraPos, rngs, aoSettings, bounces, colors);
+			}
+		});
 
 	}
 
+	if (!rendered) {
+		return 1;
+	}
 	image.writeToFile(imageFilename);
 
 	cout << "Rendered scene " << scene << " to " << imageFilename << " with size " << imageSize << "x" << imageSize << endl;